@@ -47,6 +47,20 @@ color_t HDRI_Background_t::operator() (const vector3d_t &dir, renderState_t &sta
 	return img->BilerpSample(u, v);
 }
 
+// brightness of the image at the center of every pixel, in map coordinates
+envSampler_t *HDRI_Background_t::buildSampler() const
+{
+	if (img==NULL) return NULL;
+	int w=img->getWidth(), h=img->getHeight();
+	vector<float> lum(w*h);
+	for (int y=0;y<h;y++) {
+		PFLOAT v = (y+0.5)/(PFLOAT)h;
+		for (int x=0;x<w;x++)
+			lum[y*w+x] = img->BilerpSample((x+0.5)/(PFLOAT)w, mapProbe ? v : 1.0-v).energy();
+	}
+	return new envSampler_t(lum, w, h, mapProbe ? envSampler_t::MAP_ANGULAR : envSampler_t::MAP_SPHERE);
+}
+
 background_t *HDRI_Background_t::factory(paramMap_t &params,renderEnvironment_t &render)
 {
 	string _filename;
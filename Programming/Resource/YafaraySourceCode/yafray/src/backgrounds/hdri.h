@@ -18,6 +18,8 @@ class HDRI_Background_t: public background_t
 		virtual color_t operator() (const vector3d_t &dir, renderState_t &state, bool filtered=false) const;
 		static background_t *factory(paramMap_t &,renderEnvironment_t &);
 	protected:
+		virtual envSampler_t *buildSampler() const;
+
 		HDRimage_t* img;
 		bool mapProbe;
 };
@@ -17,7 +17,8 @@ background_t *constBackground_t::factory(paramMap_t &params,renderEnvironment_t
 }
 
 sunskyBackground_t::sunskyBackground_t(const point3d_t dir, PFLOAT turb,
-		PFLOAT a_var, PFLOAT b_var, PFLOAT c_var, PFLOAT d_var, PFLOAT e_var)
+		PFLOAT a_var, PFLOAT b_var, PFLOAT c_var, PFLOAT d_var, PFLOAT e_var, int lutsize)
+	: lutW(0), lutH(0)
 {
 	sunDir.set(dir.x, dir.y, dir.z);
 	sunDir.normalize();
@@ -56,6 +57,20 @@ sunskyBackground_t::sunskyBackground_t(const point3d_t dir, PFLOAT turb,
 	perez_y[2] = (-0.00792 * T + 0.21023) * c_var;
 	perez_y[3] = (-0.04405 * T - 1.65369) * d_var;
 	perez_y[4] = (-0.01092 * T + 0.05291) * e_var;
+
+	// the sky only depends on the direction from here on, tabulate it
+	if (lutsize>1) {
+		lutW = lutsize;
+		lutH = (lutsize+1)/2;
+		lut.resize(lutW*lutH);
+		for (int j=0;j<lutH;j++) {
+			double theta = M_PI*(j+0.5)/lutH, st = sin(theta), ct = cos(theta);
+			for (int i=0;i<lutW;i++) {
+				double phi = 2.0*M_PI*(i+0.5)/lutW;
+				lut[j*lutW+i] = skyColor(vector3d_t(st*cos(phi), st*sin(phi), ct));
+			}
+		}
+	}
 };
 
 
@@ -93,6 +108,50 @@ double sunskyBackground_t::AngleBetween(double thetav, double phiv) const
 }
 
 color_t sunskyBackground_t::operator() (const vector3d_t &dir, renderState_t &state, bool filtered) const
+{
+	if (lutW) return lookup(dir);
+	return skyColor(dir);
+}
+
+// bilinear between cell centers, wraps around in phi
+color_t sunskyBackground_t::lookup(const vector3d_t &dir) const
+{
+	vector3d_t Iw = dir;
+	Iw.normalize();
+	PFLOAT z = Iw.z;
+	if (z>1) z = 1; else if (z<-1) z = -1;
+	PFLOAT phi = ((Iw.y==0.0) && (Iw.x==0.0)) ? M_PI*0.5 : atan2(Iw.y, Iw.x);
+	if (phi<0) phi += 2.0*M_PI;
+	PFLOAT xf = phi*(0.5*M_1_PI)*lutW - 0.5, yf = acos(z)*M_1_PI*lutH - 0.5;
+	int x = (int)floor(xf), y = (int)floor(yf);
+	PFLOAT dx = xf-x, dy = yf-y;
+	if (y<0) { y = 0;  dy = 0; }
+	else if (y>=lutH-1) { y = lutH-1;  dy = 0; }
+	int y2 = (y<lutH-1) ? y+1 : y;
+	if (x<0) x += lutW;
+	int x2 = (x+1<lutW) ? x+1 : 0;
+	const color_t *r1 = &lut[y*lutW], *r2 = &lut[y2*lutW];
+	return (1-dy)*((1-dx)*r1[x] + dx*r1[x2]) + dy*((1-dx)*r2[x] + dx*r2[x2]);
+}
+
+// Brightness at the cell centers of the sampler map, from the table when
+// there is one. Directions follow spheremap(): phi from +y towards +x.
+envSampler_t *sunskyBackground_t::buildSampler() const
+{
+	int w = lutW ? lutW : 128, h = lutW ? lutH : 64;
+	vector<float> lum(w*h);
+	for (int j=0;j<h;j++) {
+		double theta = M_PI*(j+0.5)/h, st = sin(theta), ct = cos(theta);
+		for (int i=0;i<w;i++) {
+			double phi = M_PI*(1.0-2.0*(i+0.5)/w);
+			vector3d_t d(st*sin(phi), st*cos(phi), ct);
+			lum[j*w+i] = (lutW ? lookup(d) : skyColor(d)).energy();
+		}
+	}
+	return new envSampler_t(lum, w, h, envSampler_t::MAP_SPHERE);
+}
+
+color_t sunskyBackground_t::skyColor(const vector3d_t &dir) const
 {
 	vector3d_t Iw = dir;
 	Iw.normalize();
@@ -150,6 +209,7 @@ background_t *sunskyBackground_t::factory(paramMap_t &params,renderEnvironment_t
 	PFLOAT pw = 1.0;	// sunlight power
 	PFLOAT av, bv, cv, dv, ev;
 	av = bv = cv = dv = ev = 1.0;	// color variation parameters, default is normal
+	int lutsize = 0;	// width of the lat-long sky table, 0 computes every lookup
 
 	params.getParam("from", dir);
 	params.getParam("turbidity", turb);
@@ -160,12 +220,13 @@ background_t *sunskyBackground_t::factory(paramMap_t &params,renderEnvironment_t
 	params.getParam("c_var", cv);
 	params.getParam("d_var", dv);
 	params.getParam("e_var", ev);
+	params.getParam("lut_size", lutsize);
 
 	// create sunlight with correct color and position?
 	params.getParam("add_sun", add_sun);
 	params.getParam("sun_power", pw);
 
-	background_t * new_sunsky = new sunskyBackground_t(dir, turb, av, bv, cv, dv, ev);
+	background_t * new_sunsky = new sunskyBackground_t(dir, turb, av, bv, cv, dv, ev, lutsize);
 	/*
 	if (add_sun) {
 		color_t suncol = (*new_sunsky)(vector3d_t(dir.x, dir.y, dir.z));
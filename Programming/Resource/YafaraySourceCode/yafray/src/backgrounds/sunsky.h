@@ -6,6 +6,7 @@
 #endif
 #include "background.h"
 #include "params.h"
+#include <vector>
 
 __BEGIN_YAFRAY
 // constant
@@ -25,11 +26,17 @@ class sunskyBackground_t: public background_t
 {
 	public:
 		sunskyBackground_t(const point3d_t dir, PFLOAT turb,
-			PFLOAT a_var, PFLOAT b_var, PFLOAT c_var, PFLOAT d_var, PFLOAT e_var);
+			PFLOAT a_var, PFLOAT b_var, PFLOAT c_var, PFLOAT d_var, PFLOAT e_var, int lutsize=0);
 		virtual color_t operator() (const vector3d_t &dir, renderState_t &state, bool filtered=false) const;
 		virtual ~sunskyBackground_t() {};
 		static background_t *factory(paramMap_t &,renderEnvironment_t &);
 	protected:
+		virtual envSampler_t *buildSampler() const;
+		color_t skyColor(const vector3d_t &dir) const;
+		color_t lookup(const vector3d_t &dir) const;
+		// sky colors at the center of lat-long cells, empty if not used
+		int lutW, lutH;
+		std::vector<color_t> lut;
 		vector3d_t sunDir;
 		PFLOAT turbidity;
 		double thetaS, phiS;	// sun coords
@@ -120,6 +120,7 @@ class renderEnvironment_t
 		virtual texture_t *getTexture(const std::string name)const=0;
 
 		virtual void repeatFirstPass()=0;
+		virtual int getCPUs()const=0;
 
 		virtual void registerFactory(const std::string &name,light_factory_t *f)=0;
 		virtual void registerFactory(const std::string &name,shader_factory_t *f)=0;
@@ -26,6 +26,8 @@
 #if HAVE_PTHREAD
 #include "threadedscene.h"
 #endif
+#include "metashader.h"
+#include "mipmap.h"
 
 #include "mesh.h"
 #include "reference.h"
@@ -532,6 +534,21 @@ void interfaceImpl_t::render(paramMap_t &params)
 	params.getParam("AA_jitterfirst", AA_jitterfirst);
 	bool clamp_rgb = false;
 	params.getParam("clamp_rgb", clamp_rgb);
+	// lights sampled per shading point from the light tree, 0 evaluates them all
+	int light_samples = 0;
+	params.getParam("light_samples", light_samples);
+	// fraction of the light left without shadow rays, 0 tests them all
+	PFLOAT shadow_threshold = 0;
+	params.getParam("shadow_threshold", shadow_threshold);
+	// memory for the tiles of paged image textures (the ones with a cache_file), in MB
+	int texture_cache = 0;
+	params.getParam("texture_cache", texture_cache);
+	// textures filtered over the pixel footprint of the camera rays
+	bool ray_differentials = false;
+	params.getParam("ray_differentials", ray_differentials);
+	// camera hits shaded afterwards, grouped by shader
+	bool deferred_shading = false;
+	params.getParam("deferred_shading", deferred_shading);
 
 	if(*camera=="")
 	{
@@ -635,13 +652,24 @@ void interfaceImpl_t::render(paramMap_t &params)
 	scene.clampRGB(clamp_rgb);
 	scene.setRegion(xmin,xmax,ymin,ymax);
 	scene.setBias(bias);
+	scene.setLightSamples(light_samples);
+	scene.setShadowThreshold(shadow_threshold);
+	scene.setRayDifferentials(ray_differentials);
+	scene.setDeferredShading(deferred_shading);
 	if(cachedPathLight) scene.setRepeatFirst();
+
+	// nodes read by several parents are evaluated once per point
+	shaderGraph_t graph;
+	graph.compile(shader_table);
+	if(texture_cache>0) tileCache_t::global().setMaxSize((size_t)texture_cache<<20);
 	
 	int nthreads=1;
 	if(params.getParam("threads", nthreads))
 		scene.setCPUs(nthreads);
 	else
 		scene.setCPUs(cpus);
+	// the image files named while parsing, all decoded at once
+	imageRegistry_t::global().loadAll(scene.getCPUs());
 
 	// tone mapping bypassed when hdr/exr output is requested
 	if (*output_type=="hdr") {
@@ -726,6 +754,21 @@ void interfaceImpl_t::render(paramMap_t &params,colorOutput_t &output)
 	params.getParam("AA_jitterfirst", AA_jitterfirst);
 	bool clamp_rgb = false;
 	params.getParam("clamp_rgb", clamp_rgb);
+	// lights sampled per shading point from the light tree, 0 evaluates them all
+	int light_samples = 0;
+	params.getParam("light_samples", light_samples);
+	// fraction of the light left without shadow rays, 0 tests them all
+	PFLOAT shadow_threshold = 0;
+	params.getParam("shadow_threshold", shadow_threshold);
+	// memory for the tiles of paged image textures (the ones with a cache_file), in MB
+	int texture_cache = 0;
+	params.getParam("texture_cache", texture_cache);
+	// textures filtered over the pixel footprint of the camera rays
+	bool ray_differentials = false;
+	params.getParam("ray_differentials", ray_differentials);
+	// camera hits shaded afterwards, grouped by shader
+	bool deferred_shading = false;
+	params.getParam("deferred_shading", deferred_shading);
 
 	if(*camera=="")
 	{
@@ -822,13 +865,24 @@ void interfaceImpl_t::render(paramMap_t &params,colorOutput_t &output)
 	scene.clampRGB(clamp_rgb);
 	scene.setRegion(xmin,xmax,ymin,ymax);
 	scene.setBias(bias);
+	scene.setLightSamples(light_samples);
+	scene.setShadowThreshold(shadow_threshold);
+	scene.setRayDifferentials(ray_differentials);
+	scene.setDeferredShading(deferred_shading);
 	if(cachedPathLight) scene.setRepeatFirst();
+
+	// nodes read by several parents are evaluated once per point
+	shaderGraph_t graph;
+	graph.compile(shader_table);
+	if(texture_cache>0) tileCache_t::global().setMaxSize((size_t)texture_cache<<20);
 	
 	int nthreads=1;
 	if(params.getParam("threads", nthreads))
 		scene.setCPUs(nthreads);
 	else
 		scene.setCPUs(cpus);
+	// the image files named while parsing, all decoded at once
+	imageRegistry_t::global().loadAll(scene.getCPUs());
 	scene.render(output);
 
 	output.flush();
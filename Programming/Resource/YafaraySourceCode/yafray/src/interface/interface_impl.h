@@ -82,6 +82,7 @@ class interfaceImpl_t : public yafrayInterface_t
 		virtual texture_t *getTexture(const std::string name)const;
 
 		virtual void repeatFirstPass();
+		virtual int getCPUs()const {return cpus;};
 		
 		virtual void registerFactory(const std::string &name,light_factory_t *f);
 		virtual void registerFactory(const std::string &name,shader_factory_t *f);
@@ -28,66 +28,29 @@ using namespace std;
 
 __BEGIN_YAFRAY
 
-int areaLight_t::fillQuad(const point3d_t &a,const point3d_t &b,
-											const point3d_t &c,const point3d_t &d,
-											vector<point3d_t> &points_vector,
-											vector<pair<vector3d_t,vector3d_t> > &jit_vector,int samp)
-{
-	PFLOAT max_v,max_h;
-	PFLOAT ab_len=(b-a).length();
-	PFLOAT bc_len=(c-b).length();
-	PFLOAT cd_len=(d-c).length();
-	PFLOAT da_len=(a-d).length();
-
-	max_v= (bc_len>da_len) ? bc_len : da_len;
-	max_h= (ab_len>cd_len) ? ab_len : cd_len;
-
-	int v_samp=(int)(( max_v / (max_v+max_h) )*2.0*std::sqrt(static_cast<PFLOAT>(samp)));
-	int h_samp=(int)(( max_h / (max_v+max_h) )*2.0*std::sqrt(static_cast<PFLOAT>(samp)));
-	
-	if (points_vector.size()==1) return 1;
-
-	vector3d_t inc_v_a= (d-a)/v_samp;
-	vector3d_t inc_v_b= (c-b)/v_samp;
-	point3d_t line_a=a+0.5*inc_v_a;
-	point3d_t line_b=b+0.5*inc_v_b;
-	int index=0;
-	for(int i=0;i<v_samp;++i)
-	{
-		vector3d_t inc_h=(line_b-line_a)/h_samp;
-		point3d_t point=line_a+0.5*inc_h;
-		for(int j=0;j<h_samp;++j)
-		{
-			PFLOAT vf=((PFLOAT)j)/((PFLOAT)h_samp);
-			vector3d_t inc_v=inc_v_a*(1.0-vf)+inc_v_b*vf;
-			points_vector[index]=point;
-			jit[index].first=inc_h;
-			jit[index].second=inc_v;
-			index++;
-			point=point+inc_h;
-		}
-		line_a=line_a+inc_v_a;
-		line_b=line_b+inc_v_b;
-	}
-	return index;
-}
-
 areaLight_t::areaLight_t(const point3d_t &a,const point3d_t &b,
 												const point3d_t &c,const point3d_t &d,
 												int nsam, const color_t &col, 
 												CFLOAT inte,int fsam,bool dum):
-												points(nsam),jit(nsam),dummy(dum)
+												dummy(dum)
 {
-	samples = fillQuad(a, b, c, d, points, jit, nsam);
+	samples = (nsam<1) ? 1 : nsam;
 	direction = (b-a)^(d-a);
 	direction.normalize();
 	color = col;
 	pow = inte;
 	from = (a+b+c+d)*0.25;
-	fsamples = fsam;
+	if(fsam>=samples)
+	{
+		cerr<<"[arealight]: psamples must be less than samples, using "<<samples-1<<endl;
+		fsam=samples-1;
+	}
+	fsamples = (fsam>0) ? fsam : sampleTable_t::prediction(samples);
 	corner = a;
 	toX = b-a;
 	toY = d-a;
+	skew = (c-b)-(d-a);
+	table.init(samples);
 }
 
 color_t areaLight_t::illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t sp,
@@ -130,71 +93,61 @@ color_t areaLight_t::illuminate(renderState_t &state,const scene_t &s,const surf
 		return (plane_at*resul);
 	}
 	
-	int status=guessLight(state,s,sp,N);
-	switch(status)
+	// the first fsamples of the set tell if the point is in penumbra, and
+	// there the lit ones so far tell how many more it needs. Penumbras are
+	// wider than a pixel, so after a point in one the next starts from the
+	// count that one needed instead of risking an early out
+	const PFLOAT *set=table.getSet();
+	int lit=0,taken=samples,check=(fsamples>0) ? fsamples : samples;
+	int last=state.context.get(_lastneed);
+	if(last>check) check=last;
+	for(int i=0;i<taken;++i)
 	{
-		case PENUMBRA:
-			for(int i=0;i<samples;++i)
+		if(i==check)
+		{
+			if((i==fsamples) && (lit==0))
+			{
+				state.context.store(_lastneed,0);
+				state.skipelement=oldorigin;
+				energy_t ene(direction, 0*color);
+				return sha->fromLight(state,sp,ene,eye);
+			}
+			if((i==fsamples) && (lit==i))
 			{
-				PFLOAT dish=ourRandom()-0.5, disv=ourRandom()-0.5;
-				point3d_t sampleP = points[i] + jit[i].first*dish + jit[i].second*disv;
-				L = sampleP-sp.P();
-				if ((L*N)<0) continue;
-				if (!s.isShadowed(state, sp, sampleP))
+				// fully lit, no more shadow rays and the same points
+				// everywhere so lit areas stay smooth
+				state.context.store(_lastneed,0);
+				set=table.firstSet();
+				resul.set(0,0,0);
+				for(i=0;i<samples;++i)
 				{
-					dir = L;
+					dir = quadPoint(set[2*i],set[2*i+1])-sp.P();
+					if ((dir*N)<0) continue;
 					CFLOAT LD2 = dir.normLenSqr();
 					LD2 = (LD2!=0) ? (1.0/LD2) : 1.0;
-					energy_t ene(dir, (pow*color)*LD2);
-					resul += sha->fromLight(state, sp, ene, eye);
+					resul += sha->fromLight(state, sp, energy_t(dir, (pow*color)*LD2), eye);
 				}
+				break;
 			}
-			state.skipelement=oldorigin;
-			return (plane_at*resul/ ((CFLOAT)samples));
-		case LIGHT:
-			for(int i=0;i<samples;++i)
-			{
-				L = points[i]-sp.P();
-				dir = L;
-				CFLOAT LD2 = dir.normLenSqr();
-				LD2 = (LD2!=0) ? (1.0/LD2) : 1.0;
-				energy_t ene(dir, (pow*color)*LD2);
-				resul += sha->fromLight(state, sp, ene, eye);
-			}
-			state.skipelement=oldorigin;
-			return (plane_at*resul/ ((CFLOAT)samples));
-		case SHADOW:
-			energy_t ene(direction, 0*color);
-			state.skipelement=oldorigin;
-			return sha->fromLight(state,sp,ene,eye);
+			taken=check=sampleTable_t::adaptive(lit,i,samples);
+			if(i==taken) break;
+		}
+		point3d_t sampleP = quadPoint(set[2*i],set[2*i+1]);
+		L = sampleP-sp.P();
+		if ((L*N)<0) continue;
+		if (!s.isShadowed(state, sp, sampleP))
+		{
+			lit++;
+			dir = L;
+			CFLOAT LD2 = dir.normLenSqr();
+			LD2 = (LD2!=0) ? (1.0/LD2) : 1.0;
+			energy_t ene(dir, (pow*color)*LD2);
+			resul += sha->fromLight(state, sp, ene, eye);
+		}
 	}
+	state.context.store(_lastneed,((lit>0) && (lit<taken)) ? taken : 0);
 	state.skipelement=oldorigin;
-	energy_t ene(direction, 0*color);
-	return sha->fromLight(state,sp,ene,eye);
-}
-
-int areaLight_t::guessLight(renderState_t &state,const scene_t &s,const surfacePoint_t &sp,const vector3d_t &N)const
-{
-	if(fsamples==0) return PENUMBRA;
-	bool luz=false,sombra=false;
-	vector3d_t L;
-	int randsamp;
-	
-	for(int i=0;i<fsamples;++i)
-	{
-		if(luz && sombra) return PENUMBRA;
-		randsamp=rand()%samples;
-		L=points[randsamp]-sp.P();
-		if((L*N)<0)
-			sombra=true;
-		else if(s.isShadowed(state,sp,points[randsamp]))
-			sombra=true;
-		else
-			luz=true;
-	}
-	if(luz && sombra) return PENUMBRA;
-	if(luz) return LIGHT;
-	return SHADOW;
+	return (plane_at*resul/((CFLOAT)taken));
 }
 
 quadEmitter_t::quadEmitter_t(const point3d_t &corn,const vector3d_t &tox,
@@ -271,7 +224,7 @@ pluginInfo_t areaLight_t::info()
 				"Number of samples for shadowing"));
 	
 	info.params.push_back(buildInfo<INT>("psamples",0,1000,0,
-				"Number of samples to guess penumbra"));
+				"Number of the samples used to guess penumbra, 0 for a quarter"));
 	info.params.push_back(buildInfo<BOOL>("dummy",
 				"Use only to shoot photons, no direct lighting"));
 
@@ -29,6 +29,7 @@
 
 #include "light.h"
 #include "params.h"
+#include "mcqmc.h"
 
 __BEGIN_YAFRAY
 
@@ -41,6 +42,8 @@ class quadEmitter_t : public emitter_t
 		virtual void numSamples(int n);
 		virtual void getDirection(int num,point3d_t &p,vector3d_t &dir,color_t &c)const;
 		virtual bool storeDirect()const {return true;};
+		virtual bool hashEmission(keyHash_t &h)const
+		{h.add(corner);h.add(toX);h.add(toY);h.add(direction);h.add(color);return true;};
 	protected:
 		point3d_t corner;
 		vector3d_t toX,toY,direction,NU,NV;
@@ -52,7 +55,9 @@ class quadEmitter_t : public emitter_t
  * Creates a quad filled with samples to illuminate objects. It
  * has penumbra prediction with a configurable numer of samples.
  * So if you create it with 60 samples and 20 for penumbra prediction,
- * it will shoot first 20 random rays trying to skip 60 if possible.
+ * it will shoot the first 20 rays of the 60 and skip the rest if they
+ * all agree. In penumbra it takes more of them the closer the lit
+ * fraction is to a half, looking again at it as the count grows.
  *
  * @see light_t
  */
@@ -70,7 +75,7 @@ class areaLight_t : public light_t
 		 * @param c is the color of the light
 		 * @param inte is the intensity of the light
 		 * @param fsam is the number of samples for penumbra prediction,if it's 0
-		 * then penumbra prediction is not used
+		 * then a quarter of them are used
 		 * 
 		 */
 		areaLight_t(const point3d_t &a,const point3d_t &b,
@@ -94,46 +99,33 @@ class areaLight_t : public light_t
 			else return NULL;
 		};
 
+		///@see light_t
+		virtual bool emissionBound(lightBound_t &b)const
+		{
+			if(dummy) return false; // lights nothing
+			point3d_t c[4]={corner,corner+toX,corner+toY,corner+toX+toY+skew};
+			b.min=b.max=c[0];
+			for(int i=1;i<4;++i)
+			{
+				b.min.set(std::min(b.min.x,c[i].x),std::min(b.min.y,c[i].y),std::min(b.min.z,c[i].z));
+				b.max.set(std::max(b.max.x,c[i].x),std::max(b.max.y,c[i].y),std::max(b.max.z,c[i].z));
+			}
+			b.axis=direction;
+			b.thetaO=0;  b.thetaE=0.5*M_PI;
+			b.power=pow*color.energy();
+			return true;
+		};
+
 		void setDummy() {dummy=true;};
 
 		static light_t *factory(paramMap_t &params,renderEnvironment_t &render);
 		static pluginInfo_t info();
 	protected:
-		/** Penumbra predictor
-		 *
-		 * It tries to guess if the current shading point is in total shadow,
-		 * total light or penumbra.
-		 *
-		 * @param s is the scene being rendered
-		 * @param P is the surface point being shaded
-		 * @param N is the normal of the surface correctly fliped
-		 *
-		 */
-		int guessLight(renderState_t &state,const scene_t &s,
-				const surfacePoint_t &P,const vector3d_t &N)const;
-		/** Generates the samples in the quad
-		 *
-		 * Fills the given vectors with samples inside the quad, and also
-		 * calculates the random vectors to be added at shading time
-		 *
-		 * @param a is a corner of the quad
-		 * @param b is another corner of the quad
-		 * @param c is another corner of the quad
-		 * @param d is another corner of the quad
-		 * @param points_vector is where the sample points are going to be stored
-		 * @param jit_vector is there the random jitter vectors are going to be 
-		 * stored
-		 * @param samp is the number of samples
-		 * 
-		 */
-		int fillQuad(const point3d_t &a,const point3d_t &b,
-									const point3d_t &c,const point3d_t &d,
-									std::vector<point3d_t> &points_vector,
-									std::vector<std::pair<vector3d_t,vector3d_t> > &jit_vector,int samp);
-		/// The sample points
-		std::vector<point3d_t> points;
-		/// The jitter vectors, they are randomly added to the samples while shading
-		std::vector<std::pair<vector3d_t,vector3d_t> > jit;
+		/// Point of the quad at parameters u,v, bilinear between the corners
+		point3d_t quadPoint(PFLOAT u,PFLOAT v)const {return corner+toX*u+toY*v+skew*(u*v);};
+
+		/// Stratified sample positions on the quad
+		sampleTable_t table;
 		/// An average point to return as position
 		point3d_t from;
 		/// The normal of the quad
@@ -146,15 +138,13 @@ class areaLight_t : public light_t
 		int samples;
 		/// Number of penumbra prediction samples
 		int fsamples;
+		/// Key for the samples the last penumbra point of a thread needed
+		int _lastneed;
 		bool dummy;
 		point3d_t corner;
-		vector3d_t toX,toY;
+		vector3d_t toX,toY,skew;
 };
 
-#define SHADOW 0
-#define PENUMBRA 1
-#define LIGHT 2
-
 __END_YAFRAY
 
 #endif
@@ -141,9 +141,9 @@ void globalPhotonLight_t::setIrradiance(compPhoton_t &cp)
 	}
 	if((found.size()==1) || (found.front().dis==0))
 	{
-		CFLOAT factor=found[0].photon->direction()*cp.N;
+		CFLOAT factor=found[0].photon.direction()*cp.N;
 		if(factor<0.0) factor=0.0;
-		cp.irr=found[0].photon->color()*factor;
+		cp.irr=found[0].photon.color()*factor;
 		return;
 	}
 		
@@ -154,7 +154,7 @@ void globalPhotonLight_t::setIrradiance(compPhoton_t &cp)
 	//points.clear();
 	for(vector< foundPhoton_t >::const_iterator i=found.begin();i!=found.end();++i)
 	{
-		const storedPhoton_t &p=*(i->photon);
+		const storedPhoton_t &p=i->photon;
 		CFLOAT factor=(1.0 - i->dis/farest)*(p.direction()*cp.N);
 		if(factor>0)
 		{
@@ -231,6 +231,38 @@ void globalPhotonLight_t::computeIrradiances()
 	irradiance->buildTree();
 }
 
+// tag changed with the packed photon map, older files are computed again
+#define CACHE_TAG "YAFGPMP2"
+
+bool globalPhotonLight_t::loadMaps(unsigned long long key)
+{
+	cacheReader_t cache(cacheFile,CACHE_TAG,key);
+	const compPhoton_t *comp;
+	unsigned int ncomp;
+	photonMap->load(cache);
+	irradiance->load(cache);
+	cache.readArray(comp,ncomp);
+	if(!cache.ok()) return false;
+
+	for(unsigned int i=0;i<ncomp;++i) hash.findBox(comp[i].photon.position())=comp[i];
+	return true;
+}
+
+void globalPhotonLight_t::saveMaps(unsigned long long key)const
+{
+	vector<compPhoton_t> comp;
+	comp.reserve(hash.numBoxes());
+	for(hash3d_t<compPhoton_t>::const_iterator i=hash.begin();i!=hash.end();++i)
+		comp.push_back(*i);
+
+	cacheWriter_t cache(cacheFile,CACHE_TAG,key);
+	photonMap->save(cache);
+	irradiance->save(cache);
+	cache.writeArray(comp);
+	if(!cache.ok()) cerr<<"Could not save photon maps to "<<cacheFile<<endl;
+	else cout<<"Photon maps saved to "<<cacheFile<<endl;
+}
+
 void globalPhotonLight_t::init(scene_t &scene)
 {
 	found.reserve(search+1);
@@ -254,6 +286,39 @@ void globalPhotonLight_t::init(scene_t &scene)
 		emitter_t *e=(*i)->getEmitter(photonsperlight);
 		if(e!=NULL) emitters.push_back(e);
 	}
+
+	// The cache is valid as long as geometry, emitters and photon settings
+	// are the same. Shaders are not part of the key, remove the file
+	// after changing materials.
+	keyHash_t key;
+	key.add(radius);
+	key.add(maxdepth);
+	key.add(maxcdepth);
+	key.add(numPhotons);
+	key.add(search);
+	scene.hashGeometry(key);
+	bool cacheable=true;
+	for(list<emitter_t *>::iterator i=emitters.begin();i!=emitters.end();++i)
+	{
+		if(!(*i)->hashEmission(key)) cacheable=false;
+		key.add((*i)->storeDirect());
+	}
+	if((cacheFile!="") && !cacheable)
+	{
+		cerr<<"Some lights can't be keyed, not using "<<cacheFile<<endl;
+		cacheFile="";
+	}
+	if((cacheFile!="") && loadMaps(key.value()))
+	{
+		for(list<emitter_t *>::iterator i=emitters.begin();i!=emitters.end();++i) delete *i;
+		cout<<"Loaded "<<photonMap->count()<<" photons and "<<irradiance->count()<<
+			" irradiance samples from "<<cacheFile<<endl;
+		scene.publishData("globalPhotonMap",photonMap);
+		scene.publishData("irradianceGlobalPhotonMap",irradiance);
+		scene.publishData("irradianceHashMap",&hash);
+		return;
+	}
+
 	point3d_t from;
 	vector3d_t dir;
 	color_t color;
@@ -279,6 +344,7 @@ void globalPhotonLight_t::init(scene_t &scene)
 
 	computeIrradiances();
 	cout<<" "<<irradiance->count()<<" OK\n";
+	if(cacheFile!="") saveMaps(key.value());
 
 	//hash.clear();
 	scene.publishData("globalPhotonMap",photonMap);
@@ -290,14 +356,18 @@ light_t *globalPhotonLight_t::factory(paramMap_t &params,renderEnvironment_t &re
 {
 	PFLOAT radius=1.0;
 	int maxdepth=2,maxcdepth=4,photons=50000,search=200;
+	string _cfile;
+	const string *cfile=&_cfile;
 
 	params.getParam("radius",radius);
 	params.getParam("depth",maxdepth);
 	params.getParam("caus_depth",maxcdepth);
 	params.getParam("photons",photons);
 	params.getParam("search",search);
+	// file to keep the maps between renders, see init() for when it is reused
+	params.getParam("cache_file",cfile);
 
-	return new globalPhotonLight_t(radius,maxdepth,maxcdepth,photons,search);
+	return new globalPhotonLight_t(radius,maxdepth,maxcdepth,photons,search,*cfile);
 }
 
 pluginInfo_t globalPhotonLight_t::info()
@@ -3,6 +3,7 @@
 
 #include "light.h"
 #include "photon.h"
+#include "mapfile.h"
 
 __BEGIN_YAFRAY
 
@@ -14,11 +15,11 @@ struct fPoint_t
 class globalPhotonLight_t: public light_t
 {
 	public:
-		globalPhotonLight_t(PFLOAT r,int md,int mcd,int p,int se):
+		globalPhotonLight_t(PFLOAT r,int md,int mcd,int p,int se,const std::string &cf=""):
 			hash(r/sqrt((PFLOAT)se),500000),
 			photonMap(new globalPhotonMap_t(r)),
 			irradiance(new globalPhotonMap_t(r)),
-			maxdepth(md),maxcdepth(mcd),numPhotons(p),search(se) {};
+			maxdepth(md),maxcdepth(mcd),numPhotons(p),search(se),cacheFile(cf) {};
 		virtual ~globalPhotonLight_t() {delete photonMap;delete irradiance;};
 		
 		virtual color_t illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t sp,
@@ -45,6 +46,8 @@ class globalPhotonLight_t: public light_t
 		void storeInHash(const runningPhoton_t &p,const vector3d_t &N);
 		void setIrradiance(compPhoton_t &p);
 		void computeIrradiances();
+		bool loadMaps(unsigned long long key);
+		void saveMaps(unsigned long long key)const;
 
 		hash3d_t<compPhoton_t> hash;
 		globalPhotonMap_t *photonMap;
@@ -54,6 +57,7 @@ class globalPhotonLight_t: public light_t
 		std::vector<fPoint_t> points;
 		renderState_t nullstate;
 		PFLOAT radius;
+		std::string cacheFile;
 };
 
 __END_YAFRAY
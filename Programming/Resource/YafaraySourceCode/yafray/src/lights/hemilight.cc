@@ -28,8 +28,10 @@ __BEGIN_YAFRAY
 #define WARNING cerr<<"[hemilight]: "
 #define INFO cerr<<"[hemilight]: "
 
-hemiLight_t::hemiLight_t(int nsam, const color_t &c, CFLOAT pwr, PFLOAT mdist, bool usebg, bool useqmc)
-	: samples(nsam), color(c), power(pwr), maxdistance(mdist), use_background(usebg), use_QMC(useqmc)
+hemiLight_t::hemiLight_t(int nsam, const color_t &c, CFLOAT pwr, PFLOAT mdist, bool usebg, bool useqmc,
+				bool imp)
+	: samples(nsam), color(c), power(pwr), maxdistance(mdist), use_background(usebg),
+		importance(imp), bgsampler(NULL), use_QMC(useqmc)
 {
 	if (use_QMC) {
 		// two dim only
@@ -54,6 +56,12 @@ hemiLight_t::hemiLight_t(int nsam, const color_t &c, CFLOAT pwr, PFLOAT mdist, b
 	sampdiv = power/(PFLOAT)samples;
 }
 
+void hemiLight_t::init(scene_t &scene)
+{
+	bgsampler = (use_background && importance) ? scene.backgroundSampler() : NULL;
+	if (bgsampler) INFO << "Sampling the background by brightness\n";
+}
+
 
 color_t hemiLight_t::illuminate(renderState_t &state,const scene_t &sc, const surfacePoint_t sp,
 				const vector3d_t &eye) const
@@ -69,11 +77,34 @@ color_t hemiLight_t::illuminate(renderState_t &state,const scene_t &sc, const su
 	const void *oldorigin=state.skipelement;
 	state.skipelement=sp.getOrigin();
 
+	// With a background sampler the last half of the directions come from
+	// it. All are weighted by the mix of both pdfs over the uniform one, so
+	// bright spots are found without losing the rest of the sky. Each half
+	// is jittered over the whole square on its own.
+	int nbg = bgsampler ? (samples+1)/2 : 0, nuni = samples-nbg;
+	PFLOAT fbg = nbg/(PFLOAT)samples, unipdf = 0.5*M_1_PI;
 	//CFLOAT totalocc = 0;
 	//vector3d_t avgdir(0, 0, 0);
 	for (int sm=0;sm<samples;sm++)
 	{
-		dir = getNext(N, sm, sp.NU(), sp.NV());
+		CFLOAT w = 1;
+		if (nbg) {
+			PFLOAT z1, z2, bgpdf;
+			if (sm<nuni) {
+				jitteredSample(sm, nuni, z1, z2);
+				dir = hemiDir(N, sp.NU(), sp.NV(), z1, z2*2.0*M_PI);
+				bgpdf = bgsampler->pdf(dir);
+			}
+			else {
+				jitteredSample(sm-nuni, nbg, z1, z2);
+				dir = bgsampler->sample(z1, z2, bgpdf);
+				if (bgpdf<=0) continue;
+			}
+			PFLOAT mix = (1.0-fbg)*unipdf + fbg*bgpdf;
+			if (mix<=0) continue;
+			w = unipdf/mix;
+		}
+		else dir = getNext(N, sm, sp.NU(), sp.NV());
 		CFLOAT occ = dir*N;
 		if ((occ>0) && (!((maxdistance>0) ?
 					sc.isShadowed(state, sp, sp.P()+maxdistance*dir) :
@@ -81,7 +112,7 @@ color_t hemiLight_t::illuminate(renderState_t &state,const scene_t &sc, const su
 		{
 			
 			if (use_background)
-				totalcolor += sc.getBackground(dir, state, true) * occ;
+				totalcolor += sc.getBackground(dir, state, true) * (occ*w);
 			else
 				totalcolor += color * occ;
 			
@@ -110,7 +141,7 @@ vector3d_t hemiLight_t::getNext(const vector3d_t &normal, int cursample, const v
 		z1 = (PFLOAT(cursample / grid) + ourRandom()) * gridiv;
 		z2 = (PFLOAT(cursample % grid) + ourRandom()) * gridiv2pi;
 	}
-	return (Ru*cos(z2) + Rv*sin(z2))*sqrt(1.0-z1*z1) + normal*z1;
+	return hemiDir(normal, Ru, Rv, z1, z2);
 }
 
 light_t *hemiLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
@@ -121,6 +152,7 @@ light_t *hemiLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	PFLOAT mdist = -1;	// infinite default
 	bool use_background = false;
 	bool useqmc = false;
+	bool importance = true;
 
 	if (!params.getParam("color", color)) {
 		INFO << "No color set for hemilight, using scene background color instead.\n";
@@ -134,9 +166,10 @@ light_t *hemiLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 		samples = 1;
 	}
 	params.getParam("use_QMC", useqmc);
+	params.getParam("importance", importance);
 	
 	params.getParam("maxdistance", mdist);
-	return new hemiLight_t(samples, color, power, mdist, use_background, useqmc);
+	return new hemiLight_t(samples, color, power, mdist, use_background, useqmc, importance);
 }
 
 pluginInfo_t hemiLight_t::info()
@@ -152,6 +185,8 @@ pluginInfo_t hemiLight_t::info()
 	info.params.push_back(buildInfo<INT>("samples",1,5000,16,"Shadow samples, \
 				the higher the slower and the better"));
 	info.params.push_back(buildInfo<BOOL>("use_QMC","Whenever to use quasi montecarlo"));
+	info.params.push_back(buildInfo<BOOL>("importance","Whenever to send half the samples \
+				to the bright parts of image backgrounds"));
 	return info;
 }
 
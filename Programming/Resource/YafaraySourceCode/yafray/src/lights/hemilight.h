@@ -37,12 +37,13 @@ __BEGIN_YAFRAY
 class hemiLight_t : public light_t
 {
 	public:
-		hemiLight_t(int nsam, const color_t &c, CFLOAT pwr, PFLOAT mdist, bool usebg, bool useqmc=false);
+		hemiLight_t(int nsam, const color_t &c, CFLOAT pwr, PFLOAT mdist, bool usebg, bool useqmc=false,
+				bool imp=true);
 		virtual color_t illuminate(renderState_t &state,const scene_t &s,
 				const surfacePoint_t sp, const vector3d_t &eye) const;
 		// has no position, return origin
 		virtual point3d_t position() const { return point3d_t(0, 0, 0); };
-		virtual void init(scene_t &scene) {};
+		virtual void init(scene_t &scene);
 		virtual ~hemiLight_t() { if (HSEQ) delete[] HSEQ;  HSEQ=NULL; };
 
 		static light_t *factory(paramMap_t &params,renderEnvironment_t &render);
@@ -58,6 +59,13 @@ class hemiLight_t : public light_t
 		PFLOAT gridiv, gridiv2pi;
 		vector3d_t getNext(const vector3d_t &nrm, int cursam,
 					const vector3d_t &ru, const vector3d_t &Rv) const;
+		// z1 is the cosine to the normal, z2 the angle around it
+		vector3d_t hemiDir(const vector3d_t &nrm, const vector3d_t &ru, const vector3d_t &Rv,
+					PFLOAT z1, PFLOAT z2) const
+		{ return (ru*cos(z2) + Rv*sin(z2))*sqrt(1.0-z1*z1) + nrm*z1; }
+		// importance sampling of the background, when it can do it
+		bool importance;
+		const envSampler_t *bgsampler;
 		// QMC sampling
 		bool use_QMC;
 		Halton* HSEQ;
@@ -45,12 +45,35 @@ static point3d_t path_get_pos(const lightSample_t * const & p)
 	return p->pP;
 }
 
+void lightCache_t::merge()
+{
+	unsigned int total=samples.size();
+	for(int s=0;s<CACHE_SHARDS;++s) total+=shards[s]->samples.size();
+	samples.reserve(total);
+	next.reserve(total);
+	for(int s=0;s<CACHE_SHARDS;++s)
+	{
+		vector<lightSample_t> &ss=shards[s]->samples;
+		for(vector<lightSample_t>::iterator i=ss.begin();i!=ss.end();++i)
+		{
+			lightAccum_t &a=hash.findBox(i->pP);
+			next.push_back(a.first);
+			a.first=samples.size();
+			samples.push_back(*i);
+		}
+		ss.clear();
+		shards[s]->next.clear();
+		shards[s]->hash.clear();
+	}
+}
+
 void lightCache_t::startUse()
 {
 	if(state!=USE)
 	{
-		vector<const lightSample_t *> pointers;
-		for(iterator i=begin();i!=end();++i) pointers.push_back(&(*i));
+		merge();
+		vector<const lightSample_t *> pointers(samples.size());
+		for(unsigned int i=0;i<samples.size();++i) pointers[i]=&samples[i];
 		tree=buildGenericTree(pointers,path_calc_bound,path_is_in_bound,
 				      path_get_pos,1);
 		state=USE;
@@ -184,6 +207,31 @@ CFLOAT lightCache_t::gatherSamples(const point3d_t &P,const point3d_t &pP,
 		return 0.0;
 }
 
+bool lightCache_t::findGood(const vector<lightSample_t> &samples,vector<int> &next,
+		lightAccum_t &a,const point3d_t &pP,const point3d_t &P,const vector3d_t &N,
+		CFLOAT (*W)(const lightSample_t &,const point3d_t &,const vector3d_t &,CFLOAT),
+		CFLOAT wlimit,bool reorder)const
+{
+	CFLOAT maxw=wlimit*2.0;
+	for(int l=a.first,prev=-1;l>=0;prev=l,l=next[l])
+	{
+		const lightSample_t &sample=samples[l];
+		//PFLOAT pD=polarDist(pP,sample.realPolar);
+		PFLOAT pD=polarDist(pP,sample.pP);
+		if(pD>cache_size) continue;
+		if((W(sample,P,N,maxw))<wlimit) continue;
+		// good samples to the front, next lookup finds them first
+		if(reorder && (prev>=0))
+		{
+			next[prev]=next[l];
+			next[l]=a.first;
+			a.first=l;
+		}
+		return true;
+	}
+	return false;
+}
+
 bool lightCache_t::enoughFor(const point3d_t &P,const vector3d_t &N,const renderState_t &state,
 				CFLOAT (*W)(const lightSample_t &,const point3d_t &,const vector3d_t &,CFLOAT),
 				CFLOAT wlimit)
@@ -197,29 +245,22 @@ bool lightCache_t::enoughFor(const point3d_t &P,const vector3d_t &N,const render
 	if(corr>0) pP.y/=corr; // realPolar
 	*/
 	lightAccum_t *a;
-	CFLOAT maxw=wlimit*2.0;
 
-	wait();
 	for(int i=cx;i<=(cx+1);i+=(i==cx) ? -1 : ((i<cx) ? 2 : 1) )
 		for(int j=cy;j<=(cy+1);j+=(j==cy) ? -1 : ((j<cy) ? 2 : 1) )
 			for(int k=cz;k<=(cz+1);k+=(k==cz) ? -1 : ((k<cz) ? 2 : 1) )
 			{
+				// previous passes, nobody writes there until startUse()
 				a=hash.findExistingBox(i,j,k);
-				if((a==NULL) || ! a->valid) continue;
-				for(list<lightSample_t>::iterator l=a->radiance.begin();
-							l!=a->radiance.end();++l)
-				{
-					//PFLOAT pD=polarDist(pP,l->realPolar);
-					PFLOAT pD=polarDist(pP,l->pP);
-					if(pD>cache_size) continue;
-					if((W(*l,P,N,maxw))<wlimit) continue;
-					a->radiance.push_front(*l);
-					a->radiance.erase(l);
-					signal();
+				if((a!=NULL) && findGood(samples,next,*a,pP,P,N,W,wlimit,false))
 					return true;
-				}
+				cacheShard_t &s=shard(i,j,k);
+				s.mutex.wait();
+				a=s.hash.findExistingBox(i,j,k);
+				bool good=(a!=NULL) && findGood(s.samples,s.next,*a,pP,P,N,W,wlimit,true);
+				s.mutex.signal();
+				if(good) return true;
 			}
-	signal();
 	return false;
 }
 
@@ -227,13 +268,23 @@ void lightCache_t::insert(const point3d_t &P,const renderState_t &state,const li
 {
 	//point3d_t pP=toPolar(P,sc);
 	point3d_t pP=toPolar(P,state);
-	wait();
-	lightAccum_t &nuevo=hash.findBox(pP);
-	if(!nuevo.valid) nuevo.radiance.clear(); // This line could be removed
-	nuevo.radiance.push_front(sample);
-	nuevo.valid=true; // To remove together with the other line
-	signal();
-	inserted++;
+	int x,y,z;
+	hash.getBox(pP,x,y,z);
+	cacheShard_t &s=shard(x,y,z);
+	s.mutex.wait();
+	lightAccum_t &nuevo=s.hash.findBox(pP);
+	s.next.push_back(nuevo.first);
+	nuevo.first=s.samples.size();
+	s.samples.push_back(sample);
+	s.mutex.signal();
+}
+
+void lightCache_t::seed(const lightSample_t &sample)
+{
+	lightAccum_t &a=hash.findBox(sample.pP);
+	next.push_back(a.first);
+	a.first=samples.size();
+	samples.push_back(sample);
 }
 
 __END_YAFRAY
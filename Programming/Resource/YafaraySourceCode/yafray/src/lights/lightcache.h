@@ -9,14 +9,27 @@
 #include "hash3d.h"
 #include "bound.h"
 #include "ccthreads.h"
+#include <vector>
 
 __BEGIN_YAFRAY
 
+/** Irradiance gradients of a sample, one vector per color channel.
+ *
+ * rot is the change with the normal and trans the change with the
+ * position, as in Ward and Heckbert "Irradiance gradients" (1992).
+ */
+struct lightGradient_t
+{
+	vector3d_t rot[3],trans[3];
+};
+
 struct lightSample_t
 {
 	lightSample_t(const vector3d_t &n,const color_t &c, PFLOAT a,const point3d_t &p,
-			const point3d_t &pp, PFLOAT m, PFLOAT prec,CFLOAT dev=1.0):
-		N(n),color(c),adist(a),M(m),precision(prec),P(p),pP(pp),deval(false),devaluated(dev)
+			const point3d_t &pp, PFLOAT m, PFLOAT prec,CFLOAT dev=1.0,
+			const lightGradient_t &g=lightGradient_t()):
+		N(n),color(c),adist(a),M(m),precision(prec),P(p),pP(pp),deval(false),devaluated(dev),
+		grad(g)
 		{
 			/*
 			realPolar=pp;
@@ -34,6 +47,17 @@ struct lightSample_t
 	//point3d_t realPolar;
 	bool deval;
 	CFLOAT devaluated;
+	lightGradient_t grad;
+
+	/// Color moved to p and n using the gradients
+	color_t at(const point3d_t &p,const vector3d_t &n)const
+	{
+		vector3d_t dP=p-P,dN=n-N;
+		CFLOAT r=color.getR()+grad.rot[0]*dN+grad.trans[0]*dP;
+		CFLOAT g=color.getG()+grad.rot[1]*dN+grad.trans[1]*dP;
+		CFLOAT b=color.getB()+grad.rot[2]*dN+grad.trans[2]*dP;
+		return color_t((r>0) ? r : 0,(g>0) ? g : 0,(b>0) ? b : 0);
+	};
 };
 
 struct foundSample_t
@@ -43,21 +67,49 @@ struct foundSample_t
 	PFLOAT weight;
 };
 
+/** Cell of the cache hash.
+ *
+ * The samples themselves live in one array, the cell only keeps the index
+ * of its first one and the rest are chained through a parallel array of
+ * next indices, so inserting never allocates more than the array growth.
+ */
 struct lightAccum_t
 {
-	lightAccum_t():valid(false),resample(true) {subdivision=1;};
-	std::list<lightSample_t> radiance;
-	int subdivision;
-	bool valid,resample;
+	lightAccum_t():first(-1) {};
+	int first;
+};
+
+/// Number of independent locks used while filling the cache
+#define CACHE_SHARDS 64
+
+/** Part of the cache cells being filled.
+ *
+ * Cells are spread over the shards by their coordinates and every shard
+ * has its own lock, so render threads only wait for each other when they
+ * touch cells of the same shard at the same time.
+ */
+struct cacheShard_t
+{
+	cacheShard_t(PFLOAT size):hash(size,5000) {};
+	yafthreads::mutex_t mutex;
+	hash3d_t<lightAccum_t> hash;
+	std::vector<lightSample_t> samples;
+	std::vector<int> next;
 };
 
 class lightCache_t
 {
 	public:
 		lightCache_t(PFLOAT size):
-			state(FILL),cache_size(size),hash(size,50000),tree(NULL),
-			inserted(0) {};
-		~lightCache_t() {if(state==USE) delete tree;};
+			state(FILL),cache_size(size),hash(size,50000),tree(NULL)
+		{
+			for(int i=0;i<CACHE_SHARDS;++i) shards[i]=new cacheShard_t(size);
+		};
+		~lightCache_t()
+		{
+			if(state==USE) delete tree;
+			for(int i=0;i<CACHE_SHARDS;++i) delete shards[i];
+		};
 
 		void setAspect(PFLOAT aspect) { ycorrection=1.0/aspect;};
 		void startFill()
@@ -73,30 +125,23 @@ class lightCache_t
 
 		typedef enum { FILL, USE } state_e;
 		bool ready()const {return state==USE;};
-		int size()const {return inserted;};
+		int size()const {return samples.size();};
 		
-		struct iterator
-		{
-			iterator(hash3d_t<lightAccum_t> &h);
-			void operator ++();
-			void operator ++(int) { operator ++();};
-
-			lightSample_t & operator * () {return *j;};
-
-			hash3d_t<lightAccum_t>::iterator i,iend;
-			std::list<lightSample_t>::iterator j,jend;
-		};
-
-		iterator begin() {return iterator(hash);};
-		char *   end() {return NULL;} // Hack to keep speed and stl look in loops.
-		void wait() {hash_mutex.wait();};
-		void signal() {hash_mutex.signal();};
-
+		typedef std::vector<lightSample_t>::iterator iterator;
+		iterator begin() {return samples.begin();};
+		iterator end() {return samples.end();};
+
+		/** While filling, the samples of previous passes are only read and
+		 * new ones go to the shards, merged back by startUse(). All of them
+		 * are seen by enoughFor() as soon as they are inserted, so the
+		 * sample density does not depend on the number of threads. */
 		bool enoughFor(const point3d_t &P,const vector3d_t &N,const renderState_t &state,
 				CFLOAT (*W)(const lightSample_t &,const point3d_t &,const vector3d_t &,CFLOAT),
 				CFLOAT wlimit);
 
 		void insert(const point3d_t &P,const renderState_t &state,const lightSample_t &sample);
+		/// Adds a sample from a previous render, only before filling starts
+		void seed(const lightSample_t &sample);
 
 		CFLOAT gatherSamples(const point3d_t &P,const point3d_t &pP,
 				const vector3d_t &N,std::vector<foundSample_t> &found,
@@ -111,45 +156,29 @@ class lightCache_t
 		};
 		PFLOAT polarDist(const point3d_t &a,const point3d_t &b)const {return (a-b).length();};
 	protected:
+		cacheShard_t & shard(int x,int y,int z)
+		{
+			unsigned int h=((unsigned int)x*73856093U)^((unsigned int)y*19349663U)^
+				((unsigned int)z*83492791U);
+			return *shards[h%CACHE_SHARDS];
+		};
+		bool findGood(const std::vector<lightSample_t> &samples,std::vector<int> &next,
+				lightAccum_t &a,const point3d_t &pP,const point3d_t &P,const vector3d_t &N,
+				CFLOAT (*W)(const lightSample_t &,const point3d_t &,const vector3d_t &,CFLOAT),
+				CFLOAT wlimit,bool reorder)const;
+		void merge();
+
 		state_e state;
 		PFLOAT cache_size;
-		yafthreads::mutex_t hash_mutex;
 		hash3d_t<lightAccum_t> hash;
+		std::vector<lightSample_t> samples;
+		std::vector<int> next;
+		cacheShard_t *shards[CACHE_SHARDS];
+		/// Points into samples, which only grows again after startFill()
 		gBoundTreeNode_t<const lightSample_t *> *tree;
-		int inserted;
 		PFLOAT ycorrection;
 };
 
-inline lightCache_t::iterator::iterator(hash3d_t<lightAccum_t> &h)
-{
-	i=h.begin();
-	iend=h.end();
-	if(i!=iend)
-	{
-		j=(*i).radiance.begin();
-		jend=(*i).radiance.end();
-	}
-}
-
-inline void lightCache_t::iterator::operator ++()
-{
-	j++;
-	if(j==jend)
-	{
-		i++;
-		if(i!=iend)
-		{
-			j=(*i).radiance.begin();
-			jend=(*i).radiance.end();
-		}
-	}
-}
-
-inline bool operator != (lightCache_t::iterator &ite,char *) // WARNING : hack to speed up i!=cache.end()
-{
-	return ite.i!=ite.iend;
-}
-
 /*
 inline point3d_t toPolar(const point3d_t &P,const scene_t &sc)
 {
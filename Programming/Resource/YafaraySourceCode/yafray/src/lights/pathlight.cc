@@ -21,6 +21,9 @@
  */
 
 #include "pathlight.h"
+#include "yafsystem.h"
+#include <algorithm>
+#include <limits>
 using namespace std;
 
 __BEGIN_YAFRAY
@@ -35,7 +38,8 @@ pathLight_t::pathLight_t(int nsam, CFLOAT pwr, int depth,int cdepth,bool uQ,
 		bool _occmode, PFLOAT occdist, bool _ignorms)
 		: samples(nsam), power(pwr), maxdepth(depth),maxcausdepth(cdepth),use_QMC(uQ),
 cache(ca),maxrefinement(ref),recalculate(recal),direct(di),show_samples(shows),
-gridsize(grids),threshold(thr), occmode(_occmode), occ_maxdistance(occdist), ignorms(_ignorms)
+gridsize(grids),threshold(thr), occmode(_occmode), occ_maxdistance(occdist), ignorms(_ignorms),
+importance(true), bgsampler(NULL), gradient(false)
 {
 	if(cache) 
 	{
@@ -90,17 +94,93 @@ pathLight_t::~pathLight_t()
 
 void pathLight_t::init(scene_t &scene)
 {
+	use_in_indirect=false;
+	scene.getPublishedData("globalPhotonMap",pmap);
+	scene.getPublishedData("irradianceGlobalPhotonMap",imap);
+	scene.getPublishedData("irradianceHashMap",irhash);
+	bgsampler=(occmode && importance) ? scene.backgroundSampler() : NULL;
 	if(cache)
 	{
 		lightcache->setAspect(scene.getAspectRatio());
 		lightcache->startFill();
+		// samples of the previous frame seed the cache, the fake passes
+		// only add what the new view is missing
+		if((cacheFile!="") && !cacheKey(scene,cachekey))
+		{
+			WARNING<<"Some lights can't be keyed, not using "<<cacheFile<<endl;
+			cacheFile="";
+		}
+		if(cacheFile!="") loadCache(scene);
 		scene.setRepeatFirst();
 		devaluated = 1.0;
 	}
-	use_in_indirect=false;
-	scene.getPublishedData("globalPhotonMap",pmap);
-	scene.getPublishedData("irradianceGlobalPhotonMap",imap);
-	scene.getPublishedData("irradianceHashMap",irhash);
+}
+
+// Samples only depend on the geometry, the lights and the sampling
+// settings. Shaders are not in the key, like in globalphotonlight.
+// False if a light can't be keyed.
+bool pathLight_t::cacheKey(scene_t &scene,unsigned long long &value)const
+{
+	keyHash_t key;
+	key.add(samples);
+	key.add(maxdepth);
+	key.add(maxcausdepth);
+	key.add(use_QMC);
+	key.add(occmode);
+	key.add(occ_maxdistance);
+	key.add(ignorms);
+	key.add(imap!=NULL);
+	scene.hashGeometry(key);
+	bool keyed=true;
+	for(scene_t::light_iterator i=scene.lightsBegin();i!=scene.lightsEnd();++i)
+	{
+		emitter_t *e=(*i)->getEmitter(1);
+		if(e==NULL) continue;
+		if(!e->hashEmission(key)) keyed=false;
+		delete e;
+	}
+	value=key.value();
+	return keyed;
+}
+
+void pathLight_t::loadCache(scene_t &scene)
+{
+	cacheReader_t cache(cacheFile,"YAFLCAC2",cachekey);
+	const lightSample_t *old;
+	unsigned int count;
+	cache.readArray(old,count);
+	if(!cache.ok()) return;
+
+	// screen position and precision depend on the view, they are taken
+	// again as if the sample was hit by a camera ray
+	camera_t *cam=scene.getCamera();
+	PFLOAT resx=cam->resX(),resy=cam->resY();
+	renderState_t state;
+	int used=0;
+	for(unsigned int i=0;i<count;++i)
+	{
+		const lightSample_t &o=old[i];
+		PFLOAT px,py,dist;
+		if(!cam->project(o.P,px,py,dist)) continue;
+		state.screenpos.set(2.0*(px/resx)-1.0,1.0-2.0*(py/resy),0);
+		// some margin, so borders don't need new samples
+		if((fabs(state.screenpos.x)>1.25) || (fabs(state.screenpos.y)>1.25)) continue;
+		state.traveled=dist;
+		lightcache->seed(lightSample_t(o.N,o.color,o.adist,o.P,lightcache->toPolar(o.P,state),
+					o.M,dist*scene.getWorldResolution(),1.0,o.grad));
+		used++;
+	}
+	cout<<"Reused "<<used<<" of "<<count<<" cached light samples from "<<cacheFile<<endl;
+}
+
+void pathLight_t::saveCache()const
+{
+	vector<lightSample_t> v;
+	v.reserve(lightcache->size());
+	for(lightCache_t::iterator i=lightcache->begin();i!=lightcache->end();++i) v.push_back(*i);
+	cacheWriter_t cache(cacheFile,"YAFLCAC2",cachekey);
+	cache.writeArray(v);
+	if(!cache.ok()) WARNING<<"Could not save light cache to "<<cacheFile<<endl;
 }
 
 
@@ -168,10 +248,10 @@ color_t pathLight_t::getLight(renderState_t &state,const surfacePoint_t &sp,
 				PFLOAT div=0.0;
 				for(vector<foundPhoton_t>::iterator i=found.begin();i!=found.end();++i)
 				{
-					PFLOAT factor=i->photon->direction()*N*(1.0-i->dis/farest);
+					PFLOAT factor=i->photon.direction()*N*(1.0-i->dis/farest);
 					if(factor>0)
 					{
-						total+=i->photon->color()*factor;
+						total+=i->photon.color()*factor;
 						div+=factor;
 					}
 				}
@@ -222,7 +302,7 @@ static bool followCaustic(vector3d_t &ray,color_t &raycolor,
 
 color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 		const surfacePoint_t &sp, const scene_t &sc, PFLOAT &avgD, PFLOAT &minD,
-		bool caching) const
+		bool caching,lightGradient_t *grad) const
 {
 	PFLOAT maxdist=1000000*sc.getWorldResolution()*sp.Z();
 	int oldlevel=state.rayDivision;
@@ -234,13 +314,22 @@ color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 
 	if(localsamples==0) localsamples=1;
 	color_t total(0.0),subtotal[4];
-	PFLOAT HNUM=0,HD=0,H,M=0;
+	PFLOAT HNUM=0,HD=0,H=0,M=0;
 
 	photonData_t *data=getPhotonData(state);
 	if(direct) {avgD=maxdist;minD=maxdist;return getLight(state,sp,sc,N,data);}
 	hemiSampler_t *sampler=getSampler(state,sc);
 	sampler->samplingFrom(state,sp.P(),N,sp.NU(),sp.NV());
 	bool first=true;
+	pathBatch_t *batch=getBatch(state);
+	// gradients need cosine distributed directions, not the photon sampler
+	bool grads=caching && (grad!=NULL) && !((pmap!=NULL) && (samples>96));
+	if(grads)
+	{
+		batch->dir.resize(samples);
+		batch->value.assign(samples,color_t(0.0));
+		batch->dist.assign(samples,maxdist);
+	}
 	CFLOAT repetitions=0.0;
 	
 	for(int ite=1;ite>0;--ite,repetitions+=1.0)
@@ -257,6 +346,7 @@ color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 				{
 					HNUM += 1;
 					vector3d_t dir = sampler->nextDirection(sp.P(), N, sp.NU(), sp.NV(), sm, 0, tcol);
+					if (grads && first) batch->dir[sm]=dir;
 					if (occ_maxdistance>0) {
 						// distance limited mode
 						// normal unbiased hittest (no distance limit) to record correct mean harmdist.
@@ -265,6 +355,7 @@ color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 						{
 							if (tempsp.Z()>0) HD += 1.0/tempsp.Z();
 							if ((tempsp.Z()<M) || (M==0)) M = tempsp.Z();
+							if (grads && first) batch->dist[sm]=tempsp.Z();
 							bghit = false;
 						}
 						// except that if z>maxdistance, assume background hit as well
@@ -272,6 +363,7 @@ color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 							color_t contri(sc.getBackground(dir, state, true) * fabs(dir*N));
 							total += contri;
 							if (first) subtotal[sm & 3] += contri;
+							if (grads && first) batch->value[sm] += contri;
 						}
 					}
 					else {
@@ -281,69 +373,129 @@ color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 							color_t contri(sc.getBackground(dir, state, true) * fabs(dir*N));
 							total += contri;
 							if (first) subtotal[sm & 3] += contri;
+							if (grads && first) batch->value[sm] += contri;
 						}
 						else {
 							if (tempsp.Z()>0) HD += 1.0/tempsp.Z();
 							if ((tempsp.Z()<M) || (M==0)) M = tempsp.Z();
+							if (grads && first) batch->dist[sm]=tempsp.Z();
 						}
 					}
 				}
 			}
 			else {
+				// With a background sampler the last half of the directions
+				// come from it instead, all weighted by the mix of both pdfs
+				// over the cosine one. Each half is jittered over the whole
+				// square on its own, the sampler's strata are for all of them.
+				// The photon sampler is not cosine, it is left alone.
+				int nbg = (bgsampler && !((pmap!=NULL) && (samples>96))) ? (samples+1)/2 : 0;
+				int ncos = samples-nbg;
+				PFLOAT fbg = nbg/(PFLOAT)samples;
 				for (int sm=0;sm<samples;sm++)
 				{
+					// still asked for every sample, it keeps the count for multiplier()
 					vector3d_t dir = sampler->nextDirection(sp.P(), N, sp.NU(), sp.NV(), sm, 0, tcol);
+					CFLOAT w = 1;
+					if (nbg) {
+						PFLOAT z1, z2, bgpdf;
+						if (sm<ncos) {
+							jitteredSample(sm, ncos, z1, z2);
+							z2 *= 2.0*M_PI;
+							dir = (sp.NU()*cos(z2) + sp.NV()*sin(z2))*sqrt(1.0-z1) + N*sqrt(z1);
+							bgpdf = bgsampler->pdf(dir);
+						}
+						else {
+							jitteredSample(sm-ncos, nbg, z1, z2);
+							dir = bgsampler->sample(z1, z2, bgpdf);
+							if (bgpdf<=0) continue;
+						}
+						PFLOAT cospdf = (dir*N)*M_1_PI;
+						PFLOAT mix = (1.0-fbg)*cospdf + fbg*bgpdf;
+						if ((cospdf<=0) || (mix<=0)) continue;
+						w = cospdf/mix;
+					}
 					if (!((occ_maxdistance>0) ?
 								sc.isShadowed(state, sp, sp.P()+occ_maxdistance*dir) :
 								sc.isShadowed(state, sp, dir)))
-						total += sc.getBackground(dir, state, true) * fabs(dir*N);
+						total += sc.getBackground(dir, state, true) * (fabs(dir*N)*w);
 				}
 			}
 		}
 		else {
-			// full GI
+			// full GI, done breadth first: all the rays of one bounce are
+			// intersected together, sorted by octant, and then shaded
+			vector<pathRay_t> &rays=batch->rays,&next=batch->next;
+			rays.resize(samples);
 			for(int i=0;i<samples;++i)
 			{
-				color_t raycolor(1.0);
-				vector3d_t ray = sampler->nextDirection(sp.P(),N, sp.NU(), sp.NV(), i, 0,raycolor);
-				vector3d_t startray = ray;
-				point3d_t where = sp.P();
+				pathRay_t &r=rays[i];
+				r.raycolor=color_t(1.0);
+				r.ray=sampler->nextDirection(sp.P(),N, sp.NU(), sp.NV(), i, 0,r.raycolor);
+				r.startray=r.ray;
+				r.where=sp.P();
+				r.origin=sp.getOrigin();
+				r.sample=i;
+				r.level=r.clevel=0;
+				if(grads && first) batch->dir[i]=r.ray;
 				if(caching) HNUM+=1;
-				state.skipelement=sp.getOrigin();
-				for(int j=0,cj=0;j<maxdepth;++j)
+			}
+			if(maxdepth<1) rays.clear();
+			while(!rays.empty())
+			{
+				for(vector<pathRay_t>::iterator r=rays.begin();r!=rays.end();++r)
+					r->octant=(r->ray.x<0) | ((r->ray.y<0)<<1) | ((r->ray.z<0)<<2);
+				sort(rays.begin(),rays.end());
+				unsigned int n=rays.size();
+				if(batch->hits.size()<n) {batch->hits.resize(n);batch->hit.resize(n);}
+				for(unsigned int k=0;k<n;++k)
 				{
-					if (raycolor.energy()<0.05) break;
-					surfacePoint_t tempsp;
-					if (!sc.firstHit(state,tempsp, where, ray, true)) //background reached
+					state.skipelement=rays[k].origin;
+					batch->hit[k]=sc.firstHit(state,batch->hits[k],rays[k].where,rays[k].ray,true);
+				}
+				next.clear();
+				for(unsigned int k=0;k<n;++k)
+				{
+					pathRay_t &r=rays[k];
+					int i=r.sample,j=r.level;
+					if (!batch->hit[k]) //background reached
 					{
-						color_t contri=(startray*N)*raycolor*sc.getBackground(ray, state, true);
+						color_t contri=(r.startray*N)*r.raycolor*sc.getBackground(r.ray, state, true);
 						total += contri;
 						if(first) subtotal[i%4]+=contri;
-						break;
+						if(grads && first) batch->value[i]+=contri;
+						continue;
 					}
-
-					if(caching)
+					surfacePoint_t &tempsp=batch->hits[k];
+					if(caching && (j==0) && (r.clevel==0))
 					{
-						if((j==0) && (cj==0) && (tempsp.Z()>0)) HD+=1.0/tempsp.Z();
-						if((j==0) && (cj==0) && ((tempsp.Z()<M) || (M==0)) ) M=tempsp.Z();
+						if(tempsp.Z()>0) HD+=1.0/tempsp.Z();
+						if((tempsp.Z()<M) || (M==0)) M=tempsp.Z();
+						if(grads && first) batch->dist[i]=tempsp.Z();
 					}
-					color_t light = getLight(state,tempsp,sc,-ray,data);
-					color_t contri=(startray*N)*raycolor*light;
+					state.skipelement=r.origin;
+					color_t light = getLight(state,tempsp,sc,-r.ray,data);
+					color_t contri=(r.startray*N)*r.raycolor*light;
 					total += contri;
 					if(first) subtotal[i%4]+=contri;
+					if(grads && first) batch->value[i]+=contri;
 					vector3d_t NN;
 					if (ignorms && caching) NN=tempsp.Nd(); else NN=tempsp.N();
-					vector3d_t HN = FACE_FORWARD(tempsp.Ng(), NN, -ray);
-					if(!followCaustic(ray,raycolor, NN, HN, tempsp.getObject()))
+					vector3d_t HN = FACE_FORWARD(tempsp.Ng(), NN, -r.ray);
+					if(!followCaustic(r.ray,r.raycolor, NN, HN, tempsp.getObject()))
 					{
-						raycolor *= tempsp.getShader()->getDiffuse(state, tempsp, -ray);
-						ray = sampler->nextDirection(tempsp.P(),HN, tempsp.NU(), tempsp.NV(),
-								i, j+1,raycolor);
+						r.raycolor *= tempsp.getShader()->getDiffuse(state, tempsp, -r.ray);
+						r.ray = sampler->nextDirection(tempsp.P(),HN, tempsp.NU(), tempsp.NV(),
+								i, j+1,r.raycolor);
+						r.level++;
 					}
-					else if(cj<maxcausdepth) {cj++;j--;}
-					where = tempsp.P();
-					state.skipelement=tempsp.getOrigin();
+					else if(r.clevel<maxcausdepth) r.clevel++;
+					else r.level++;
+					r.where = tempsp.P();
+					r.origin=tempsp.getOrigin();
+					if((r.level<maxdepth) && (r.raycolor.energy()>=0.05)) next.push_back(r);
 				}
+				rays.swap(next);
 			}
 		}
 		if(first)
@@ -380,12 +532,130 @@ color_t pathLight_t::takeSample(renderState_t &state, const vector3d_t &N,
 		avgD=H;
 		minD=M;
 	}
+	if(grads)
+	{
+		// in corners H goes to zero, the gradient is limited as if the
+		// nearest hit was a few cache cells away
+		PFLOAT minH=2.0*searchRadius*state.traveled;
+		gradients(*batch,sp,N,sampler->multiplier(),(H>minH) ? H : minH,*grad);
+	}
 	state.rayDivision=oldlevel;
 	state.skipelement=oldorigin;
 	total*=sampler->multiplier()/repetitions;
 	return total;
 }
 
+/* Rotational gradient: the estimate is the sum of the sample colors and
+ * each of them goes with the cosine to the normal, tilting the normal
+ * changes it by the tangent component of the direction over the cosine.
+ * Translational gradient: Ward and Heckbert's stratified estimate, the
+ * directions are binned in the sin^2(theta),phi strata of the hemisphere
+ * and the differences between neighbour strata are weighted by the
+ * distance to the nearest hit. With non stratified samplers it is only
+ * done when every stratum got some sample. */
+void pathLight_t::gradients(pathBatch_t &batch,const surfacePoint_t &sp,const vector3d_t &N,
+		CFLOAT mult,PFLOAT H,lightGradient_t &grad)const
+{
+	const vector3d_t &Ru=sp.NU(),&Rv=sp.NV();
+	int n=batch.dir.size();
+	vector3d_t rot[3],trans[3];
+	for(int i=0;i<n;++i)
+	{
+		const vector3d_t &d=batch.dir[i];
+		PFLOAT cosT=d*N;
+		if(cosT<0.1) cosT=0.1;
+		vector3d_t t=(d-(d*N)*N)*(1.0/cosT);
+		rot[0]+=batch.value[i].getR()*t;
+		rot[1]+=batch.value[i].getG()*t;
+		rot[2]+=batch.value[i].getB()*t;
+	}
+	for(int c=0;c<3;++c) grad.rot[c]=mult*rot[c];
+
+	int g=(int)sqrt((float)n);
+	if(g<2) return;
+	batch.cellValue.assign(g*g,color_t(0.0));
+	batch.cellDist.assign(g*g,numeric_limits<PFLOAT>::infinity());
+	batch.cellCount.assign(g*g,0);
+	for(int i=0;i<n;++i)
+	{
+		const vector3d_t &d=batch.dir[i];
+		PFLOAT cosT=d*N;
+		int j=(int)((1.0-cosT*cosT)*g);
+		PFLOAT phi=atan2(d*Rv,d*Ru);
+		if(phi<0) phi+=2.0*M_PI;
+		int k=(int)(phi*g/(2.0*M_PI));
+		if(j<0) j=0; else if(j>=g) j=g-1;
+		if(k<0) k=0; else if(k>=g) k=g-1;
+		int cell=j*g+k;
+		batch.cellValue[cell]+=batch.value[i];
+		if(batch.dist[i]<batch.cellDist[cell]) batch.cellDist[cell]=batch.dist[i];
+		batch.cellCount[cell]++;
+	}
+	for(int i=0;i<g*g;++i)
+	{
+		if(batch.cellCount[i]==0) return;
+		batch.cellValue[i]*=1.0/(CFLOAT)batch.cellCount[i];
+	}
+	const vector<color_t> &L=batch.cellValue;
+	const vector<PFLOAT> &R=batch.cellDist;
+	PFLOAT pdiv=2.0*M_PI/(PFLOAT)g;
+	for(int k=0;k<g;++k)
+	{
+		int km=(k+g-1)%g;
+		PFLOAT phi=pdiv*((PFLOAT)k+0.5);
+		vector3d_t u=Ru*cos(phi)+Rv*sin(phi);
+		phi=pdiv*(PFLOAT)k+0.5*M_PI;
+		vector3d_t v=Ru*cos(phi)+Rv*sin(phi);
+		for(int j=0;j<g;++j)
+		{
+			PFLOAT s2=(PFLOAT)j/(PFLOAT)g;
+			PFLOAT sinm=sqrt(s2),sinp=sqrt((PFLOAT)(j+1)/(PFLOAT)g);
+			int a=j*g+k;
+			if(j>0)
+			{
+				int b=a-g;
+				PFLOAT r=(R[a]<R[b]) ? R[a] : R[b];
+				if(r>0)
+				{
+					PFLOAT f=pdiv*sinm*(1.0-s2)/r;
+					color_t diff=L[a]-L[b];
+					trans[0]+=(f*diff.getR())*u;
+					trans[1]+=(f*diff.getG())*u;
+					trans[2]+=(f*diff.getB())*u;
+				}
+			}
+			int b=j*g+km;
+			PFLOAT r=(R[a]<R[b]) ? R[a] : R[b];
+			if(r>0)
+			{
+				PFLOAT f=(sinp-sinm)/r;
+				color_t diff=L[a]-L[b];
+				trans[0]+=(f*diff.getR())*v;
+				trans[1]+=(f*diff.getG())*v;
+				trans[2]+=(f*diff.getB())*v;
+			}
+		}
+	}
+	// Ward's estimate is scaled by pi/(strata), the colors here by mult.
+	// Single samples per stratum and very close hits make it noisy, so it
+	// can't change the color more than the color itself over the harmonic
+	// mean distance
+	CFLOAT col[3]={0,0,0};
+	for(int i=0;i<n;++i)
+	{
+		col[0]+=batch.value[i].getR();
+		col[1]+=batch.value[i].getG();
+		col[2]+=batch.value[i].getB();
+	}
+	for(int c=0;c<3;++c)
+	{
+		trans[c]*=1.0/M_PI;
+		PFLOAT len=trans[c].length(),limit=mult*col[c]/H;
+		if(len>limit) trans[c]*=limit/len;
+		grad.trans[c]=trans[c];
+	}
+}
+
 color_t pathLight_t::normalSample(renderState_t &state,const scene_t &sc, 
 		const surfacePoint_t sp, const vector3d_t &eye) const
 {
@@ -572,7 +842,8 @@ color_t pathLight_t::interpolate(renderState_t &state,const scene_t &s,
 	CFLOAT amount=0;
 	for(vector<foundSample_t>::iterator i=samples.begin();i!=samples.end();++i)
 	{
-		total+=i->weight*i->S->color;
+		if(gradient) total+=i->weight*i->S->at(sp.P(),N);
+		else total+=i->weight*i->S->color;
 		amount+=i->weight;
 	}
 	if(amount!=0) 
@@ -587,73 +858,93 @@ color_t pathLight_t::interpolate(renderState_t &state,const scene_t &s,
 		cout<<".";cout.flush();
 		PFLOAT H,M;
 		if (ignorms) N = FACE_FORWARD(sp.Ng(), sp.Nd(), eye);
-		color_t ncol=takeSample(state,N,sp,s,H,M,true);
+		lightGradient_t grad;
+		color_t ncol=takeSample(state,N,sp,s,H,M,true,gradient ? &grad : NULL);
 		proxy->addSample(state,lightSample_t(N,ncol,H, sp.P(),
-			            lightcache->toPolar(sp.P(),state),M,state.traveled*s.getWorldResolution(),1.0));
+			            lightcache->toPolar(sp.P(),state),M,state.traveled*s.getWorldResolution(),1.0,grad));
 			            //toPolar(sp.P(),s),M,state.traveled*s.getWorldResolution(),1.0));
 		return sp.getShader()->getDiffuse(state, sp, eye)*ncol*power;
 	}
 }
 
-void pathLight_t::setIrradiance(lightSample_t &sample,PFLOAT &radius)
+void pathLight_t::setIrradiance(lightSample_t &sample,PFLOAT &radius,
+		vector<foundSample_t> &found)const
 {
 	vector3d_t &N = sample.N;
 	//point3d_t &pP= sample.realPolar;
 	point3d_t &pP= sample.pP;
 	point3d_t &P= sample.P;
-	stsamples.clear();
+	found.clear();
 	CFLOAT farest;
 
-	farest=lightcache->gatherSamples(P,pP,N,stsamples,search,radius,searchRadius,
+	farest=lightcache->gatherSamples(P,pP,N,found,search,radius,searchRadius,
 																		2,pathLight_t::weightNoDev,weightLimit);
 	
-	if(stsamples.size()==1) farest=0;
+	if(found.size()==1) farest=0;
 	else if(farest>weightLimit) farest=weightLimit;
 
-	for(vector<foundSample_t>::iterator i=stsamples.begin();i!=stsamples.end();++i)
+	for(vector<foundSample_t>::iterator i=found.begin();i!=found.end();++i)
 		i->weight=(i->weight-farest)*(1.0-i->dis/searchRadius);
 
 	color_t total(0,0,0);
 	CFLOAT amount=0;
-	for(vector<foundSample_t>::iterator i=stsamples.begin();i!=stsamples.end();++i)
+	for(vector<foundSample_t>::iterator i=found.begin();i!=found.end();++i)
 	{
-		total+=i->weight*i->S->color;
+		if(gradient) total+=i->weight*i->S->at(P,N);
+		else total+=i->weight*i->S->color;
 		amount+=i->weight;
 	}
 	if(amount!=0) amount=1.0/amount;
 	sample.mixed=total*power*amount;
 }
 
-bool pathLight_t::testRefinement(const scene_t &sc)
+// Both refinement sweeps run on all the threads of the render. Every
+// thread has its own search radius and found samples.
+
+struct irradianceWork_t : public yafthreads::parallelWork_t
 {
-	if(threshold>=1.0) return false;
-	if(refined>=maxrefinement)
+	irradianceWork_t(const pathLight_t &p,vector<lightSample_t *> &s,int threads):
+		path(p),samples(s),radius(threads,p.searchRadius),found(threads) {};
+	virtual void work(int begin,int end,int thread)
 	{
-		for(lightCache_t::iterator i=lightcache->begin();i!=lightcache->end();++i)
-			(*i).devaluated=1.0;
-		return false;
+		for(int i=begin;i<end;++i)
+			path.setIrradiance(*samples[i],radius[thread],found[thread]);
 	}
-	devaluated*=2;
-	refined++;
-	bool changed=false;
-	int change=0;
-	int num=0;
-
-	PFLOAT mixradius=searchRadius;
-	for(lightCache_t::iterator i=lightcache->begin();i!=lightcache->end();++i)
-		setIrradiance(*i,mixradius);
+	const pathLight_t &path;
+	vector<lightSample_t *> &samples;
+	vector<PFLOAT> radius;
+	vector< vector<foundSample_t> > found;
+};
 
-	vector<foundSample_t> samples;
-	mixradius=searchRadius;
-	for(lightCache_t::iterator i=lightcache->begin();i!=lightcache->end();++i)
+struct refinementWork_t : public yafthreads::parallelWork_t
+{
+	refinementWork_t(const pathLight_t &p,const scene_t &s,vector<lightSample_t *> &sa,
+			int threads):path(p),sc(s),samples(sa),radius(threads,p.searchRadius),
+			found(threads),change(threads,0) {};
+	virtual void work(int begin,int end,int thread);
+	const pathLight_t &path;
+	const scene_t &sc;
+	vector<lightSample_t *> &samples;
+	vector<PFLOAT> radius;
+	vector< vector<foundSample_t> > found;
+	vector<int> change;
+};
+
+// Only the devaluation of the sample itself is written, the weights used
+// in the search don't read it, so the order of the samples doesn't matter.
+void refinementWork_t::work(int begin,int end,int thread)
+{
+	vector<foundSample_t> &fs=found[thread];
+	for(int s=begin;s<end;++s)
 	{
+		lightSample_t &sample=*samples[s];
 		CFLOAT minR=1000,minG=1000,minB=1000;
 		CFLOAT maxR=0,maxG=0,maxB=0;
-		samples.clear();
-		//lightcache->gatherSamples((*i).P,(*i).realPolar,(*i).N,samples,5,mixradius,searchRadius,
-		lightcache->gatherSamples((*i).P,(*i).pP,(*i).N,samples,5,mixradius,searchRadius,
-				5,pathLight_t::weightNoDist,weightLimit);
-		for(vector<foundSample_t>::iterator j=samples.begin();j!=samples.end();++j)
+		fs.clear();
+		//lightcache->gatherSamples(sample.P,sample.realPolar,sample.N,fs,5,radius[thread],path.searchRadius,
+		lightcache->gatherSamples(sample.P,sample.pP,sample.N,fs,5,radius[thread],path.searchRadius,
+				5,pathLight_t::weightNoDist,path.weightLimit);
+		for(vector<foundSample_t>::iterator j=fs.begin();j!=fs.end();++j)
 		{
 			if (j->S->mixed.getR()>maxR) maxR = j->S->mixed.getR();
 			if (j->S->mixed.getG()>maxG) maxG = j->S->mixed.getG();
@@ -664,22 +955,50 @@ bool pathLight_t::testRefinement(const scene_t &sc)
 		}
 		
 		color_t min(minR,minG,minB),max(maxR,maxG,maxB);
-		min=min*power;
-		max=max*power;
+		min=min*path.power;
+		max=max*path.power;
 		sc.adjustColor(min);
 		sc.adjustColor(max);
 		min.clampRGB01();
 		max.clampRGB01();
-		if((maxAbsDiff(max,min))>threshold)
+		if((maxAbsDiff(max,min))>path.threshold)
 		{
-			(*i).devaluated=devaluated;
-			changed=true;
-			change++;
+			sample.devaluated=path.devaluated;
+			change[thread]++;
 		}
-		num++;
 	}
-	cout<<"\nRefinement:"<<change<<"/"<<num<<"   "<<endl;
-	return changed;
+}
+
+bool pathLight_t::testRefinement(const scene_t &sc)
+{
+	if(threshold>=1.0) return false;
+	if(refined>=maxrefinement)
+	{
+		for(lightCache_t::iterator i=lightcache->begin();i!=lightcache->end();++i)
+			(*i).devaluated=1.0;
+		return false;
+	}
+	double start=wallClock();
+	devaluated*=2;
+	refined++;
+
+	vector<lightSample_t *> all;
+	all.reserve(lightcache->size());
+	for(lightCache_t::iterator i=lightcache->begin();i!=lightcache->end();++i)
+		all.push_back(&(*i));
+	int threads=(sc.getCPUs()>1) ? sc.getCPUs() : 1;
+
+	irradianceWork_t irr(*this,all,threads);
+	yafthreads::parallelFor(irr,all.size(),threads);
+
+	refinementWork_t ref(*this,sc,all,threads);
+	yafthreads::parallelFor(ref,all.size(),threads);
+	int change=0;
+	for(int i=0;i<threads;++i) change+=ref.change[i];
+
+	cout<<"\nRefinement:"<<change<<"/"<<all.size()<<"   "<<endl;
+	cout<<"Refinement time: "<<(wallClock()-start)<<"s"<<endl;
+	return change>0;
 }
 
 color_t pathLight_t::cached(renderState_t &state,const scene_t &sc,
@@ -697,10 +1016,12 @@ color_t pathLight_t::cached(renderState_t &state,const scene_t &sc,
 	if(!lightcache->enoughFor(sp.P(),N,state,pathLight_t::weightNoPrec,desiredWeight*rq))
 	{
 		PFLOAT H,M;
-		total=takeSample(state,N,sp,sc,H,M,true);
+		lightGradient_t grad;
+		total=takeSample(state,N,sp,sc,H,M,true,gradient ? &grad : NULL);
 
 		lightcache->insert(sp.P(),state,lightSample_t(N,total,H, sp.P(),
-						lightcache->toPolar(sp.P(),state),M,state.traveled*sc.getWorldResolution(),devaluated));
+						lightcache->toPolar(sp.P(),state),M,state.traveled*sc.getWorldResolution(),devaluated,
+						grad));
 						//toPolar(sp.P(),sc),M,state.traveled*sc.getWorldResolution(),devaluated));
 		total.set(1,1,1);
 	}
@@ -719,7 +1040,10 @@ void pathLight_t::postInit(scene_t &scene)
 		lightcache->startFill();
 	}
 	else
+	{
 		cout << lightcache->size() << " samples taken\n";
+		if(cacheFile!="") saveCache();
+	}
 }
 
 hemiSampler_t *pathLight_t::getSampler(renderState_t &state,const scene_t &sc)const
@@ -737,6 +1061,18 @@ hemiSampler_t *pathLight_t::getSampler(renderState_t &state,const scene_t &sc)co
 	return sam;
 }
 
+pathBatch_t *pathLight_t::getBatch(renderState_t &state)const
+{
+	bool present;
+	pathBatch_t *batch=state.context.getDestructible(_batch,present);
+	if(!present)
+	{
+		batch=new pathBatch_t;
+		state.context.storeDestructible(_batch,batch);
+	}
+	return batch;
+}
+
 cacheProxy_t *pathLight_t::getProxy(renderState_t &state,const scene_t &sc)const
 {
 	bool present;
@@ -775,6 +1111,9 @@ light_t *pathLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	params.getParam("threshold",thr);
 	params.getParam("max_refinement",ref);
 
+	string _cfile;
+	const string *cfile=&_cfile;
+
 	// new mode parameter
 	string _mode = ":)";
 	const string *mode=&_mode;
@@ -782,6 +1121,8 @@ light_t *pathLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	bool occmode = (*mode=="occlusion");
 	PFLOAT occdist = -1;
 	params.getParam("maxdistance", occdist);
+	bool importance = true;
+	params.getParam("importance", importance);
 
 	if (samples<1) {
 		WARNING << "Samples value too low, minimum is one\n";
@@ -797,12 +1138,20 @@ light_t *pathLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 		params.getParam("show_samples",show_samples);
 		params.getParam("gradient",useg);
 		params.getParam("ignore_bumpnormals", ignorms);
+		// file to carry the samples to the next frame, see init()
+		params.getParam("cache_file",cfile);
 		if(search<3) search=3;
 		//render.repeatFirstPass();
 	}
 	pathLight_t *path=new pathLight_t(samples, power, depth,cdepth, useqmc,
 			cache,cache_size,thr,recalculate,direct,show_samples,grid,ref, occmode, occdist, ignorms);
-	if(cache) path->setCacheThreshold(shadt,search);
+	if(cache)
+	{
+		path->setCacheThreshold(shadt,search);
+		path->setCacheFile(*cfile);
+		path->setGradient(useg);
+	}
+	path->setImportance(importance);
 	return path;
 }
 
@@ -834,8 +1183,10 @@ pluginInfo_t pathLight_t::info()
 				number of values to do interpolation"));
 	info.params.push_back(buildInfo<BOOL>("show_samples","Show the sample \
 				distribution instead of lighting"));
-	info.params.push_back(buildInfo<BOOL>("gradient","Activates the use of \
-				gradients. Not working fine, but can solve some artifacts"));
+	info.params.push_back(buildInfo<BOOL>("gradient","Cache mode: Interpolate using \
+				irradiance gradients, a higher shadow_threshold gives the same quality"));
+	info.params.push_back(buildInfo<BOOL>("importance","Occlusion mode without cache: \
+				send half the samples to the bright parts of image backgrounds"));
 
 	return info;
 			
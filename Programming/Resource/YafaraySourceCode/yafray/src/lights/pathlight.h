@@ -56,10 +56,45 @@ class photonData_t : public context_t::destructible
 		std::vector<foundPhoton_t> *found;
 };
 
+/// Hemisphere ray in flight, see pathLight_t::takeSample
+struct pathRay_t
+{
+	vector3d_t ray,startray;
+	point3d_t where;
+	color_t raycolor;
+	const void *origin;
+	int sample,level,clevel,octant;
+	bool operator < (const pathRay_t &r)const
+	{
+		return (octant<r.octant) || ((octant==r.octant) && (sample<r.sample));
+	};
+};
+
+/// Per thread ray buffers, so the batches don't allocate on every sample
+class pathBatch_t : public context_t::destructible
+{
+	public:
+		virtual ~pathBatch_t() {};
+
+		std::vector<pathRay_t> rays,next;
+		std::vector<surfacePoint_t> hits;
+		std::vector<char> hit;
+		/// Direction, color and distance of every sample, for the gradients
+		std::vector<vector3d_t> dir;
+		std::vector<color_t> value;
+		std::vector<PFLOAT> dist;
+		/// Samples gathered in the strata of the hemisphere
+		std::vector<color_t> cellValue;
+		std::vector<PFLOAT> cellDist;
+		std::vector<int> cellCount;
+};
+
 
 class pathLight_t : public light_t
 {
 	friend struct photonData_t;
+	friend struct irradianceWork_t;
+	friend struct refinementWork_t;
 	public:
 		pathLight_t(int nsam, CFLOAT pwr, int depth, int cdepth,bool uQ,
 				bool ca=false,PFLOAT casiz=1.0,CFLOAT thr=0.1,bool recal=true,
@@ -73,6 +108,12 @@ class pathLight_t : public light_t
 			desiredWeight=1.0/shadow_threshold;
 			weightLimit=0.8*desiredWeight;
 		};
+		/// Cache mode: keep the samples between renders, see init()
+		void setCacheFile(const std::string &f) {cacheFile=f;};
+		/// Cache mode: interpolate with irradiance gradients
+		void setGradient(bool g) {gradient=g;};
+		/// Occlusion mode: send half the samples to the bright parts of the background
+		void setImportance(bool i) {importance=i;};
 		virtual color_t illuminate(renderState_t &state,const scene_t &s,
 				const surfacePoint_t sp, const vector3d_t &eye) const;
 		color_t normalSample(renderState_t &state,const scene_t &s,
@@ -100,7 +141,10 @@ class pathLight_t : public light_t
 		bool use_QMC;
 		Halton* HSEQ;
 		color_t takeSample(renderState_t &state,const vector3d_t &N,const surfacePoint_t &sp,
-											const scene_t &sc,PFLOAT &avgD,PFLOAT &minD,bool caching=false)const;
+											const scene_t &sc,PFLOAT &avgD,PFLOAT &minD,bool caching=false,
+											lightGradient_t *grad=NULL)const;
+		void gradients(pathBatch_t &batch,const surfacePoint_t &sp,const vector3d_t &N,
+				CFLOAT mult,PFLOAT H,lightGradient_t &grad)const;
 
 		static CFLOAT weight(const lightSample_t &sample,const point3d_t &P,
 				const vector3d_t &N,CFLOAT maxweight);
@@ -111,15 +155,20 @@ class pathLight_t : public light_t
 		static CFLOAT weightNoDev(const lightSample_t &sample,const point3d_t &P,
 				const vector3d_t &N,CFLOAT maxweight);
 
-		void setIrradiance(lightSample_t &sample,PFLOAT &radius);
+		void setIrradiance(lightSample_t &sample,PFLOAT &radius,
+				std::vector<foundSample_t> &found)const;
 
 		color_t getLight(renderState_t &state,const surfacePoint_t &sp,
 				const scene_t &sc,const vector3d_t &eye,photonData_t *data)const;
 		bool testRefinement(const scene_t &sc);
+		bool cacheKey(scene_t &scene,unsigned long long &value)const;
+		void loadCache(scene_t &scene);
+		void saveCache()const;
 
 		hemiSampler_t *getSampler(renderState_t &state,const scene_t &sc)const;
 		photonData_t *getPhotonData(renderState_t &state)const;
 		cacheProxy_t *getProxy(renderState_t &state,const scene_t &sc)const;
+		pathBatch_t *getBatch(renderState_t &state)const;
 
 		bool cache;
 		PFLOAT dist_to_sample;
@@ -138,9 +187,14 @@ class pathLight_t : public light_t
 		bool occmode;
 		PFLOAT occ_maxdistance;
 		bool ignorms;
+		bool importance;
+		const envSampler_t *bgsampler;
 
-		std::vector<foundSample_t> stsamples;
 		cacheProxy_t *_proxy;
+		pathBatch_t *_batch;
+		std::string cacheFile;
+		bool gradient;
+		unsigned long long cachekey;
 };
 
 __END_YAFRAY
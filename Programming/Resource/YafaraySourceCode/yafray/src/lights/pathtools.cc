@@ -180,10 +180,10 @@ void photonSampler_t::samplingFrom(renderState_t &state,const point3d_t &P,
 		}
 	
 	for(vector< foundPhoton_t >::iterator i=found.begin();i!=found.end();++i)
-		if((i->photon->direction()*N)>0.0)
+		if((i->photon.direction()*N)>0.0)
 		{
-			pair<int,int> pos=getCoords(i->photon->direction(),N,Ru,Rv);
-			energy[pos.first][pos.second]+=i->photon->color();
+			pair<int,int> pos=getCoords(i->photon.direction(),N,Ru,Rv);
+			energy[pos.first][pos.second]+=i->photon.color();
 		}
 	CFLOAT totaldiff=0;
 	for(int i=0;i<paralels;++i)
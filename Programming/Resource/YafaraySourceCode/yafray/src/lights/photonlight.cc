@@ -62,7 +62,7 @@ void insert(hash3d_t<photoAccum_t> &h,const photonMark_t &e)
 
 photonLight_t::photonLight_t(const point3d_t &f,const point3d_t _to,PFLOAT angle,
 		const color_t &c,CFLOAT inte,int np,int search,int maxd,int mind,PFLOAT b,
-		PFLOAT disp, PFLOAT fr,PFLOAT clus,int mod, bool useqmc)
+		PFLOAT disp, PFLOAT fr,PFLOAT clus,int mod, bool useqmc, const std::string &cf)
 {
 	from=f;
 	to=_to;
@@ -100,6 +100,7 @@ photonLight_t::photonLight_t(const point3d_t &f,const point3d_t _to,PFLOAT angle
 		}
 	}
 	use_in_indirect=false;
+	cacheFile=cf;
 }
 
 void photonLight_t::shoot_photon_caustic(scene_t &scene, photon_t &photon,
@@ -450,7 +451,65 @@ point3d_t photon_get_pos(photonMark_t * const & p)
 }
 
 
+// Same rule as globalphotonlight, the photon marks are reused while
+// geometry and light settings stay the same. Shaders are not part of the key.
+unsigned long long photonLight_t::cacheKey(scene_t &scene)const
+{
+	keyHash_t key;
+	key.add(from);
+	key.add(to);
+	key.add(color);
+	key.add(pow);
+	key.add(Np);
+	key.add(K);
+	key.add(maxdepth);
+	key.add(mindepth);
+	key.add(bias);
+	key.add(angle_cos);
+	key.add(fixedRadius);
+	key.add(cluster);
+	key.add(dispersion);
+	key.add(mode);
+	key.add(use_QMC);
+	scene.hashGeometry(key);
+	return key.value();
+}
+
 void photonLight_t::init(scene_t &scene)
+{
+	unsigned long long key=0;
+	bool loaded=false;
+	if(cacheFile!="")
+	{
+		key=cacheKey(scene);
+		cacheReader_t cache(cacheFile,"YAFPHMRK",key);
+		loaded=cache.readArray(photons);
+		if(loaded) cerr<<"Loaded "<<photons.size()<<" photons from "<<cacheFile<<endl;
+	}
+	if(!loaded)
+	{
+		shootPhotons(scene);
+		if(cacheFile!="")
+		{
+			cacheWriter_t cache(cacheFile,"YAFPHMRK",key);
+			cache.writeArray(photons);
+			if(!cache.ok()) WARNING<<"Could not save photons to "<<cacheFile<<endl;
+		}
+	}
+
+	vector<photonMark_t *> lpho(photons.size());
+	for(vector<photonMark_t>::iterator i=photons.begin();i!=photons.end();++i)
+		lpho[i-photons.begin()]=&(*i);
+
+	bound_add=fixedRadius;
+	if(tree!=NULL) delete tree;
+	tree=buildGenericTree(lpho,photon_calc_bound_fixed,photon_is_in_bound,
+				photon_get_pos,8);
+
+	cerr<<"OK "<<photons.size()<<" photons kept\n";
+}
+
+void photonLight_t::shootPhotons(scene_t &scene)
 {
 	fprintf(stderr,"Shooting photons ... ");
 	vector3d_t dir;
@@ -486,18 +545,6 @@ void photonLight_t::init(scene_t &scene)
 	cerr << "Pre-Gathering ("<<hash->numBoxes()<<") ... ";
 	preGathering();
 	delete hash;hash=NULL;
-
-	vector<photonMark_t *> lpho(photons.size());
-	for(vector<photonMark_t>::iterator i=photons.begin();i!=photons.end();++i)
-		lpho[i-photons.begin()]=&(*i);
-
-	bound_add=fixedRadius;
-	if(tree!=NULL) delete tree;
-	tree=buildGenericTree(lpho,photon_calc_bound_fixed,photon_is_in_bound,
-				photon_get_pos,8);
-
-	cerr<<"OK "<<photons.size()<<" photons kept\n";
-
 }
 /*
 struct compX_f
@@ -700,6 +747,8 @@ light_t *photonLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	string _smode;
 	const string *smode=&_smode;
 	bool useqmc=false;
+	string _cfile;
+	const string *cfile=&_cfile;
 
 	params.getParam("from", from);
 	params.getParam("to", to);
@@ -712,6 +761,8 @@ light_t *photonLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	params.getParam("mindepth", mindepth);
 	params.getParam("bias", bias);
 	params.getParam("use_QMC", useqmc);
+	// file to keep the photons between renders, see init() for when it is reused
+	params.getParam("cache_file", cfile);
 	if(params.getParam("dispersion",disp))
 		WARNING<<"Dispersion value is deprecated, use fixedradius only.\n";
 	params.getParam("mode",smode);
@@ -728,7 +779,7 @@ light_t *photonLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	}
 
 	return new photonLight_t(from,to,angle,color,power,nphotons,
-			search,depth,mindepth,bias,disp,fr,cluster,mode, useqmc);
+			search,depth,mindepth,bias,disp,fr,cluster,mode, useqmc, *cfile);
 }
 
 pluginInfo_t photonLight_t::info()
@@ -32,6 +32,7 @@
 #include "light.h"
 #include "mcqmc.h"
 #include "hash3d.h"
+#include "mapfile.h"
 #include<queue>
 
 __BEGIN_YAFRAY
@@ -150,7 +151,7 @@ class photonLight_t : public  light_t
 		photonLight_t(const point3d_t &f,const point3d_t _to,PFLOAT angle,
 				const color_t &c,CFLOAT inte,int np,int search,int maxd=3,int mind=1,
 				PFLOAT b=0.0001, PFLOAT disp=1.0,PFLOAT fr=-1,PFLOAT clus=1.0,
-				int mode=CAUSTIC, bool useqmc=false);
+				int mode=CAUSTIC, bool useqmc=false, const std::string &cf="");
 		virtual color_t illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t sp,
 															const vector3d_t &eye)const;
 		virtual point3d_t position()const {return from;};
@@ -170,6 +171,8 @@ class photonLight_t : public  light_t
 				const vector3d_t &dir, PFLOAT dis=0.0); 
 		void shoot_photon_diffuse(scene_t &scene,photon_t &photon,const vector3d_t &dir
 				,PFLOAT dis=0.0); 
+		void shootPhotons(scene_t &scene);
+		unsigned long long cacheKey(scene_t &scene)const;
 		point3d_t from,to;
 		color_t color;
 		CFLOAT pow;
@@ -193,6 +196,7 @@ class photonLight_t : public  light_t
 		Halton* HSEQ;
 		bool use_QMC;
 		renderState_t nullstate;
+		std::string cacheFile;
 };
 
 inline CFLOAT filterGauss(const PFLOAT &x, const PFLOAT &limit)
@@ -45,6 +45,22 @@ color_t pointLight_t::illuminate(renderState_t &state, const scene_t &s,
 	return col;
 }
 
+bool pointLight_t::unshadowed(renderState_t &state, const scene_t &s, const surfacePoint_t &sp,
+				const vector3d_t &eye, color_t &lit, color_t &extra, point3d_t &to) const
+{
+	if (!cast_shadows) return false;
+	vector3d_t L = from-sp.P();
+	vector3d_t dir = L;
+	dir.normalize();
+	CFLOAT id2 = L*L;
+	if (id2!=0.f) id2=1.f/id2;
+	lit = sp.getShader()->fromLight(state, sp, energy_t(dir, color*id2), eye);
+	extra = color_t(0.f);
+	if (glow_int>0) extra = glow_int * color * getGlow(from, sp, eye, glow_ofs, glow_type);
+	to = from;
+	return true;
+}
+
 pointEmitter_t::pointEmitter_t(const point3d_t &f, const color_t &c): from(f), color(c)
 {
 }
@@ -38,6 +38,7 @@ class pointEmitter_t : public emitter_t
 		virtual ~pointEmitter_t();
 		virtual void getDirection(int num, point3d_t &p, vector3d_t &dir, color_t &c) const;
 		virtual void numSamples(int n);
+		virtual bool hashEmission(keyHash_t &h) const { h.add(from);  h.add(color);  return true; }
 	protected:
 		point3d_t from;
 		color_t color, lcol;
@@ -60,6 +61,17 @@ class pointLight_t : public light_t
 					const surfacePoint_t sp, const vector3d_t &eye) const;
 		virtual point3d_t position() const { return from; }
 		virtual emitter_t * getEmitter(int maxsamples) const { return new pointEmitter_t(from, color); }
+		virtual bool unshadowed(renderState_t &state, const scene_t &s, const surfacePoint_t &sp,
+				const vector3d_t &eye, color_t &lit, color_t &extra, point3d_t &to) const;
+		virtual bool emissionBound(lightBound_t &b) const
+		{
+			if (glow_int>0) return false; // glow depends on the eye ray
+			b.min = b.max = from;
+			b.axis.set(0, 0, 1);
+			b.thetaO = M_PI;  b.thetaE = 0.5*M_PI;
+			b.power = color.energy();
+			return true;
+		}
 		virtual void init(scene_t &scene) {}
 		virtual ~pointLight_t() {}
 		
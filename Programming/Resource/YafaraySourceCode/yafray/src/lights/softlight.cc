@@ -1,5 +1,7 @@
 
 #include "softlight.h"
+#include "ccthreads.h"
+#include <cstring>
 using namespace std;
 
 __BEGIN_YAFRAY
@@ -150,12 +152,51 @@ softLight_t::softLight_t(const point3d_t &f, const color_t &c, CFLOAT p,
 		}
 }
 
+#define CACHE_TAG "YAFSOFTC"
+
+bool softLight_t::loadCube(unsigned long long key)
+{
+	cacheReader_t cache(cacheFile,CACHE_TAG,key);
+	const GFLOAT *faces[6];
+	for(int i=0;i<6;++i)
+	{
+		unsigned int count;
+		cache.readArray(faces[i],count);
+		if(!cache.ok() || (count!=(unsigned int)(res*res))) return false;
+	}
+	for(int i=0;i<6;++i)
+		memcpy(buffer[i].buffer(0,0),faces[i],res*res*sizeof(GFLOAT));
+	return true;
+}
+
+void softLight_t::saveCube(unsigned long long key)const
+{
+	cacheWriter_t cache(cacheFile,CACHE_TAG,key);
+	for(int i=0;i<6;++i) cache.writeArray(buffer[i].buffer(0,0),res*res);
+	if(!cache.ok()) cerr<<"Could not save shadow maps to "<<cacheFile<<endl;
+}
+
 void softLight_t::init(scene_t &scene)
 {
+	// The cube only depends on the geometry seen from the light, shaders
+	// and light color can change and the file is still valid
+	keyHash_t key;
+	if(cacheFile!="")
+	{
+		key.add(from);
+		key.add(res);
+		scene.hashGeometry(key);
+		if(loadCube(key.value()))
+		{
+			cout<<"Shadow maps loaded from "<<cacheFile<<endl;
+			return;
+		}
+	}
 	cout<<"Building shadow maps ... ";
 	cout.flush();
 	fillCube(scene);
 	cout<<"OK\n";
+	if(cacheFile!="") saveCube(key.value());
 }
 
 color_t softLight_t::illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t sp,
@@ -179,58 +220,60 @@ color_t softLight_t::illuminate(renderState_t &state,const scene_t &s,const surf
 	return col;
 }
 
-void softLight_t::fillSide(int s,const vector3d_t &corner,
-		const vector3d_t &cx,const vector3d_t &cy,scene_t &scene)
+// corner, corner along x and corner along y of every face
+static const PFLOAT cubeCorners[6][3][3]=
 {
-	vector3d_t incx=(cx-corner)/res;
-	vector3d_t incy=(cy-corner)/res;
-	vector3d_t diry=corner+incx/2+incy/2;
+	{{-1.0,-1.0, 1.0},{ 1.0,-1.0, 1.0},{-1.0,-1.0,-1.0}},
+	{{ 1.0,-1.0, 1.0},{ 1.0, 1.0, 1.0},{ 1.0,-1.0,-1.0}},
+	{{ 1.0, 1.0, 1.0},{-1.0, 1.0, 1.0},{ 1.0, 1.0,-1.0}},
+	{{-1.0, 1.0, 1.0},{-1.0,-1.0, 1.0},{-1.0, 1.0,-1.0}},
+	{{-1.0, 1.0, 1.0},{ 1.0, 1.0, 1.0},{-1.0,-1.0, 1.0}},
+	{{-1.0, 1.0,-1.0},{ 1.0, 1.0,-1.0},{-1.0,-1.0,-1.0}}
+};
+
+void softLight_t::fillRow(int s,int y,scene_t &scene,renderState_t &state)
+{
+	const PFLOAT (*c)[3]=cubeCorners[s];
+	vector3d_t corner(c[0][0],c[0][1],c[0][2]);
+	vector3d_t incx=(vector3d_t(c[1][0],c[1][1],c[1][2])-corner)/res;
+	vector3d_t incy=(vector3d_t(c[2][0],c[2][1],c[2][2])-corner)/res;
+	vector3d_t dir=corner+incx/2+incy*((PFLOAT)y+0.5);
 	surfacePoint_t sp;
-	renderState_t state;
-	for(int y=0;y<res;++y)
+	for(int x=0;x<res;++x)
 	{
-		vector3d_t dir=diry;
-		for(int x=0;x<res;++x)
+		vector3d_t ray=dir;
+		ray.normalize();
+		if(!scene.firstHit(state,sp,from,ray,true))
+		{
+			buffer[s](x,y)=-1;
+			//obj[s](x,y)=(object3d_t *)NULL;
+		}
+		else
 		{
-			vector3d_t ray=dir;
-			ray.normalize();
-			if(!scene.firstHit(state,sp,from,ray,true))
-			{
-				buffer[s](x,y)=-1;
-				//obj[s](x,y)=(object3d_t *)NULL;
-			}
-			else
-			{
-				buffer[s](x,y)=sp.Z();
-				//obj[s](x,y)=sp.getObject();
-			}
-			dir=dir+incx;
+			buffer[s](x,y)=sp.Z();
+			//obj[s](x,y)=sp.getObject();
 		}
-		diry=diry+incy;
+		dir=dir+incx;
 	}
-		
 }
 
+/// The rows of the six faces are shared out among the render threads
+struct cubeWork_t : public yafthreads::parallelWork_t
+{
+	cubeWork_t(softLight_t &l,scene_t &s):light(l),scene(s) {};
+	virtual void work(int begin,int end,int thread)
+	{
+		renderState_t state;
+		for(int r=begin;r<end;++r) light.fillRow(r/light.res,r%light.res,scene,state);
+	}
+	softLight_t &light;
+	scene_t &scene;
+};
+
 void softLight_t::fillCube(scene_t &scene)
 {
-	fillSide(0,vector3d_t(-1.0,-1.0 ,1.0),
-						vector3d_t ( 1.0,-1.0 ,1.0),
-						vector3d_t (-1.0,-1.0,-1.0),scene);
-	fillSide(1,vector3d_t( 1.0,-1.0 ,1.0),
-						vector3d_t ( 1.0 ,1.0 ,1.0),
-						vector3d_t ( 1.0,-1.0,-1.0),scene);
-	fillSide(2,vector3d_t( 1.0 ,1.0 ,1.0),
-						vector3d_t (-1.0 ,1.0 ,1.0),
-						vector3d_t ( 1.0 ,1.0,-1.0),scene);
-	fillSide(3,vector3d_t(-1.0 ,1.0 ,1.0),
-						vector3d_t (-1.0,-1.0 ,1.0),
-						vector3d_t (-1.0 ,1.0,-1.0),scene);
-	fillSide(4,vector3d_t(-1.0 ,1.0 ,1.0),
-						vector3d_t ( 1.0 ,1.0 ,1.0),
-						vector3d_t (-1.0,-1.0 ,1.0),scene);
-	fillSide(5,vector3d_t(-1.0 ,1.0,-1.0),
-						vector3d_t ( 1.0 ,1.0,-1.0),
-						vector3d_t (-1.0,-1.0,-1.0),scene);
+	cubeWork_t work(*this,scene);
+	yafthreads::parallelFor(work,6*res,scene.getCPUs(),8);
 }
 
 light_t *softLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
@@ -255,7 +298,14 @@ light_t *softLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 	params.getParam("glow_type", glt);
 	params.getParam("glow_offset", glo);
 
-	return new softLight_t(from, color, power, res, radius, bias, gli, glo, glt);
+	string _cfile;
+	const string *cfile=&_cfile;
+	// keeps the shadow cube for the next render, only for static lights
+	params.getParam("cache_file",cfile);
+
+	softLight_t *light=new softLight_t(from, color, power, res, radius, bias, gli, glo, glt);
+	light->setCacheFile(*cfile);
+	return light;
 }
 
 pluginInfo_t softLight_t::info()
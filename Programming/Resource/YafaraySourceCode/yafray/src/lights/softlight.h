@@ -10,6 +10,8 @@
 #include"buffer.h"
 #include"object3d.h"
 #include"light.h"
+#include"mapfile.h"
+#include<string>
 
 __BEGIN_YAFRAY
 
@@ -20,23 +22,36 @@ __BEGIN_YAFRAY
 
 class softLight_t : public light_t
 {
+	friend struct cubeWork_t;
 	public:
 		softLight_t(const point3d_t &f, const color_t &c, CFLOAT p,
 				int resol, int radius, GFLOAT biass, CFLOAT gli=0, CFLOAT glo=0, int glt=0);
 		virtual color_t illuminate(renderState_t &state, const scene_t &s,
 				const surfacePoint_t sp, const vector3d_t &eye)const;
 		virtual point3d_t position() const { return from; }
+		virtual bool emissionBound(lightBound_t &b) const
+		{
+			if (glow_int>0) return false; // glow depends on the eye ray
+			b.min = b.max = from;
+			b.axis.set(0, 0, 1);
+			b.thetaO = M_PI;  b.thetaE = 0.5*M_PI;
+			b.power = pow*color.energy();
+			return true;
+		}
 		virtual void init(scene_t &scene);
 		virtual ~softLight_t() {};
+		/// File to keep the shadow cube between renders, see init()
+		void setCacheFile(const std::string &f) {cacheFile=f;};
 
 		static light_t *factory(paramMap_t &params, renderEnvironment_t &render);
 		static pluginInfo_t info();
 	protected:
 		GFLOAT getSample(int face,int x, int y/*,object3d_t * &o*/)const;
 		int guessSide(const vector3d_t &v,GFLOAT &x,GFLOAT &y)const;
-		void fillSide(int s,const vector3d_t &corner,const vector3d_t &cx,
-				const vector3d_t &y,scene_t &scene);
+		void fillRow(int s,int y,scene_t &scene,renderState_t &state);
 		void fillCube(scene_t &scene);
+		bool loadCube(unsigned long long key);
+		void saveCube(unsigned long long key)const;
 		CFLOAT mixShadow(int face,int ix,int iy,int fx,int fy,
 				GFLOAT cx,GFLOAT cy,GFLOAT Z/*,const object3d_t *ob*/)const;
 		
@@ -54,6 +69,7 @@ class softLight_t : public light_t
 		// glow
 		CFLOAT glow_int, glow_ofs;
 		int glow_type;
+		std::string cacheFile;
 };
 
 #define SIDE_ISOUT(a) ((a<0) || (a>=res))
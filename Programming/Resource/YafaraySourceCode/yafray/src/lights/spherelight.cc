@@ -25,30 +25,31 @@
 __BEGIN_YAFRAY
 
 sphereLight_t::sphereLight_t(const point3d_t &p, PFLOAT r, int nsam, int psam,
-			const color_t &c, CFLOAT pw, int qmcm, bool dm, CFLOAT gli, CFLOAT glo, int glt)
+			const color_t &c, CFLOAT pw, bool dm, CFLOAT gli, CFLOAT glo, int glt)
 {
 	pos = p;
 	rad = r;
 	if (psam<0) psam=0;
-	pred_samples = psam;
 	samples = nsam+psam;	// samples is total number of samples of which pred_samples used to estimate shadowing
 	// samples must be at least 1
 	if (samples<1) {
 		samples = 1;
 		std::cerr << "[spherelight]: number of samples must be at least 1\n";
 	}
+	if (psam>=samples) {
+		psam = samples-1;
+		std::cerr << "[spherelight]: psamples must be less than the total number of samples, using " << psam << "\n";
+	}
 	// if radius <= 0.01, assume light is pointlight, only one sample needed
 	if (rad<=0.01) {
 		rad = 0.0;
 		std::cerr << "[spherelight]: radius of light very small, assuming pointlight\n";
 		samples = 1;
 	}
-	samdiv = 1.0/(CFLOAT)samples;
+	// without psamples a quarter of them estimate shadowing
+	pred_samples = (psam>0) ? psam : sampleTable_t::prediction(samples);
 	color = c*pw;
-	qmc_method = qmcm;
-	HSEQ = new Halton[2];
-	HSEQ[0].setBase(2);
-	HSEQ[1].setBase(3);
+	table.init(samples);
 	dummy = dm;
 	glow_int = gli;
 	glow_ofs = glo;
@@ -85,25 +86,44 @@ color_t sphereLight_t::illuminate(renderState_t &state, const scene_t &s, const
 
 	createCS(dir, u, v);
 
-	if (qmc_method) {
-		HSEQ[0].setStart(ourRandomI());
-		HSEQ[1].setStart(ourRandomI());
-	}
-
-	int sm, Ltot=0;
+	// the set is stratified from its first samples on, so the prediction
+	// samples are also part of the estimate. Next to a point in penumbra
+	// start from the count that one needed, it is likely in it too
+	const PFLOAT *set = table.getSet();
+	int sm, Ltot=0, taken=samples, check=(pred_samples) ? pred_samples : samples;
+	int last = state.context.get(_lastneed);
+	if (last>check) check = last;
 	point3d_t dp = pos;
-	for (sm=0;sm<samples;sm++)
+	for (sm=0;sm<taken;sm++)
 	{
-		if ((pred_samples) && (sm==pred_samples)) {
-			// if points totally lit or totally shadowed, stop now
-			if (Ltot==sm) {
-				totalcolor *= (1.f/(CFLOAT)sm);
+		if (sm==check) {
+			// if points totally lit or totally shadowed, stop now; lit ones
+			// are shaded from the same points everywhere so they stay smooth
+			if ((sm==pred_samples) && (Ltot==sm)) {
+				state.context.store(_lastneed, 0);
+				set = table.firstSet();
+				totalcolor.set(0, 0, 0);
+				for (sm=0;sm<samples;sm++) {
+					ShirleyDisk(set[2*sm], set[2*sm+1], du, dv);
+					dir = pos + rad*(du*u + dv*v) - sp.P();
+					Ld = dir*dir;
+					if (Ld!=0.0) Ld=1.0/Ld;
+					dir.normalize();
+					totalcolor += sha->fromLight(state, sp, energy_t(dir, color*Ld), eye);
+				}
+				totalcolor *= (1.f/(CFLOAT)samples);
 				if (glow_int>0) totalcolor += glow_int * color * getGlow(pos, sp, eye, glow_ofs, glow_type);
 				return totalcolor;
 			}
-			else if (Ltot==0) return color_t(0.0);	// noglo
+			else if ((sm==pred_samples) && (Ltot==0)) {
+				state.context.store(_lastneed, 0);
+				return color_t(0.0);	// noglo
+			}
+			// otherwise as many more as the penumbra asks for, checked again on the way
+			taken = check = sampleTable_t::adaptive(Ltot, sm, samples);
+			if (sm==taken) break;
 		}
-		ShirleyDisk(HSEQ[0].getNext(), HSEQ[1].getNext(), du, dv);
+		ShirleyDisk(set[2*sm], set[2*sm+1], du, dv);
 		dp = pos + rad*(du*u + dv*v);
 		dir = dp - sp.P();
 		Ld = dir*dir;
@@ -117,6 +137,8 @@ color_t sphereLight_t::illuminate(renderState_t &state, const scene_t &s, const
 		}
 		state.skipelement=oldorigin;
 	}
+	state.context.store(_lastneed, ((Ltot>0) && (Ltot<taken)) ? taken : 0);
+	CFLOAT samdiv = 1.0/(CFLOAT)taken;
 	totalcolor *= samdiv;
 	if (glow_int>0) totalcolor += ((CFLOAT)Ltot*samdiv) * glow_int * color * getGlow(pos, sp, eye, glow_ofs, glow_type);
 	return totalcolor;
@@ -154,7 +176,7 @@ light_t *sphereLight_t::factory(paramMap_t &params, renderEnvironment_t &render)
 	point3d_t p;
 	CFLOAT pw = 1;
 	int nsam=16, psam=0;
-	int qmcm = 0;
+	int qmcm = 0;	// no longer used, read so old scenes load quietly
 	bool dm = false;
 
 	params.getParam("from", p);
@@ -173,7 +195,7 @@ light_t *sphereLight_t::factory(paramMap_t &params, renderEnvironment_t &render)
 	params.getParam("glow_type", glt);
 	params.getParam("glow_offset", glo);
 
-	return new sphereLight_t(p, r, nsam, psam, col, pw, qmcm, dm, gli, glo, glt);
+	return new sphereLight_t(p, r, nsam, psam, col, pw, dm, gli, glo, glt);
 }
 
 pluginInfo_t sphereLight_t::info()
@@ -188,8 +210,7 @@ pluginInfo_t sphereLight_t::info()
 	info.params.push_back(buildInfo<COLOR>("color", "Light color"));
 	info.params.push_back(buildInfo<FLOAT>("power", 0.0f, 100000.0f, 1.0f, "Light intensity"));
 	info.params.push_back(buildInfo<INT>("samples",1,5000,50, "Number of shadow samples"));
-	info.params.push_back(buildInfo<INT>("psamples",0,1000,0, "Minimum of samples to estimate shadowing"));
-	info.params.push_back(buildInfo<INT>("qmc_method",0, 1, 0, "The sampling method"));
+	info.params.push_back(buildInfo<INT>("psamples",0,1000,0, "Minimum of samples to estimate shadowing, 0 for a quarter"));
 	info.params.push_back(buildInfo<BOOL>("dummy", "Use only to shoot photons, no direct lighting"));
 
 	return info;
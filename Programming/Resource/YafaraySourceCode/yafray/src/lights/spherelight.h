@@ -41,6 +41,7 @@ class sphereEmitter_t : public emitter_t
 		virtual void numSamples(int n);
 		virtual void getDirection(int num, point3d_t &p, vector3d_t &dir, color_t &c) const;
 		virtual bool storeDirect() const { return true; }
+		virtual bool hashEmission(keyHash_t &h) const { h.add(color);  h.add(pos);  h.add(radius);  return true; }
 	protected:
 		color_t color, lcol;
 		point3d_t pos;
@@ -52,13 +53,23 @@ class sphereLight_t : public light_t
 {
 	public:
 		sphereLight_t(const point3d_t &p, PFLOAT r, int nsam, int psam,
-				const color_t &c, CFLOAT pw, int qmcm=0, bool dm=false, CFLOAT gli=0, CFLOAT glo=0, int glt=0);
+				const color_t &c, CFLOAT pw, bool dm=false, CFLOAT gli=0, CFLOAT glo=0, int glt=0);
 		virtual color_t illuminate(renderState_t &state, const scene_t &s, const surfacePoint_t sp, const vector3d_t &eye) const;
 		virtual point3d_t position() const { return pos; }
 		virtual void init(scene_t &scene) {}
-		virtual ~sphereLight_t() { delete[] HSEQ;  HSEQ=NULL; }
+		virtual ~sphereLight_t() {}
 
 		virtual emitter_t * getEmitter(int maxsamples) const { return new sphereEmitter_t(color, pos, rad); }
+		virtual bool emissionBound(lightBound_t &b) const
+		{
+			if (glow_int>0) return false; // glow depends on the eye ray
+			b.min.set(pos.x-rad, pos.y-rad, pos.z-rad);
+			b.max.set(pos.x+rad, pos.y+rad, pos.z+rad);
+			b.axis.set(0, 0, 1);
+			b.thetaO = M_PI;  b.thetaE = 0.5*M_PI;
+			b.power = color.energy();
+			return true;
+		}
 
 		static light_t *factory(paramMap_t &params, renderEnvironment_t &render);
 		static pluginInfo_t info();
@@ -67,10 +78,11 @@ class sphereLight_t : public light_t
 		PFLOAT rad;
 		color_t color;
 		int samples, pred_samples;
-		int qmc_method;
-		CFLOAT samdiv;
+		/// Key for the samples the last penumbra point of a thread needed
+		int _lastneed;
 		bool dummy;
-		Halton* HSEQ;
+		/// Stratified sample positions on the disk facing the point
+		sampleTable_t table;
 		CFLOAT glow_int, glow_ofs;
 		int glow_type;
 };
@@ -21,6 +21,8 @@
  */
 
 #include "spotlight.h"
+#include "ccthreads.h"
+#include "mapfile.h"
 
 __BEGIN_YAFRAY
 
@@ -74,6 +76,30 @@ color_t spotLight_t::illuminate(renderState_t &state,const scene_t &s,
 	return sha->fromLight(state,sp, ene, eye);
 }
 
+bool spotLight_t::unshadowed(renderState_t &state,const scene_t &s,const surfacePoint_t &sp,
+		const vector3d_t &eye,color_t &lit,color_t &extra,point3d_t &to) const
+{
+	// the shadow map already answers without rays
+	if(use_map || !cast_shadows) return false;
+	vector3d_t L = from-sp.P();
+	CFLOAT dist_atten = L*L;
+	if (dist_atten!=0) dist_atten = 1.0/dist_atten;
+	L.normalize();
+	const shader_t *sha= sp.getShader();
+	CFLOAT ca = L * dir;
+	lit = color_t(0.0);
+	if (ca>=cosout)
+	{
+		CFLOAT atten = pow(ca, beamDist) * dist_atten * smoothstep(cosout, cosin, ca) * power;
+		lit = sha->fromLight(state,sp, energy_t(L, atten*color), eye);
+		extra = color_t(0.0);
+	}
+	else extra = sha->fromLight(state,sp, energy_t(dir, color_t(0.0)), eye);
+	if (halo && (state.rayDivision<=1)) extra += getVolume(s,sp,eye);
+	to = from;
+	return true;
+}
+
 using namespace std;
 
 inline color_t spotLight_t::getFog(PFLOAT d)const
@@ -217,27 +243,72 @@ color_t spotLight_t::getMappedLight(const surfacePoint_t &sp)const
 	return light/((CFLOAT)(sqs*sqs));
 }
 
-void spotLight_t::buildShadowMap(scene_t &scene)
+void spotLight_t::fillMapRow(int y,scene_t &scene,renderState_t &state)
 {
-	cerr << "Building volumetric shadow map... ";
-	cerr.flush();
 	surfacePoint_t sp;
-	renderState_t state;
-	for(int y=0;y<resolution;++y)
+	PFLOAT leny = 2*sina*((PFLOAT)y-halfres)/(PFLOAT)resolution;
+	for(int x=0;x<resolution;++x)
 	{
-		PFLOAT leny = 2*sina*((PFLOAT)y-halfres)/(PFLOAT)resolution;
-		for(int x=0;x<resolution;++x)
+		PFLOAT lenx = 2*sina*((PFLOAT)x - halfres)/(PFLOAT)resolution;
+		PFLOAT lenz = sqrt(1.0 - lenx*lenx - leny*leny);
+		vector3d_t ray = ndir*lenz + vx*lenx + vy*leny;
+		if (!scene.firstHit(state, sp, from, ray, true))
+			shadow(x,y) = -1;
+		else
+			shadow(x,y) = sp.Z()+scene.selfBias();
+	}
+}
+
+/// Rows of the shadow map shared out among the render threads
+struct spotMapWork_t : public yafthreads::parallelWork_t
+{
+	spotMapWork_t(spotLight_t &l,scene_t &s):light(l),scene(s) {};
+	virtual void work(int begin,int end,int thread)
+	{
+		renderState_t state;
+		for(int y=begin;y<end;++y) light.fillMapRow(y,scene,state);
+	}
+	spotLight_t &light;
+	scene_t &scene;
+};
+
+#define CACHE_TAG "YAFSPOTM"
+
+void spotLight_t::buildShadowMap(scene_t &scene)
+{
+	// The map only depends on the light frame and the geometry, the camera
+	// can move freely and the file is still valid
+	keyHash_t key;
+	if(cacheFile!="")
+	{
+		key.add(from);
+		key.add(ndir);
+		key.add(vx);
+		key.add(vy);
+		key.add(sina);
+		key.add(resolution);
+		key.add(scene.selfBias());
+		scene.hashGeometry(key);
+		cacheReader_t cache(cacheFile,CACHE_TAG,key.value());
+		cache.readArray(shadow_map);
+		if(cache.ok() && ((int)shadow_map.size()==resolution*resolution))
 		{
-			PFLOAT lenx = 2*sina*((PFLOAT)x - halfres)/(PFLOAT)resolution;
-			PFLOAT lenz = sqrt(1.0 - lenx*lenx - leny*leny);
-			vector3d_t ray = ndir*lenz + vx*lenx + vy*leny;
-			if (!scene.firstHit(state, sp, from, ray, true))
-				shadow(x,y) = -1;
-			else
-				shadow(x,y) = sp.Z()+scene.selfBias();
+			cerr << "Volumetric shadow map loaded from " << cacheFile << endl;
+			return;
 		}
+		shadow_map.resize(resolution*resolution);
 	}
+	cerr << "Building volumetric shadow map... ";
+	cerr.flush();
+	spotMapWork_t work(*this,scene);
+	yafthreads::parallelFor(work,resolution,scene.getCPUs(),8);
 	cerr << "OK\n";
+	if(cacheFile!="")
+	{
+		cacheWriter_t cache(cacheFile,CACHE_TAG,key.value());
+		cache.writeArray(shadow_map);
+		if(!cache.ok()) cerr << "Could not save volumetric shadow map to " << cacheFile << endl;
+	}
 }
 
 
@@ -333,6 +404,11 @@ light_t *spotLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
 		params.getParam("fog_density", fden);
 		spot->setMap(res, shadow_samples, sblur);
 		spot->setHalo(fog, fden, hblur, stepsize);
+		string _cfile;
+		const string *cfile=&_cfile;
+		// keeps the shadow map for frames where only the camera moves
+		params.getParam("cache_file",cfile);
+		spot->setCacheFile(*cfile);
 	}
 	return spot;
 }
@@ -28,6 +28,7 @@
 
 #include "light.h"
 #include "params.h"
+#include <string>
 
 __BEGIN_YAFRAY
 
@@ -39,6 +40,8 @@ class spotEmitter_t : public emitter_t
 		virtual ~spotEmitter_t();
 		virtual void numSamples(int n);
 		virtual void getDirection(int num, point3d_t &p, vector3d_t &dir, color_t &c)const;
+		virtual bool hashEmission(keyHash_t &h)const
+		{h.add(from);h.add(direction);h.add(cosa);h.add(color);return true;};
 	protected:
 		point3d_t from;
 		vector3d_t direction, diru, dirv;
@@ -48,6 +51,7 @@ class spotEmitter_t : public emitter_t
 
 class spotLight_t : public light_t
 {
+	friend struct spotMapWork_t;
 	public:
 		spotLight_t(	const point3d_t &fm, const point3d_t &to,
 				const color_t &cl, CFLOAT pw,
@@ -72,12 +76,25 @@ class spotLight_t : public light_t
 
 		void setMap(int res, int ss, PFLOAT b);
 		void setHalo(const color_t &f, CFLOAT d, PFLOAT b=0, PFLOAT s=0.1);
+		/// File to keep the halo shadow map between renders
+		void setCacheFile(const std::string &f) {cacheFile=f;};
 
 		virtual color_t illuminate(renderState_t &state,const scene_t &s, 
 				const surfacePoint_t sp, const vector3d_t &eye) const;
 		virtual point3d_t position() const { return from; };
 		virtual emitter_t * getEmitter(int maxsamples)const 
 		{return new spotEmitter_t(from,-dir,cosa,color*power*(angle/M_PI));};
+		virtual bool unshadowed(renderState_t &state,const scene_t &s,const surfacePoint_t &sp,
+				const vector3d_t &eye,color_t &lit,color_t &extra,point3d_t &to) const;
+		virtual bool emissionBound(lightBound_t &b) const
+		{
+			if(halo) return false; // the halo depends on the eye ray
+			b.min=b.max=from;
+			b.axis=ndir;
+			b.thetaO=angle;  b.thetaE=0;
+			b.power=power*color.energy();
+			return true;
+		};
 		virtual void init(scene_t &scene) {if(halo) buildShadowMap(scene);};
 		virtual ~spotLight_t() {};
 
@@ -109,6 +126,7 @@ class spotLight_t : public light_t
 		color_t sumLine(const point3d_t &s,const point3d_t &e)const;
 		color_t getFog(PFLOAT d)const;
 		void buildShadowMap(scene_t &scene);
+		void fillMapRow(int y,scene_t &scene,renderState_t &state);
 
 		vector3d_t vx,vy;
 		PFLOAT cosa, tana, sina, isina;
@@ -121,6 +139,7 @@ class spotLight_t : public light_t
 		PFLOAT stepsize;
 		color_t fog;
 		CFLOAT fden;
+		std::string cacheFile;
 };
 
 __END_YAFRAY
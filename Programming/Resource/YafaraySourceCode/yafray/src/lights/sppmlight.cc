@@ -0,0 +1,410 @@
+/****************************************************************************
+ *
+ * 			sppmlight.cc: Stochastic progressive photon mapping light
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "sppmlight.h"
+#include <ctime>
+
+using namespace std;
+
+__BEGIN_YAFRAY
+
+#define WARNING cerr<<"[sppmLight]: "
+
+sppmLight_t::sppmLight_t(PFLOAT r,int pp,int np,PFLOAT t,PFLOAT a,int md,int mcd,int ed,bool co):
+	tree(NULL),initRadius(r),alpha(a),maxtime(t),passPhotons(pp),maxPasses(np),passes(0),
+	maxdepth(md),maxcdepth(mcd),eyedepth(ed),causticsOnly(co)
+{
+	use_in_indirect=false;
+}
+
+sppmLight_t::~sppmLight_t()
+{
+	if(tree!=NULL) delete tree;
+}
+
+//------------------------------------------------------------------------------------------
+// hit point tree, every point is bounded by its own gather radius
+
+static bound_t hit_calc_bound(const vector<hitPoint_t *> &v)
+{
+	int size=v.size();
+	if(size==0) return bound_t(point3d_t(),point3d_t());
+	PFLOAT r=v[0]->radius;
+	point3d_t a=v[0]->P-vector3d_t(r,r,r),g=v[0]->P+vector3d_t(r,r,r);
+	for(int i=1;i<size;++i)
+	{
+		const point3d_t &p=v[i]->P;
+		r=v[i]->radius;
+		if((p.x-r)<a.x) a.x=p.x-r;
+		if((p.y-r)<a.y) a.y=p.y-r;
+		if((p.z-r)<a.z) a.z=p.z-r;
+		if((p.x+r)>g.x) g.x=p.x+r;
+		if((p.y+r)>g.y) g.y=p.y+r;
+		if((p.z+r)>g.z) g.z=p.z+r;
+	}
+	return bound_t(a,g);
+}
+
+static bool hit_is_in_bound(hitPoint_t * const & p,bound_t &b)
+{
+	return b.includes(p->P);
+}
+
+static point3d_t hit_get_pos(hitPoint_t * const & p)
+{
+	return p->P;
+}
+
+struct pointCross_f
+{
+	bool operator() (const point3d_t &p,const bound_t &b) {return b.includes(p);};
+};
+
+void sppmLight_t::buildTree()
+{
+	if(tree!=NULL) delete tree;
+	tree=NULL;
+	vector<hitPoint_t *> v;
+	v.reserve(hitpoints.size());
+	for(vector<hitPoint_t>::iterator i=hitpoints.begin();i!=hitpoints.end();++i)
+		if((*i).valid) v.push_back(&(*i));
+	if(v.empty()) return;
+	tree=buildGenericTree(v,hit_calc_bound,hit_is_in_bound,hit_get_pos,8);
+}
+
+//------------------------------------------------------------------------------------------
+
+/** Follows an eye ray through caustic (specular) objects until it lands on
+ * a surface that receives light, the same way the render will reach it.
+ */
+bool sppmLight_t::traceEye(scene_t &scene,hitPoint_t &hp,point3d_t from,vector3d_t ray)
+{
+	surfacePoint_t sp;
+	bool found=false;
+	nullstate.skipelement=NULL;
+	for(int depth=0;depth<=eyedepth;++depth)
+	{
+		if(!scene.firstHit(nullstate,sp,from,ray)) break;
+		nullstate.skipelement=sp.getOrigin();
+		vector3d_t edir=-ray;
+		edir.normalize();
+		object3d_t *obj=sp.getObject();
+		color_t rcolor,tcolor;
+		PFLOAT ior;
+		// same order as photonlight, shader settings first then the object ones
+		bool caustics=sp.getShader()->getCaustics(nullstate,sp,ray,rcolor,tcolor,ior);
+		if(!caustics)
+		{
+			caustics=obj->caustics();
+			obj->getCaustic(rcolor,tcolor,ior);
+		}
+		if(!caustics)
+		{
+			if(obj->reciveRadiosity())
+			{
+				hp.P=sp.P();
+				hp.N=FACE_FORWARD(sp.Ng(),sp.N(),edir);
+				found=true;
+			}
+			break;
+		}
+		CFLOAT kr,kt;
+		fresnel(edir,sp.N(),ior,kr,kt);
+		CFLOAT pr=kr*rcolor.energy(),pt=kt*tcolor.energy();
+		if((pr+pt)<=0.0) break;
+		from=sp.P();
+		if(ourRandom()*(pr+pt)<pr)
+			ray=reflect(FACE_FORWARD(sp.Ng(),sp.N(),edir),edir);
+		else
+			ray=refract(sp.N(),edir,ior);
+		if(ray.null()) break;
+	}
+	nullstate.skipelement=NULL;
+	return found;
+}
+
+void sppmLight_t::traceHitPoints(scene_t &scene,int pass)
+{
+	camera_t *cam=scene.getCamera();
+	int resx=cam->resX(),resy=cam->resY();
+	if(hitpoints.empty())
+	{
+		hitpoints.resize(resx*resy);
+		for(vector<hitPoint_t>::iterator i=hitpoints.begin();i!=hitpoints.end();++i)
+			(*i).radius=initRadius;
+	}
+	PFLOAT wt;
+	for(int i=0;i<resy;++i)
+		for(int j=0;j<resx;++j)
+		{
+			unsigned int pixel=j+i*resx;
+			hitPoint_t &hp=hitpoints[pixel];
+			// new jitter inside the pixel every pass, scrambled per pixel
+			PFLOAT fx=RI_vdC(pass,pixel*2654435761u);
+			PFLOAT fy=RI_S(pass,pixel*2246822519u);
+			vector3d_t ray=cam->shootRay((PFLOAT)j+fx,(PFLOAT)i+fy,wt);
+			if(wt==0.0) hp.valid=false;
+			else hp.valid=traceEye(scene,hp,cam->position(),ray);
+		}
+}
+
+//------------------------------------------------------------------------------------------
+
+void sppmLight_t::shoot(runningPhoton_t &photon,const vector3d_t &dir,
+		int depth,int cdepth,bool storeFirst,scene_t &scene)
+{
+	if(depth>maxdepth) return;
+	surfacePoint_t sp;
+	if(!scene.firstHit(nullstate,sp,photon.position(),dir)) return;
+	const void *oldorigin=nullstate.skipelement;
+	nullstate.skipelement=sp.getOrigin();
+	photon.position(sp.P(),MIN_RAYDIST);
+	const shader_t *sha=sp.getShader();
+	object3d_t *obj=sp.getObject();
+	vector3d_t edir=photon.lastPosition()-photon.position();
+	edir.normalize();
+	vector3d_t Ng=FACE_FORWARD(sp.Ng(),sp.Ng(),edir);
+
+	// direct light is left to the other lights, caustic paths are not
+	if(((depth>0) || (cdepth>0) || storeFirst) && obj->reciveRadiosity() && (!causticsOnly || (cdepth>0)))
+		photons.push_back(storedPhoton_t(photon));
+
+	color_t diffcolor,transcolor;
+	CFLOAT trans=0.0,diffuse=0.0;
+	PFLOAT caus_IOR=1.0;
+	if(obj->caustics() && (cdepth<maxcdepth))
+	{
+		color_t caus_rcolor;
+		obj->getCaustic(caus_rcolor,transcolor,caus_IOR);
+		trans=transcolor.energy();
+	}
+	if(obj->useForRadiosity() && !causticsOnly)
+	{
+		diffcolor=sha->getDiffuse(nullstate,sp,edir);
+		diffuse=diffcolor.energy();
+	}
+	CFLOAT sum=trans+diffuse;
+	if(sum>0.0)
+	{
+		// russian roulette, the photon keeps its power on average
+		CFLOAT q=(sum>1.0) ? 1.0 : sum;
+		CFLOAT r=ourRandom();
+		if(r<(q*trans/sum))
+		{
+			photon.filter(transcolor*(sum/(q*trans)));
+			vector3d_t tdir=refract(sp.N(),-dir,caus_IOR);
+			if(!tdir.null()) shoot(photon,tdir,depth,cdepth+1,storeFirst,scene);
+		}
+		else if(r<q)
+		{
+			photon.filter(diffcolor*(sum/(q*diffuse)));
+			vector3d_t U,V;
+			createCS(Ng,U,V);
+			PFLOAT phi=2.0*M_PI*ourRandom(),r2=ourRandom();
+			PFLOAT sint=sqrt(r2);
+			vector3d_t refDir=(U*cos(phi)+V*sin(phi))*sint+Ng*sqrt(1.0-r2);
+			shoot(photon,refDir,depth+1,cdepth,storeFirst,scene);
+		}
+	}
+	nullstate.skipelement=oldorigin;
+}
+
+void sppmLight_t::splat()
+{
+	for(vector<storedPhoton_t>::const_iterator i=photons.begin();i!=photons.end();++i)
+	{
+		const point3d_t &p=(*i).position();
+		vector3d_t dir=(*i).direction();
+		color_t c=(*i).color();
+		for(gObjectIterator_t<hitPoint_t *,point3d_t,pointCross_f> ite(tree,p);!ite;++ite)
+		{
+			hitPoint_t &hp=**ite;
+			if((dir*hp.N)<=0.0) continue;
+			vector3d_t sub=hp.P-p;
+			if((sub*sub)>=(hp.radius*hp.radius)) continue;
+			hp.newflux+=c;
+			hp.newcount++;
+		}
+	}
+	// progressive radius reduction, keeps a fraction alpha of the new photons
+	for(vector<hitPoint_t>::iterator i=hitpoints.begin();i!=hitpoints.end();++i)
+	{
+		hitPoint_t &hp=*i;
+		if(hp.newcount==0) continue;
+		PFLOAT count=hp.count+alpha*(PFLOAT)hp.newcount;
+		PFLOAT ratio=count/(hp.count+(PFLOAT)hp.newcount);
+		hp.radius*=sqrt(ratio);
+		hp.flux=(hp.flux+hp.newflux)*ratio;
+		hp.count=count;
+		hp.newcount=0;
+		hp.newflux=color_t(0.0);
+	}
+}
+
+void sppmLight_t::init(scene_t &scene)
+{
+	int numemitters=0;
+	for(scene_t::light_iterator i=scene.lightsBegin();i!=scene.lightsEnd();++i)
+	{
+		emitter_t *e=(*i)->getEmitter(passPhotons);
+		if(e!=NULL)
+		{
+			delete e;
+			numemitters++;
+		}
+	}
+	if(!numemitters) return;
+	int photonsperlight=passPhotons/numemitters;
+	list<emitter_t *> emitters;
+	for(scene_t::light_iterator i=scene.lightsBegin();i!=scene.lightsEnd();++i)
+	{
+		emitter_t *e=(*i)->getEmitter(photonsperlight);
+		if(e!=NULL)
+		{
+			e->numSamples(photonsperlight);
+			emitters.push_back(e);
+		}
+	}
+
+	hitpoints.clear();
+	photons.reserve(passPhotons);
+	clock_t start=clock();
+	point3d_t from;
+	vector3d_t dir;
+	color_t color;
+	for(passes=0;passes<maxPasses;)
+	{
+		traceHitPoints(scene,passes);
+		buildTree();
+		if(tree==NULL) break;
+		photons.clear();
+		for(list<emitter_t *>::iterator i=emitters.begin();i!=emitters.end();++i)
+		{
+			bool storeFirst=(*i)->storeDirect();
+			for(int j=0;j<photonsperlight;++j)
+			{
+				(*i)->getDirection(j,from,dir,color);
+				runningPhoton_t photon(color,from);
+				shoot(photon,dir,0,0,storeFirst,scene);
+			}
+		}
+		splat();
+		passes++;
+		cout<<"\rSPPM pass "<<passes<<"/"<<maxPasses<<", "<<photons.size()<<" photons";
+		cout.flush();
+		if((maxtime>0) && ((PFLOAT)(clock()-start)/(PFLOAT)CLOCKS_PER_SEC>maxtime)) break;
+	}
+	cout<<endl;
+	for(list<emitter_t *>::iterator i=emitters.begin();i!=emitters.end();++i) delete *i;
+	// the pass buffer is not needed anymore
+	vector<storedPhoton_t>().swap(photons);
+	// radii changed in the last pass
+	buildTree();
+}
+
+color_t sppmLight_t::illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t sp,
+															const vector3d_t &eye)const
+{
+	if((tree==NULL) || !sp.getObject()->reciveRadiosity()) return color_t(0.0);
+	vector3d_t N=FACE_FORWARD(sp.Ng(),sp.N(),eye);
+	color_t total(0.0);
+	PFLOAT weight=0.0;
+	for(gObjectIterator_t<hitPoint_t *,point3d_t,pointCross_f> ite(tree,sp.P());!ite;++ite)
+	{
+		const hitPoint_t &hp=**ite;
+		if((hp.N*N)<0.5) continue;
+		PFLOAT dis=(hp.P-sp.P()).length();
+		if(dis>=hp.radius) continue;
+		PFLOAT w=1.0-dis/hp.radius;
+		total+=hp.flux*(w/(hp.radius*hp.radius));
+		weight+=w;
+	}
+	if(weight==0.0) return color_t(0.0);
+	// photons carry power/4PI, irradiance is 4PI*flux/(PI*r^2) per pass
+	total*=4.0/(weight*(PFLOAT)passes);
+	return sp.getShader()->fromRadiosity(state,sp,energy_t(N,total),eye);
+}
+
+light_t *sppmLight_t::factory(paramMap_t &params,renderEnvironment_t &render)
+{
+	PFLOAT radius=1.0,maxtime=0,alpha=0.7;
+	int photons=100000,passes=16,maxdepth=5,maxcdepth=8,eyedepth=5;
+	string _smode;
+	const string *smode=&_smode;
+
+	params.getParam("radius",radius);
+	params.getParam("photons",photons);
+	params.getParam("passes",passes);
+	params.getParam("time",maxtime);
+	params.getParam("alpha",alpha);
+	params.getParam("depth",maxdepth);
+	params.getParam("caus_depth",maxcdepth);
+	params.getParam("eye_depth",eyedepth);
+	params.getParam("mode",smode);
+	if((alpha<=0.0) || (alpha>1.0))
+	{
+		WARNING<<"alpha must be in (0,1], using 0.7\n";
+		alpha=0.7;
+	}
+
+	return new sppmLight_t(radius,photons,passes,maxtime,alpha,maxdepth,maxcdepth,
+			eyedepth,*smode=="caustic");
+}
+
+pluginInfo_t sppmLight_t::info()
+{
+	pluginInfo_t info;
+
+	info.name="sppmlight";
+	info.description="Stochastic progressive photon mapping, shoots photons \
+		from every direct light in passes of fixed size";
+
+	info.params.push_back(buildInfo<FLOAT>("radius",0,10000,1.0,"Initial search radius"));
+	info.params.push_back(buildInfo<INT>("photons",1000,100000000,100000,"Photons per pass"));
+	info.params.push_back(buildInfo<INT>("passes",1,100000,16,"Maximum number of passes"));
+	info.params.push_back(buildInfo<FLOAT>("time",0,1000000,0,"Stop after this many \
+				seconds, 0 means no limit"));
+	info.params.push_back(buildInfo<FLOAT>("alpha",0.01,1,0.7,"Fraction of the new \
+				photons kept at every pass, lower values shrink the radius faster"));
+	info.params.push_back(buildInfo<INT>("depth",1,50,5,"Number of photon bounces"));
+	info.params.push_back(buildInfo<INT>("caus_depth",1,50,8,"Number of photon bounces inside caustic"));
+	info.params.push_back(buildInfo<INT>("eye_depth",0,50,5,"Specular bounces followed \
+				from the camera to find visible points"));
+	list<string> modes;
+	modes.push_back("full");
+	modes.push_back("caustic");
+	info.params.push_back(buildInfo<ENUM>("mode",modes,"full","Store every indirect \
+				photon or only caustic ones"));
+
+	return info;
+}
+
+extern "C"
+{
+
+YAFRAYPLUGIN_EXPORT void registerPlugin(renderEnvironment_t &render)
+{
+	render.registerFactory("sppmlight",sppmLight_t::factory);
+	std::cout<<"Registered sppmlight\n";
+}
+
+}
+__END_YAFRAY
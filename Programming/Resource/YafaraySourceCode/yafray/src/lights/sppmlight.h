@@ -0,0 +1,98 @@
+/****************************************************************************
+ *
+ * 			sppmlight.h: Stochastic progressive photon mapping light api
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#ifndef __SPPMLIGHT_H
+#define __SPPMLIGHT_H
+
+#ifdef HAVE_CONFIG_H
+#include<config.h>
+#endif
+
+#include "light.h"
+#include "photon.h"
+#include "params.h"
+
+__BEGIN_YAFRAY
+
+/** Visible point of one pixel.
+ *
+ * Keeps the photon statistics of the pixel between passes. The position
+ * is traced again every pass with a new jitter inside the pixel, the
+ * statistics stay.
+ */
+struct hitPoint_t
+{
+	hitPoint_t():radius(0),count(0),newcount(0),flux(0.0),newflux(0.0),valid(false) {};
+	point3d_t P;
+	vector3d_t N;
+	/// Current gather radius, shrinks as photons arrive
+	PFLOAT radius;
+	/// Photons accumulated so far
+	PFLOAT count;
+	/// Photons found in the current pass
+	int newcount;
+	/// Accumulated flux, scaled to the current radius
+	color_t flux;
+	color_t newflux;
+	bool valid;
+};
+
+/** Stochastic progressive photon mapping.
+ *
+ * Instead of a single huge photon map, photons are shot in passes of
+ * fixed size. After each pass the photons are splatted on the visible
+ * points of the camera and thrown away, then the gather radius of every
+ * point is reduced. Memory stays the same no matter how many passes are
+ * done, and the estimate keeps converging with every pass.
+ */
+class sppmLight_t: public light_t
+{
+	public:
+		sppmLight_t(PFLOAT r,int pp,int np,PFLOAT t,PFLOAT a,int md,int mcd,int ed,bool co);
+		virtual ~sppmLight_t();
+
+		virtual color_t illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t sp,
+															const vector3d_t &eye)const;
+		virtual point3d_t position()const {return point3d_t(0,0,0);};
+		virtual void init(scene_t &scene);
+
+		static light_t *factory(paramMap_t &params,renderEnvironment_t &render);
+		static pluginInfo_t info();
+	protected:
+		void traceHitPoints(scene_t &scene,int pass);
+		bool traceEye(scene_t &scene,hitPoint_t &hp,point3d_t from,vector3d_t ray);
+		void shoot(runningPhoton_t &photon,const vector3d_t &dir,int depth,int cdepth,
+				bool storeFirst,scene_t &scene);
+		void splat();
+		void buildTree();
+
+		std::vector<hitPoint_t> hitpoints;
+		gBoundTreeNode_t<hitPoint_t *> *tree;
+		/// Photons of the current pass only
+		std::vector<storedPhoton_t> photons;
+		PFLOAT initRadius,alpha,maxtime;
+		int passPhotons,maxPasses,passes;
+		int maxdepth,maxcdepth,eyedepth;
+		bool causticsOnly;
+		renderState_t nullstate;
+};
+
+__END_YAFRAY
+#endif
@@ -25,6 +25,8 @@
 #include "sphere.h"
 #include "reference.h"
 #include "threadedscene.h"
+#include "metashader.h"
+#include "mipmap.h"
 #include "forkedscene.h"
 
 #include "targaIO.h"
@@ -1103,6 +1105,21 @@ void * render_t::render(ast_t *ast)
 	params.getParam("AA_jitterfirst", AA_jitterfirst);
 	bool clamp_rgb = false;
 	params.getParam("clamp_rgb", clamp_rgb);
+	// lights sampled per shading point from the light tree, 0 evaluates them all
+	int light_samples = 0;
+	params.getParam("light_samples", light_samples);
+	// fraction of the light left without shadow rays, 0 tests them all
+	PFLOAT shadow_threshold = 0;
+	params.getParam("shadow_threshold", shadow_threshold);
+	// memory for the tiles of paged image textures (the ones with a cache_file), in MB
+	int texture_cache = 0;
+	params.getParam("texture_cache", texture_cache);
+	// textures filtered over the pixel footprint of the camera rays
+	bool ray_differentials = false;
+	params.getParam("ray_differentials", ray_differentials);
+	// camera hits shaded afterwards, grouped by shader
+	bool deferred_shading = false;
+	params.getParam("deferred_shading", deferred_shading);
 
 	if(*camera=="")
 	{
@@ -1224,10 +1241,21 @@ void * render_t::render(ast_t *ast)
 	scene->clampRGB(clamp_rgb);
 
 	scene->setBias(bias);
+	scene->setLightSamples(light_samples);
+	scene->setShadowThreshold(shadow_threshold);
+	scene->setRayDifferentials(ray_differentials);
+	scene->setDeferredShading(deferred_shading);
 	if(cachedPathLight) scene->setRepeatFirst();
 
+	// nodes read by several parents are evaluated once per point
+	shaderGraph_t graph;
+	graph.compile(shader_table);
+	if(texture_cache>0) tileCache_t::global().setMaxSize((size_t)texture_cache<<20);
+
 	scene->setRegion(scxmin,scxmax,scymin,scymax);
 	scene->setCPUs(cpus);
+	// the image files named while parsing, all decoded at once
+	imageRegistry_t::global().loadAll(cpus);
 
 	// tone mapping bypassed when hdr/exr output is requested
 	if (*output_type=="hdr") {
@@ -92,17 +92,18 @@ cloudsNode_t::cloudsNode_t(PFLOAT s, int dep, bool hd, int ct,
 CFLOAT cloudsNode_t::stdoutFloat(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye
 				,const scene_t *scene)const
 {
-	return tex.getFloat(sp.P());
+	return tex.getFilteredFloat(sp.P(), sp.footprint());
 }
 
 colorA_t cloudsNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 		const vector3d_t &eye, const scene_t *scene)const
 {
-	CFLOAT intensidad = tex.getFloat(sp.P());
+	CFLOAT intensidad = tex.getFilteredFloat(sp.P(), sp.footprint());
 	colorA_t rescol(intensidad);
 	if (ctype==1) {
 		point3d_t pt(sp.P());
-		rescol.set(intensidad, tex.getFloat(point3d_t(pt.y, pt.x, pt.z)), tex.getFloat(point3d_t(pt.y, pt.z, pt.x)), 1.0);
+		rescol.set(intensidad, tex.getFilteredFloat(point3d_t(pt.y, pt.x, pt.z), sp.footprint()),
+				tex.getFilteredFloat(point3d_t(pt.y, pt.z, pt.x), sp.footprint()), 1.0);
 	}
 	if ((input1==NULL) || (input2==NULL)) return rescol;
 	return input1->stdoutColor(state, sp, eye, scene)*intensidad
@@ -145,13 +146,13 @@ marbleNode_t::marbleNode_t(PFLOAT sz, int dep, CFLOAT turb, CFLOAT shp, bool hrd
 CFLOAT marbleNode_t::stdoutFloat(renderState_t &state,const surfacePoint_t &sp, const vector3d_t &eye
 				,const scene_t *scene) const
 {
-	return tex.getFloat(sp.P());
+	return tex.getFilteredFloat(sp.P(), sp.footprint());
 }
 
 colorA_t marbleNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 		const vector3d_t &eye, const scene_t *scene) const
 {
-	CFLOAT intensidad = tex.getFloat(sp.P());
+	CFLOAT intensidad = tex.getFilteredFloat(sp.P(), sp.footprint());
 	if ((input1==NULL) || (input2==NULL))
 		return colorA_t(intensidad);
 	return (input1->stdoutColor(state,sp,eye,scene))*intensidad
@@ -196,13 +197,13 @@ woodNode_t::woodNode_t(PFLOAT sz, int dep, CFLOAT turb, bool hrd,
 CFLOAT woodNode_t::stdoutFloat(renderState_t &state,const surfacePoint_t &sp, const vector3d_t &eye
 				,const scene_t *scene) const
 {
-	return tex.getFloat(sp.P());
+	return tex.getFilteredFloat(sp.P(), sp.footprint());
 }
 
 colorA_t woodNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 		const vector3d_t &eye, const scene_t *scene) const
 {
-	CFLOAT intensidad = tex.getFloat(sp.P());
+	CFLOAT intensidad = tex.getFilteredFloat(sp.P(), sp.footprint());
 	if ((input1==NULL) || (input2==NULL))
 		return colorA_t(intensidad);
 	return (input1->stdoutColor(state,sp,eye,scene))*intensidad
@@ -582,8 +583,10 @@ coneTraceNode_t::coneTraceNode_t(const color_t &c, PFLOAT angle, int s, PFLOAT i
 	{
 		samples = 1;
 		cosa = 1.0;
+		lobe = 0;
 	}
 	else {
+		lobe = 2.0*angle*M_PI/180.0;
 		// cosa not really used anymore
 		cosa = cos(angle*M_PI/180.0);
 		exponent = 1.f-cosa;
@@ -623,12 +626,18 @@ colorA_t coneTraceNode_t::stdoutColor(renderState_t &state,const surfacePoint_t
 
 	const void *oldorigin = state.skipelement;
 	state.skipelement = sp.getOrigin();
+	PFLOAT oldspread = state.raySpread;
 	if ((cosa==1.0) || (oldlevel>1)) 
 	{
+		// a single ray stands for the whole lobe
+		if ((state.rayWidth>0) || (oldspread>0)) state.raySpread += lobe;
 		color_t res = scene->raytrace(state,P, basedir)*color;
 		state.skipelement = oldorigin;
+		state.raySpread = oldspread;
 		return res;
 	}
+	// each sample covers its own stratum of the lobe
+	if ((state.rayWidth>0) || (oldspread>0)) state.raySpread += lobe*sqrdiv;
 
 	vector3d_t Ru, Rv;
 	createCS(basedir, Ru, Rv);
@@ -652,6 +661,7 @@ colorA_t coneTraceNode_t::stdoutColor(renderState_t &state,const surfacePoint_t
 	res *= div;
 	state.rayDivision = oldlevel;
 	state.skipelement = oldorigin;
+	state.raySpread = oldspread;
 	return res*color;
 }
 
@@ -709,14 +719,17 @@ shader_t * fresnelNode_t::factory(paramMap_t &bparams,std::list<paramMap_t> &lpa
 shader_t * imageNode_t::factory(paramMap_t &bparams, std::list<paramMap_t> &lparams,
 				renderEnvironment_t &render)
 {
-	string _name, _intp="bilinear";	// default bilinear interpolation
-	const string *name=&_name, *intp=&_intp;
+	string _name, _intp="bilinear", _cfile;	// default bilinear interpolation
+	const string *name=&_name, *intp=&_intp, *cfile=&_cfile;
+	bool mipmap=true;
 	bparams.getParam("interpolate", intp);
 	bparams.getParam("filename", name);	
+	bparams.getParam("mipmap", mipmap);
+	bparams.getParam("cache_file", cfile);
 	if (*name=="")
 		cerr << "Required argument filename not found for image block\n";
 	else
-		return new imageNode_t(name->c_str(), *intp);
+		return new imageNode_t(name->c_str(), *intp, mipmap, *cfile);
 	return NULL;
 }
 
@@ -889,13 +902,13 @@ musgraveNode_t::musgraveNode_t(const shader_t *in1, const shader_t *in2,
 CFLOAT musgraveNode_t::stdoutFloat(renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene) const
 {
-	return tex.getFloat(sp.P());
+	return tex.getFilteredFloat(sp.P(), sp.footprint());
 }
 
 colorA_t musgraveNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 		const vector3d_t &eye, const scene_t *scene)const
 {
-	CFLOAT intensidad = tex.getFloat(sp.P());
+	CFLOAT intensidad = tex.getFilteredFloat(sp.P(), sp.footprint());
 	if ((input1==NULL) || (input2==NULL)) return colorA_t(intensidad);
 	return (input1->stdoutColor(state, sp, eye, scene))*intensidad
 			 + (input2->stdoutColor(state, sp, eye, scene))*(1.0-intensidad);
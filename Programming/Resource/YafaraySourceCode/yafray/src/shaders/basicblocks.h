@@ -17,6 +17,7 @@ class floatToColor_t : public shaderNode_t
 		floatToColor_t(const shader_t *in):input(in) {};
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene=NULL)const;
+		virtual void getInputs(std::vector<const shader_t **> &in) {in.push_back(&input);};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -30,6 +31,7 @@ class colorToFloat_t : public shaderNode_t
 		virtual CFLOAT stdoutFloat(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene=NULL)const
 		{return input->stdoutColor(state,sp,eye,scene).energy();};
+		virtual void getInputs(std::vector<const shader_t **> &in) {in.push_back(&input);};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -49,6 +51,11 @@ class cloudsNode_t : public shaderNode_t
 				const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (((input1!=NULL) && (input2!=NULL)) || (ctype==1)); }
 		virtual ~cloudsNode_t() {};
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -70,6 +77,11 @@ class marbleNode_t : public shaderNode_t
 				const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (input1!=NULL) && (input2!=NULL); }
 		virtual ~marbleNode_t() {};
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -90,6 +102,11 @@ class woodNode_t : public shaderNode_t
 				const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (input1!=NULL) && (input2!=NULL); }
 		virtual ~woodNode_t() {};
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -111,6 +128,7 @@ class colorBandNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(CFLOAT x, renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene=NULL) const;
 
+		virtual void getInputs(std::vector<const shader_t **> &in) {in.push_back(&input);};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 	protected:
 		std::vector<std::pair<CFLOAT,colorA_t> > band;
@@ -152,6 +170,11 @@ class mulNode_t : public shaderNode_t
 			if(input2!=NULL) res*=input2->stdoutFloat(state,sp,eye,scene);
 			return res;
 		};
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -169,6 +192,7 @@ class sinNode_t : public shaderNode_t
 		{
 			return 0.5*sin(input->stdoutFloat(state,sp,eye,scene))+0.5;
 		};
+		virtual void getInputs(std::vector<const shader_t **> &in) {in.push_back(&input);};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -204,6 +228,15 @@ class phongNode_t : public shader_t
 		/// Destructor
 		virtual ~phongNode_t() {};
 
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&color);
+			in.push_back(&specular);
+			in.push_back(&env);
+			in.push_back(&caus_rcolor);
+			in.push_back(&caus_tcolor);
+			in.push_back(&bump);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -222,6 +255,12 @@ class rgbNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene)const;
 		virtual ~rgbNode_t() {};
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&inputred);
+			in.push_back(&inputgreen);
+			in.push_back(&inputblue);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 
@@ -240,6 +279,12 @@ class hsvNode_t : public shaderNode_t
 
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene)const;
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&inputhue);
+			in.push_back(&inputsaturation);
+			in.push_back(&inputvalue);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 
@@ -266,6 +311,8 @@ class coneTraceNode_t : public shaderNode_t
 		bool ref;
 		color_t color;
 		PFLOAT cosa, IOR, sqrdiv, exponent;
+		// spread of the whole lobe, in radians
+		PFLOAT lobe;
 		CFLOAT div;
 		int samples,sqr;
 };
@@ -282,6 +329,11 @@ class fresnelNode_t : public shaderNode_t
 
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene)const;
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&ref);
+			in.push_back(&trans);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 
@@ -294,16 +346,17 @@ class fresnelNode_t : public shaderNode_t
 class imageNode_t : public shaderNode_t
 {
 	public:
-		imageNode_t(const char *filename, const std::string &intp):tex(filename, intp) {}
+		imageNode_t(const char *filename, const std::string &intp, bool mipmap,
+				const std::string &cfile):tex(filename, intp, mipmap, cfile) {}
 		virtual CFLOAT stdoutFloat(renderState_t &state, const surfacePoint_t &sp,
 			const vector3d_t &eye, const scene_t *scene=NULL) const
 		{
-			return tex.getFloat(sp.P());
+			return tex.getFilteredFloat(sp.P(), sp.footprint());
 		}
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 			const vector3d_t &eye, const scene_t *scene=NULL) const
 		{
-			return tex.getColor(sp.P());
+			return tex.getFilteredColor(sp.P(), sp.footprint());
 		}
 		virtual bool discrete() const { return true; }
 		virtual ~imageNode_t() {}
@@ -324,6 +377,13 @@ class goboNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene)const;
 
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+			in.push_back(&goboColor);
+			in.push_back(&goboFloat);
+		};
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 
@@ -350,6 +410,11 @@ class voronoiNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (((input1!=NULL) && (input2!=NULL)) || iscolor); }
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 	protected:
 		textureVoronoi_t tex;
@@ -369,6 +434,11 @@ class musgraveNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (input1!=NULL) && (input2!=NULL); }
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 	protected:
 		textureMusgrave_t tex;
@@ -387,6 +457,11 @@ class distortedNoiseNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (input1!=NULL) && (input2!=NULL); }
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 	protected:
 		textureDistortedNoise_t tex;
@@ -404,6 +479,11 @@ class gradientNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (input1!=NULL) && (input2!=NULL); }
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 	protected:
 		textureGradient_t tex;
@@ -420,6 +500,11 @@ class randomNoiseNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state, const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene=NULL) const;
 		virtual bool isRGB() const { return (input1!=NULL) && (input2!=NULL); }
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 	protected:
 		textureRandomNoise_t tex;
@@ -114,6 +114,7 @@ class genericShader_t : public shader_t
 			ior = IOR;
 			return ((!ref.null()) | (!trans.null()));
 		}
+		virtual void getInputs(std::vector<const shader_t **> &in) {in.push_back(&environment);};
 
 		/** Adds a modulator.
 		 *
@@ -22,6 +22,7 @@
 
 #include "basictex.h"
 #include "object3d.h"
+#include "mapfile.h"
 #include <iostream>
 
 #include "targaIO.h"
@@ -81,7 +82,18 @@ textureClouds_t::textureClouds_t(int dep, PFLOAT sz, bool hd,
 
 CFLOAT textureClouds_t::getFloat(const point3d_t &p) const
 {
-	CFLOAT v = turbulence(nGen, p, depth, size, hard);
+	return getFilteredFloat(p, 0);
+}
+
+colorA_t textureClouds_t::getColor(const point3d_t &p) const
+{
+	return color1 + getFloat(p)*(color2 - color1);
+}
+
+// octaves finer than the footprint are left out
+CFLOAT textureClouds_t::getFilteredFloat(const point3d_t &p, PFLOAT width) const
+{
+	CFLOAT v = turbulence(nGen, p, depth, size, hard, width);
 	if (bias) {
 		v *= v;
 		if (bias==1) return -v;	// !!!
@@ -89,9 +101,9 @@ CFLOAT textureClouds_t::getFloat(const point3d_t &p) const
 	return v;
 }
 
-colorA_t textureClouds_t::getColor(const point3d_t &p) const
+colorA_t textureClouds_t::getFilteredColor(const point3d_t &p, PFLOAT width) const
 {
-	return color1 + getFloat(p)*(color2 - color1);
+	return color1 + getFilteredFloat(p, width)*(color2 - color1);
 }
 
 
@@ -131,9 +143,20 @@ textureMarble_t::textureMarble_t(int oct, PFLOAT sz, const color_t &c1, const co
 }
 
 CFLOAT textureMarble_t::getFloat(const point3d_t &p) const
+{
+	return getFilteredFloat(p, 0);
+}
+
+colorA_t textureMarble_t::getFilteredColor(const point3d_t &p, PFLOAT width) const
+{
+	return color1 + getFilteredFloat(p, width)*(color2 - color1);
+}
+
+// only the turbulence is filtered, the bands themselves are not
+CFLOAT textureMarble_t::getFilteredFloat(const point3d_t &p, PFLOAT width) const
 {
 	PFLOAT w = (p.x + p.y + p.z)*5.0
-					+ ((turb==0.0) ? 0.0 : turb*turbulence(nGen, p, octaves, size, hard));
+					+ ((turb==0.0) ? 0.0 : turb*turbulence(nGen, p, octaves, size, hard, width));
 	switch (wshape) {
 		case SAW:
 			w *= (PFLOAT)(0.5*M_1_PI);
@@ -192,13 +215,24 @@ textureWood_t::textureWood_t(int oct, PFLOAT sz, const color_t &c1, const color_
 }
 
 CFLOAT textureWood_t::getFloat(const point3d_t &p) const
+{
+	return getFilteredFloat(p, 0);
+}
+
+colorA_t textureWood_t::getFilteredColor(const point3d_t &p, PFLOAT width) const
+{
+	return color1 + getFilteredFloat(p, width)*(color2 - color1);
+}
+
+// only the turbulence is filtered, the bands themselves are not
+CFLOAT textureWood_t::getFilteredFloat(const point3d_t &p, PFLOAT width) const
 {
 	PFLOAT w;
 	if (rings)
 		w = sqrt(p.x*p.x + p.y*p.y + p.z*p.z)*20.0;
 	else
 		w = (p.x + p.y + p.z)*10.0;
-	w += (turb==0.0) ? 0.0 : turb*turbulence(nGen, p, octaves, size, hard);
+	w += (turb==0.0) ? 0.0 : turb*turbulence(nGen, p, octaves, size, hard, width);
 	switch (wshape) {
 		case SAW:
 			w *= (PFLOAT)(0.5*M_1_PI);
@@ -249,17 +283,25 @@ texture_t *textureWood_t::factory(paramMap_t &params,
 
 extern cBuffer_t* load_jpeg(const char *name);
 
-textureImage_t::textureImage_t(const char *filename, const string &intp)
+// loader for the image registry, may run on any thread
+static mipMap_t *loadImage(const string &file, bool mip, const string &cachefile)
 {
-	// interpolation type, bilinear default
-	intp_type = BILINEAR;
-	if (intp=="none")
-		intp_type = NONE;
-	else if (intp=="bicubic")
-		intp_type = BICUBIC;
-	
+	const char *filename = file.c_str();
+	mipMap_t *mipmap = NULL;
+
+	// a valid tiled file saves decoding the image at all
+	unsigned long long key = 0;
+	if (cachefile!="") {
+		key = mipMap_t::fileKey(filename, mip);
+		mipmap = mipMap_t::open(cachefile, key);
+		if (mipmap) {
+			cout << "Paging image file " << filename << " from " << cachefile << endl;
+			return mipmap;
+		}
+	}
+
 	// Load image, try to determine from extensions first
-	char *ext = strrchr(filename, '.');
+	const char *ext = strrchr(filename, '.');
 	bool jpg_tried = false;
 	bool tga_tried = false;
 	bool hdr_tried = false;
@@ -267,8 +309,8 @@ textureImage_t::textureImage_t(const char *filename, const string &intp)
 	bool exr_tried = false;
 #endif
 
-	image = NULL;
-	float_image = NULL;
+	cBuffer_t *image = NULL;
+	fcBuffer_t *float_image = NULL;
 
 	cout << "Loading image file " << filename << endl;
 
@@ -367,45 +409,83 @@ textureImage_t::textureImage_t(const char *filename, const string &intp)
 
 	}
 
-	if (image || float_image) {
+	if (image || float_image)
 		cout << "OK\n";
-		failed = false;
+	else {
+		cout << "Could not load image " << filename << endl;
+		return NULL;
+	}
+
+	// the pyramid keeps the texels as they were loaded, level 0 is the image
+	if (image) {
+		mipmap = new mipMap_t(*image, mip);
+		delete image;
 	}
 	else {
-		cout << "Could not load image\n";
-		failed = true;
+		mipmap = new mipMap_t(*float_image, mip);
+		delete float_image;
 	}
 
+	// from now on only the tiles in use are kept in memory
+	if (cachefile!="") {
+		mipMap_t *paged = NULL;
+		if (mipmap->save(cachefile, key))
+			paged = mipMap_t::open(cachefile, key);
+		if (paged) {
+			delete mipmap;
+			mipmap = paged;
+		}
+		else
+			cout << "Could not save image tiles to " << cachefile << endl;
+	}
+	return mipmap;
+}
+
+textureImage_t::textureImage_t(const char *filename, const string &intp,
+		bool mip, const string &cachefile)
+{
+	// interpolation type, bilinear default
+	intp_type = BILINEAR;
+	if (intp=="none")
+		intp_type = NONE;
+	else if (intp=="bicubic")
+		intp_type = BICUBIC;
+
 	prefilt = false;
+
+	// decoded along with all the other images before rendering, textures
+	// naming the same file share it
+	img = imageRegistry_t::global().use(filename, mip, cachefile, loadImage);
 }
 
 textureImage_t::~textureImage_t()
 {
-	if (image) {
-		delete image;
-		image = NULL;
-	}
-	if (float_image) {
-		delete float_image;
-		float_image = NULL;
-	}
+	imageRegistry_t::global().release(img);
 }
 
-// for use as background, pre-integrate image, currently assumes angular map
-// based on "An Efficient Representation for Irradiance Environment Maps" by Ramamoorthi/Hanrahan.
-void textureImage_t::preFilter(bool spheremap)
+#define SH_TAG "YAFSHCOE"
+
+// Projects image rows on the first 9 spherical harmonics, 9 colors per row.
+// Rows are summed apart so the result does not depend on the threads.
+class shProjectWork_t : public yafthreads::parallelWork_t
 {
-	if ((!image) && (!float_image)) return;
-	cout << "Pre-filtering...";
-	int width, height;
-	if (image) {
-		width = image->resx();
-		height = image->resy();
-	}
-	else {
-		width = float_image->resx();
-		height = float_image->resy();
-	}
+	public:
+		shProjectWork_t(const mipMap_t *m, bool s, vector<color_t> &r):
+			mipmap(m), spheremap(s), rows(r) {};
+		virtual void work(int begin, int end, int thread);
+	protected:
+		const mipMap_t *mipmap;
+		bool spheremap;
+		vector<color_t> &rows;
+};
+
+void shProjectWork_t::work(int begin, int end, int thread)
+{
+	int width=mipmap->resx(), height=mipmap->resy();
+	// whole rows at a time, paged images lock the tile cache once per row
+	vector<int> xs(width);
+	vector<colorA_t> row(width);
+	for (int i=0;i<width;i++) xs[i] = i;
 
 	float sa = 4.f*M_PI*M_PI/(width*height);
 	if (spheremap) sa *= 0.5f;
@@ -414,8 +494,11 @@ void textureImage_t::preFilter(bool spheremap)
 	GFLOAT theta, phi, sinphi, domega, x, y, z;
 	color_t col;
 
-	for (int j=0;j<height;j++) {
+	for (int j=begin;j<end;j++) {
+		color_t *SH_coeffs = &rows[9*j];
 		GFLOAT v = 1.f-2.f*(j/(GFLOAT)height);
+		int ty = (height-1)-j;
+		mipmap->texels(0, &xs[0], width, &ty, 1, &row[0]);
 		for (int i=0;i<width;i++) {
 			GFLOAT u = 2.f*(i/(GFLOAT)width)-1.f;
 			if (!spheremap) r = u*u + v*v;
@@ -434,10 +517,7 @@ void textureImage_t::preFilter(bool spheremap)
 					domega = sa * ((phi==0.f)?1.f:(sinphi/phi)); // sinc(phi) -> probe
 					x=sinphi*cos(theta);  y=cos(phi);  z=sinphi*sin(theta);
 				}
-				if (image)
-					(*image)(i, (height-1)-j) >> col;
-				else
-					(*float_image)(i, (height-1)-j) >> col;
+				col = row[i];
 				GFLOAT dc2=0.488603f*domega, dc3=1.092548f*domega;
 				SH_coeffs[0] += col * 0.282095f*domega;
 				SH_coeffs[1] += col * dc2 * y;
@@ -451,13 +531,51 @@ void textureImage_t::preFilter(bool spheremap)
 			}
 		}
 	}
+}
+
+// for use as background, pre-integrate image, currently assumes angular map
+// based on "An Efficient Representation for Irradiance Environment Maps" by Ramamoorthi/Hanrahan.
+// The coefficients are kept beside the image, an unchanged image is not even decoded.
+void textureImage_t::preFilter(bool spheremap, int threads)
+{
+	string shfile = img->fileName() + ".ysh";
+	keyHash_t key;
+	unsigned long long fkey = mipMap_t::fileKey(img->fileName(), false);
+	key.add(&fkey, sizeof(fkey));
+	key.add(spheremap);
+	cacheReader_t cache(shfile, SH_TAG, key.value());
+	const color_t *saved;
+	unsigned int count;
+	if (cache.readArray(saved, count) && (count==9)) {
+		cout << "Pre-filter coefficients read from " << shfile << endl;
+		for (int i=0;i<9;i++) SH_coeffs[i] = saved[i];
+		prefilt = true;
+		return;
+	}
+
+	// still parsing, the registry has not loaded the images yet
+	const mipMap_t *mipmap = img->load();
+	if (!mipmap) return;
+	cout << "Pre-filtering...";
+	int height = mipmap->resy();
+	vector<color_t> rows(9*height);
+	shProjectWork_t work(mipmap, spheremap, rows);
+	yafthreads::parallelFor(work, height, threads, 8);
+	for (int i=0;i<9;i++) SH_coeffs[i] = color_t(0.0);
+	for (int j=0;j<height;j++)
+		for (int i=0;i<9;i++) SH_coeffs[i] += rows[9*j+i];
 	cout << " Done" << endl;
 	prefilt = true;
+
+	cacheWriter_t out(shfile, SH_TAG, key.value());
+	out.writeArray(SH_coeffs, 9);
+	if (!out.ok())
+		cout << "Could not save pre-filter coefficients to " << shfile << endl;
 }
 
 colorA_t textureImage_t::getColorSH(const vector3d_t &n) const
 {
-	if ((!image) && (!float_image)) return colorA_t(0.0);
+	if (!prefilt) return colorA_t(0.0);
 	const float c1=0.429043f, c2=0.511664f, c3=0.743125f, c4=0.886227f, c5=0.247708f;
 	return M_1_PI * (c1*SH_coeffs[8]*(n.x*n.x - n.y*n.y) + c3*SH_coeffs[6]*n.z*n.z + c4*SH_coeffs[0] - c5*SH_coeffs[6]
 						+ 2.f*c1*(SH_coeffs[4]*n.x*n.y + SH_coeffs[7]*n.x*n.z + SH_coeffs[5]*n.y*n.z)
@@ -474,11 +592,11 @@ colorA_t cubicInterpolate(const colorA_t &c1, const colorA_t &c2,
 	return x*c3 + ix*c2 + ((4.f*t2 - t1)*(x*x*x-x) + (4.f*t1 - t2)*(ix*ix*ix-ix))*0.06666667f;
 }
 
-template<typename T>
-colorA_t interpolateImage(T image, textureImage_t::INTERPOLATE_TYPE intp, const point3d_t &p)
+colorA_t interpolateImage(const mipMap_t *mip, int l, textureImage_t::INTERPOLATE_TYPE intp,
+													const point3d_t &p)
 {
 	int x, y, x2, y2;
-	int resx=image->resx(), resy=image->resy();
+	int resx=mip->resx(l), resy=mip->resy(l);
 	CFLOAT xf = ((CFLOAT)resx * (p.x - floor(p.x)));
 	CFLOAT yf = ((CFLOAT)resy * (p.y - floor(p.y)));
 	if (intp!=textureImage_t::NONE) { xf -= 0.5f;  yf -= 0.5f; }
@@ -486,55 +604,42 @@ colorA_t interpolateImage(T image, textureImage_t::INTERPOLATE_TYPE intp, const
 	if ((y=(int)yf)<0) y = 0;
 	if (x>=resx) x = resx-1;
 	if (y>=resy) y = resy-1;
-	colorA_t c1;
-	(*image)(x, y) >> c1;
-	if (intp==textureImage_t::NONE) return c1;
-	colorA_t c2, c3, c4;
+	if (intp==textureImage_t::NONE) return mip->texel(l, x, y);
 	if ((x2=x+1)>=resx) x2 = resx-1;
 	if ((y2=y+1)>=resy) y2 = resy-1;
-	(*image)(x2, y)  >> c2;
-	(*image)(x,  y2) >> c3;
-	(*image)(x2, y2) >> c4;
 	CFLOAT dx=xf-floor(xf), dy=yf-floor(yf);
 	if (intp==textureImage_t::BILINEAR) {
+		// c[0] (x, y), c[1] (x2, y), c[2] (x, y2), c[3] (x2, y2)
+		int xs[2]={x, x2}, ys[2]={y, y2};
+		colorA_t c[4];
+		mip->texels(l, xs, 2, ys, 2, c);
 		CFLOAT w0=(1-dx)*(1-dy), w1=(1-dx)*dy, w2=dx*(1-dy), w3=dx*dy;
-		return colorA_t(w0*c1.getR() + w1*c3.getR() + w2*c2.getR() + w3*c4.getR(),
-										w0*c1.getG() + w1*c3.getG() + w2*c2.getG() + w3*c4.getG(),
-										w0*c1.getB() + w1*c3.getB() + w2*c2.getB() + w3*c4.getB(),
-										w0*c1.getA() + w1*c3.getA() + w2*c2.getA() + w3*c4.getA());
+		return colorA_t(w0*c[0].getR() + w1*c[2].getR() + w2*c[1].getR() + w3*c[3].getR(),
+										w0*c[0].getG() + w1*c[2].getG() + w2*c[1].getG() + w3*c[3].getG(),
+										w0*c[0].getB() + w1*c[2].getB() + w2*c[1].getB() + w3*c[3].getB(),
+										w0*c[0].getA() + w1*c[2].getA() + w2*c[1].getA() + w3*c[3].getA());
 	}
 	int x0=x-1, x3=x2+1, y0=y-1, y3=y2+1;
 	if (x0<0) x0 = 0;
 	if (y0<0) y0 = 0;
 	if (x3>=resx) x3 = resx-1;
 	if (y3>=resy) y3 = resy-1;
-	colorA_t c0, c5, c6, c7, c8, c9, cA, cB, cC, cD, cE, cF;
-	(*image)(x0, y0) >> c0;
-	(*image)(x,  y0) >> c5;
-	(*image)(x2, y0) >> c6;
-	(*image)(x3, y0) >> c7;
-	(*image)(x0, y)  >> c8;
-	(*image)(x3, y)  >> c9;
-	(*image)(x0, y2) >> cA;
-	(*image)(x3, y2) >> cB;
-	(*image)(x0, y3) >> cC;
-	(*image)(x,  y3) >> cD;
-	(*image)(x2, y3) >> cE;
-	(*image)(x3, y3) >> cF;
-	c0 = cubicInterpolate(c0, c5, c6, c7, dx);
-	c8 = cubicInterpolate(c8, c1, c2, c9, dx);
-	cA = cubicInterpolate(cA, c3, c4, cB, dx);
-	cC = cubicInterpolate(cC, cD, cE, cF, dx);
-	return cubicInterpolate(c0, c8, cA, cC, dy);
+	int xs[4]={x0, x, x2, x3}, ys[4]={y0, y, y2, y3};
+	colorA_t c[16];
+	mip->texels(l, xs, 4, ys, 4, c);
+	colorA_t r0 = cubicInterpolate(c[0], c[1], c[2], c[3], dx);
+	colorA_t r1 = cubicInterpolate(c[4], c[5], c[6], c[7], dx);
+	colorA_t r2 = cubicInterpolate(c[8], c[9], c[10], c[11], dx);
+	colorA_t r3 = cubicInterpolate(c[12], c[13], c[14], c[15], dx);
+	return cubicInterpolate(r0, r1, r2, r3, dy);
 }
 
 colorA_t textureImage_t::getColor(const point3d_t &p) const
 {
 	// p->x/y == u, v
-	if (image)
-		return interpolateImage(image, intp_type, p);
-	else if (float_image)
-		return interpolateImage(float_image, intp_type, p);
+	const mipMap_t *mipmap = img->get();
+	if (mipmap)
+		return interpolateImage(mipmap, 0, intp_type, p);
 	return color_t(0.0);
 }
 
@@ -543,17 +648,38 @@ CFLOAT textureImage_t::getFloat(const point3d_t &p) const
 	return getColor(p).energy();
 }
 
+// trilinear, blends the two levels around the filter width
+colorA_t textureImage_t::getFilteredColor(const point3d_t &p, PFLOAT width) const
+{
+	const mipMap_t *mipmap = img->get();
+	if (!mipmap) return color_t(0.0);
+	PFLOAT lod = mipmap->lod(width);
+	int l = (int)lod;
+	CFLOAT f = lod - l;
+	colorA_t c = interpolateImage(mipmap, l, intp_type, p);
+	if (f>0) c = (1.f-f)*c + f*interpolateImage(mipmap, l+1, intp_type, p);
+	return c;
+}
+
+CFLOAT textureImage_t::getFilteredFloat(const point3d_t &p, PFLOAT width) const
+{
+	return getFilteredColor(p, width).energy();
+}
+
 texture_t *textureImage_t::factory(paramMap_t &params,
 		renderEnvironment_t &render)
 {
-	string _name, _intp="bilinear";	// default bilinear interpolation
-	const string *name=&_name, *intp=&_intp;
+	string _name, _intp="bilinear", _cfile;	// default bilinear interpolation
+	const string *name=&_name, *intp=&_intp, *cfile=&_cfile;
+	bool mipmap=true;
 	params.getParam("interpolate", intp);
 	params.getParam("filename", name);	
+	params.getParam("mipmap", mipmap);
+	params.getParam("cache_file", cfile);
 	if (*name=="")
 		cerr << "Required argument filename not found for image texture\n";
 	else
-		return new textureImage_t(name->c_str(), *intp);
+		return new textureImage_t(name->c_str(), *intp, mipmap, *cfile);
 	return NULL;
 }
 
@@ -590,24 +716,28 @@ textureVoronoi_t::textureVoronoi_t(const color_t &c1, const color_t &c2,
 	if (iscale!=0) iscale = isc/iscale;
 }
 
+CFLOAT textureVoronoi_t::intensity(const voronoiFeatures_t &f) const
+{
+	return iscale * fabs(w1*f.d[0] + w2*f.d[1] + w3*f.d[2] + w4*f.d[3]);
+}
+
 CFLOAT textureVoronoi_t::getFloat(const point3d_t &p) const
 {
-	vGen.getFeatures(p*size);
-	return iscale * fabs(w1*vGen.getDistance(0) + w2*vGen.getDistance(1)
-			+ w3*vGen.getDistance(2) + w4*vGen.getDistance(3));
+	return intensity(vGen.getFeatures(p*size));
 }
 
 colorA_t textureVoronoi_t::getColor(const point3d_t &p) const
 {
-	CFLOAT inte = getFloat(p);
+	voronoiFeatures_t f = vGen.getFeatures(p*size);
+	CFLOAT inte = intensity(f);
 	colorA_t col(0.0);
 	if (coltype) {
-		col += aw1 * cellNoiseColor(vGen.getPoint(0));
-		col += aw2 * cellNoiseColor(vGen.getPoint(1));
-		col += aw3 * cellNoiseColor(vGen.getPoint(2));
-		col += aw4 * cellNoiseColor(vGen.getPoint(3));
+		col += aw1 * cellNoiseColor(f.p[0]);
+		col += aw2 * cellNoiseColor(f.p[1]);
+		col += aw3 * cellNoiseColor(f.p[2]);
+		col += aw4 * cellNoiseColor(f.p[3]);
 		if (coltype>=2) {
-			CFLOAT t1 = (vGen.getDistance(1) - vGen.getDistance(0))*10.0;
+			CFLOAT t1 = (f.d[1] - f.d[0])*10.0;
 			if (t1>1) t1=1;
 			if (coltype==3) t1*=inte; else t1*=iscale;
 			col *= t1;
@@ -679,6 +809,16 @@ CFLOAT textureMusgrave_t::getFloat(const point3d_t &p) const
 	return iscale * (*mGen)(p*size);
 }
 
+colorA_t textureMusgrave_t::getFilteredColor(const point3d_t &p, PFLOAT width) const
+{
+	return color1 + getFilteredFloat(p, width)*(color2 - color1);
+}
+
+CFLOAT textureMusgrave_t::getFilteredFloat(const point3d_t &p, PFLOAT width) const
+{
+	return iscale * (*mGen)(p*size, width*size);
+}
+
 colorA_t textureMusgrave_t::getColor(const point3d_t &p) const
 {
 	return color1 + getFloat(p)*(color2 - color1);
@@ -725,7 +865,10 @@ CFLOAT textureDistortedNoise_t::getFloat(const point3d_t &p) const
 	// get a random vector and scale the randomization
 	const point3d_t ofs(13.5, 13.5, 13.5);
 	point3d_t tp(p*size);
-	point3d_t rv(getSignedNoise(nGen1, tp+ofs), getSignedNoise(nGen1, tp), getSignedNoise(nGen1, tp-ofs));
+	const point3d_t rp[3] = {tp+ofs, tp, tp-ofs};
+	PFLOAT rn[3];
+	nGen1->evaluate(rp, rn, 3);
+	point3d_t rv((PFLOAT)2.0*rn[0] - (PFLOAT)1.0, (PFLOAT)2.0*rn[1] - (PFLOAT)1.0, (PFLOAT)2.0*rn[2] - (PFLOAT)1.0);
 	return getSignedNoise(nGen2, tp+rv*distort);	// distorted-domain noise
 }
 
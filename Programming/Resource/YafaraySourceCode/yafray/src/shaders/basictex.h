@@ -25,6 +25,7 @@
 #include "texture.h"
 #include "params.h"
 #include "noise.h"
+#include "mipmap.h"
 
 #ifdef HAVE_CONFIG_H
 #include<config.h>
@@ -49,6 +50,8 @@ class textureClouds_t : public texture_t
 
 		virtual colorA_t getColor(const point3d_t &p) const;
 		virtual CFLOAT getFloat(const point3d_t &p) const;
+		virtual colorA_t getFilteredColor(const point3d_t &p, PFLOAT width) const;
+		virtual CFLOAT getFilteredFloat(const point3d_t &p, PFLOAT width) const;
 
 		static texture_t *factory(paramMap_t &params,renderEnvironment_t &render);
 	protected:
@@ -75,6 +78,8 @@ class textureMarble_t : public texture_t
 
 		virtual colorA_t getColor(const point3d_t &p) const;
 		virtual CFLOAT getFloat(const point3d_t &p) const;
+		virtual colorA_t getFilteredColor(const point3d_t &p, PFLOAT width) const;
+		virtual CFLOAT getFilteredFloat(const point3d_t &p, PFLOAT width) const;
 
 		static texture_t *factory(paramMap_t &params,renderEnvironment_t &render);
 	protected:
@@ -102,6 +107,8 @@ class textureWood_t : public texture_t
 
 		virtual colorA_t getColor(const point3d_t &p) const;
 		virtual CFLOAT getFloat(const point3d_t &p) const;
+		virtual colorA_t getFilteredColor(const point3d_t &p, PFLOAT width) const;
+		virtual CFLOAT getFilteredFloat(const point3d_t &p, PFLOAT width) const;
 
 		static texture_t *factory(paramMap_t &params,renderEnvironment_t &render);
 	protected:
@@ -128,6 +135,7 @@ class textureVoronoi_t : public texture_t
 
 		static texture_t *factory(paramMap_t &params, renderEnvironment_t &render);
 	protected:
+		CFLOAT intensity(const voronoiFeatures_t &f) const;
 		color_t color1, color2;
 		CFLOAT w1, w2, w3, w4;	// feature weights
 		CFLOAT aw1, aw2, aw3, aw4;	// absolute value of above
@@ -158,6 +166,8 @@ class textureMusgrave_t : public texture_t
 
 		virtual colorA_t getColor(const point3d_t &p) const;
 		virtual CFLOAT getFloat(const point3d_t &p) const;
+		virtual colorA_t getFilteredColor(const point3d_t &p, PFLOAT width) const;
+		virtual CFLOAT getFilteredFloat(const point3d_t &p, PFLOAT width) const;
 
 		static texture_t *factory(paramMap_t &params, renderEnvironment_t &render);
 
@@ -235,34 +245,40 @@ class textureImage_t : public texture_t
 {
 	public:
 		enum INTERPOLATE_TYPE {NONE, BILINEAR, BICUBIC};
-		textureImage_t(const char *filename, const std::string &intp);
+		textureImage_t(const char *filename, const std::string &intp,
+				bool mipmap=true, const std::string &cachefile="");
 		virtual ~textureImage_t();
 
 		virtual colorA_t getColor(const point3d_t &sp) const;
 		virtual CFLOAT getFloat(const point3d_t &p) const;
+		virtual colorA_t getFilteredColor(const point3d_t &p, PFLOAT width) const;
+		virtual CFLOAT getFilteredFloat(const point3d_t &p, PFLOAT width) const;
 
 		// for Spherical harmonic coefficients
-		virtual void preFilter(bool spheremap);
+		virtual void preFilter(bool spheremap, int threads=1);
 		virtual colorA_t getColorSH(const vector3d_t &n) const;
-		virtual bool has_SH() const { return ((!failed) && (prefilt)); }
+		virtual bool has_SH() const { return prefilt; }
 
-		virtual bool loadFailed() const { return failed; }
+		virtual bool loadFailed() const { return img->get()==NULL; }
 		virtual bool discrete() { return true; }
 		virtual GFLOAT toPixelU(GFLOAT u)
 		{
-			if (failed) return 0.0;
-			return u*(GFLOAT)image->resx();
+			const mipMap_t *mipmap = img->get();
+			if (!mipmap) return 0.0;
+			return u*(GFLOAT)mipmap->resx();
 		}
 		virtual GFLOAT toPixelV(GFLOAT v)
 		{
-			if (failed) return 0.0;
-			return v*(GFLOAT)image->resy();
+			const mipMap_t *mipmap = img->get();
+			if (!mipmap) return 0.0;
+			return v*(GFLOAT)mipmap->resy();
 		}
 		static texture_t *factory(paramMap_t &params,renderEnvironment_t &render);
 	protected:
-		cBuffer_t *image;
-		fcBuffer_t *float_image;
-		bool failed, prefilt;
+		// all levels of the image, loaded or paged from cachefile, shared
+		// with the other textures of the same file
+		imageRegistry_t::image_t *img;
+		bool prefilt;
 		INTERPOLATE_TYPE intp_type;
 		color_t SH_coeffs[9];
 };
@@ -240,6 +240,7 @@ CFLOAT blenderMapperNode_t::stdoutFloat(renderState_t &state,
 	if (doMapping(sp, eye, mpoint)) return 0.0;
 	surfacePoint_t tempsp(sp);
 	tempsp.P() = mpoint;
+	tempsp.setFootprint(filterWidth(sp, eye, mpoint));
 	return mapped->stdoutFloat(state, tempsp, eye, scene);
 }
 
@@ -251,9 +252,16 @@ colorA_t blenderMapperNode_t::stdoutColor(renderState_t &state,
 	if (doMapping(sp, eye, mpoint)) return color_t(0.0);
 	surfacePoint_t tempsp(sp);
 	tempsp.P() = mpoint;
+	tempsp.setFootprint(filterWidth(sp, eye, mpoint));
 	return mapped->stdoutColor(state, tempsp, eye, scene);
 }
 
+PFLOAT blenderMapperNode_t::filterWidth(const surfacePoint_t &sp, const vector3d_t &eye,
+		const point3d_t &mpoint) const
+{
+	return mappedFootprintWidth(*this, tex_coords, sp, eye, mpoint, mapped->discrete());
+}
+
 void blenderMapperNode_t::string2maptype(const std::string &mapname)
 {
 	// default "flat"
@@ -1094,6 +1102,15 @@ void blenderShader_t::displace(renderState_t &state,surfacePoint_t &sp, const ve
 	}
 }
 
+void blenderShader_t::getInputs(std::vector<const shader_t **> &in)
+{
+	in.push_back(&diffRamp);
+	in.push_back(&specRamp);
+	in.push_back(&environment);
+	for(vector<blenderModulator_t>::iterator ite=mods.begin();ite!=mods.end();++ite)
+		(*ite).getInputs(in);
+}
+
 shader_t * blenderShader_t::factory(paramMap_t &bparams, std::list<paramMap_t> &lmod,
 				renderEnvironment_t &render)
 {
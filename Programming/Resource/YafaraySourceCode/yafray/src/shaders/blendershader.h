@@ -24,11 +24,14 @@ class blenderMapperNode_t : public shaderNode_t
 				const scene_t *scene=NULL) const;
 		virtual bool discrete()const {return mapped->discrete();};
 		virtual bool isRGB() const { return mapped->isRGB(); }
+		virtual void getInputs(std::vector<const shader_t **> &in) {in.push_back(&mapped);};
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 
+		bool doMapping(const surfacePoint_t &sp, const vector3d_t &eye,point3d_t &texpt) const;
+
 	protected:
 
-		bool doMapping(const surfacePoint_t &sp, const vector3d_t &eye,point3d_t &texpt) const;
+		PFLOAT filterWidth(const surfacePoint_t &sp, const vector3d_t &eye, const point3d_t &mpoint) const;
 		// size factors
 		void sizeX(GFLOAT c) { _sizex=c; }
 		void sizeY(GFLOAT c) { _sizey=c; }
@@ -140,6 +143,7 @@ class blenderModulator_t : public modulator_t
 		}
 		// use texture as normalmap
 		void setNormap(bool nmap) { rgbnormap = nmap; }
+		void getInputs(std::vector<const shader_t **> &in) { in.push_back(&input); }
 
 	protected:
 
@@ -296,6 +300,8 @@ class blenderShader_t : public shader_t
 			if (int(mst.find("onlyshadow"))!=-1) mat_mode |= MAT_ONLYSHADOW;
 		}
 
+		virtual void getInputs(std::vector<const shader_t **> &in);
+
 		static shader_t * factory(paramMap_t &, std::list<paramMap_t> &, renderEnvironment_t &);
 
 	protected:
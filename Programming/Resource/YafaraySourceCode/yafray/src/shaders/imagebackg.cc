@@ -6,20 +6,18 @@ using namespace std;
 __BEGIN_YAFRAY
 
 imageBackground_t::imageBackground_t(const char* fname, const std::string &intp,
-				CFLOAT bri_adj, const matrix4x4_t &m, mappingType mt, bool prefilt)
+				CFLOAT bri_adj, const matrix4x4_t &m, mappingType mt, bool prefilt, int threads)
 {
-	img = new textureImage_t(fname, intp);
-	if (img->loadFailed()) {
-		delete img;
-		img = NULL;
-	}
+	// backgrounds are looked up unfiltered, level 0 is enough. The image is
+	// decoded with the others, a missing one just looks black
+	img = new textureImage_t(fname, intp, false);
 	mType = mt;
 	brightness_scale = pow((CFLOAT)2.0, bri_adj);
 	if ((img!=NULL) && prefilt) {
 		if (mt==IBG_TUBE)
 			cout << "[background_image]: Can't do prefilter for tube mapping yet\n";
 		else
-			img->preFilter((mt==IBG_SPHERE));
+			img->preFilter((mt==IBG_SPHERE), threads);
 	}
 	mtx = m;
 }
@@ -49,6 +47,23 @@ color_t imageBackground_t::operator() (const vector3d_t &dir, renderState_t &sta
 	return brightness_scale * img->getColor(point3d_t(u, v, 0));
 }
 
+// Brightness of the image at the center of every pixel, in map coordinates.
+// Prefiltered backgrounds light with the SH colors, the image is no guide.
+envSampler_t *imageBackground_t::buildSampler() const
+{
+	if ((img==NULL) || img->loadFailed() || img->has_SH() || (mType==IBG_TUBE)) return NULL;
+	int w=(int)img->toPixelU(1), h=(int)img->toPixelV(1);
+	vector<float> lum(w*h);
+	for (int y=0;y<h;y++) {
+		PFLOAT v = (y+0.5)/(PFLOAT)h;
+		for (int x=0;x<w;x++)
+			lum[y*w+x] = img->getColor(point3d_t((x+0.5)/(PFLOAT)w, (mType==IBG_ANGULAR) ? 1.0-v : v, 0)).energy();
+	}
+	envSampler_t *sam = new envSampler_t(lum, w, h, (mType==IBG_ANGULAR) ? envSampler_t::MAP_ANGULAR : envSampler_t::MAP_SPHERE);
+	sam->setTransform(mtx);
+	return sam;
+}
+
 background_t *imageBackground_t::factory(paramMap_t &params, renderEnvironment_t &render)
 {
 	string _filename, _mapping, _intp="bilinear";
@@ -95,7 +110,7 @@ background_t *imageBackground_t::factory(paramMap_t &params, renderEnvironment_t
 		cerr << "[background_image]: Error,  No filename given\n";
 		return NULL;
 	}
-	return new imageBackground_t(filename->c_str(), *intp, expadj, mtx, mt, prefilt);
+	return new imageBackground_t(filename->c_str(), *intp, expadj, mtx, mt, prefilt, render.getCPUs());
 }
 
 __END_YAFRAY
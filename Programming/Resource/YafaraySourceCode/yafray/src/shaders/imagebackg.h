@@ -17,12 +17,15 @@ class imageBackground_t: public background_t
 	public:
 		enum mappingType {IBG_SPHERE, IBG_ANGULAR, IBG_TUBE};
 		imageBackground_t(const char* fname, const std::string &intp, CFLOAT bri_adj, const matrix4x4_t &m,
-					mappingType mt=IBG_SPHERE, bool prefilt=false);
+					mappingType mt=IBG_SPHERE, bool prefilt=false, int threads=1);
 		virtual ~imageBackground_t();
 		virtual color_t operator() (const vector3d_t &dir, renderState_t &state, bool filtered=false) const;
 
 		static background_t *factory(paramMap_t &,renderEnvironment_t &);
 	protected:
+		// the image is only decoded before rendering, so not at construction
+		virtual envSampler_t *buildSampler() const;
+
 		mappingType mType;
 		texture_t* img;
 		CFLOAT brightness_scale;
@@ -42,6 +42,11 @@ class mixModeNode_t : public shaderNode_t
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 				const vector3d_t &eye, const scene_t *scene)const;
 
+		virtual void getInputs(std::vector<const shader_t **> &in)
+		{
+			in.push_back(&input1);
+			in.push_back(&input2);
+		};
 		static void fillModes();
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				renderEnvironment_t &);
@@ -1,11 +1,12 @@
 
 #include "sss.h"
+#include <algorithm>
 
 using namespace std;
 
 __BEGIN_YAFRAY
 
-sssNode_t::sssNode_t(const color_t &c,PFLOAT r,int s):color(c),radius(r)
+sssNode_t::sssNode_t(const color_t &c,PFLOAT r,int s):color(c),radius(r),cloud(false)
 {
 	sqrtsamples=(int)sqrt((PFLOAT)s);
 	samples=sqrtsamples*sqrtsamples;
@@ -20,21 +21,15 @@ color_t sssNode_t::sampleObject(renderState_t &state,const object3d_t *obj,
 																const point3d_t &outpoint,
 																CFLOAT &W,const scene_t *scene)const
 {
-	try
-	{
-		surfacePoint_t sp;
-		if(!obj->shoot(state,sp,from,ray,false,farradius+halfradius)) throw true;
-		PFLOAT distance=(sp.P()-outpoint).length();
-		if(distance>farradius) throw true;
-		W=exp(exponent*distance);
-		if(W<0.01) throw true;
-		return scene->light(state,sp,sp.P()+sp.Ng()); // This includes specular highlights, shouldn't
-	}
-	catch (bool useless)
-	{
-		W=0;
-		return color_t(0,0,0);
-	}
+	W=0;
+	surfacePoint_t sp;
+	if(!obj->shoot(state,sp,from,ray,false,farradius+halfradius)) return color_t(0,0,0);
+	PFLOAT distance=(sp.P()-outpoint).length();
+	if(distance>farradius) return color_t(0,0,0);
+	CFLOAT w=exp(exponent*distance);
+	if(w<0.01) return color_t(0,0,0);
+	W=w;
+	return scene->light(state,sp,sp.P()+sp.Ng()); // This includes specular highlights, shouldn't
 }
 
 point3d_t sssNode_t::getSamplingPoint(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye)const
@@ -64,6 +59,14 @@ colorA_t sssNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 	if(scene==NULL) return colorA_t(0,0,0);
 	if(state.rayDivision>1) return colorA_t(0,0,0); // avoid indirect recursion
 	state.rayDivision+=samples;
+	if(cloud)
+	{
+		const sssTree_t *tree=getCloud(state,sp.getObject(),scene);
+		state.rayDivision-=samples;
+		// scaled like the probe estimate over a flat evenly lit surface
+		color_t E=tree->eval(sp.P(),-exponent,farradius*4.0,0.05);
+		return (E*color)*(0.5*expinv);
+	}
 	//point3d_t above=sp.P()+Ng*halfradius;
 	point3d_t below=getSamplingPoint(state,sp,eye);
 	CFLOAT Wtotal=(CFLOAT)samples;
@@ -126,6 +129,178 @@ colorA_t sssNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
 	*/
 }
 
+sssNode_t::~sssNode_t()
+{
+	for(map<const object3d_t *,sssTree_t *>::iterator i=clouds.begin();i!=clouds.end();++i)
+		delete i->second;
+}
+
+const sssTree_t *sssNode_t::getCloud(renderState_t &state,const object3d_t *obj,
+		const scene_t *scene)const
+{
+	bool present;
+	sssClouds_t *local=state.context.getDestructible(_clouds,present);
+	if(!present)
+	{
+		local=new sssClouds_t;
+		state.context.storeDestructible(_clouds,local);
+	}
+	map<const object3d_t *,const sssTree_t *>::iterator l=local->clouds.find(obj);
+	if(l!=local->clouds.end()) return l->second;
+
+	mutex.wait();
+	sssTree_t *&tree=clouds[obj];
+	if(tree==NULL)
+	{
+		vector<sssPoint_t> points;
+		buildCloud(state,obj,scene,points);
+		tree=new sssTree_t(points);
+		cout<<"[sss]: "<<tree->size()<<" irradiance points"<<endl;
+	}
+	mutex.signal();
+	local->clouds[obj]=tree;
+	return tree;
+}
+
+/* The points are found shooting a grid of rays through the object along
+ * the three axes, following each ray through all the layers. A surface
+ * with normal N gets hits at a density of |N.x|+|N.y|+|N.z| per grid
+ * cell, so every point stands for spacing^2 over that much area. */
+void sssNode_t::buildCloud(renderState_t &state,const object3d_t *obj,const scene_t *scene,
+		vector<sssPoint_t> &points)const
+{
+	point3d_t a,g;
+	obj->getBound().get(a,g);
+	PFLOAT lo[3]={a.x,a.y,a.z},hi[3]={g.x,g.y,g.z};
+	surfacePoint_t sp;
+	for(int axis=0;axis<3;++axis)
+	{
+		int u=(axis+1)%3,v=(axis+2)%3;
+		vector3d_t ray((axis==0) ? 1 : 0,(axis==1) ? 1 : 0,(axis==2) ? 1 : 0);
+		PFLOAT c[3];
+		for(c[u]=lo[u]+spacing*0.5;c[u]<hi[u];c[u]+=spacing)
+			for(c[v]=lo[v]+spacing*0.5;c[v]<hi[v];c[v]+=spacing)
+			{
+				c[axis]=lo[axis]-spacing;
+				point3d_t from(c[0],c[1],c[2]);
+				for(int layer=0;layer<64;++layer)
+				{
+					if(!obj->shoot(state,sp,from,ray,false)) break;
+					vector3d_t N=sp.Ng();
+					N.normalize();
+					sssPoint_t p;
+					p.P=sp.P();
+					p.area=spacing*spacing/(fabs(N.x)+fabs(N.y)+fabs(N.z));
+					p.E=scene->light(state,sp,sp.P()+sp.Ng());
+					points.push_back(p);
+					// the mesh tree does not honour skipelement, step past the hit
+					from=sp.P()+ray*MIN_RAYDIST;
+				}
+			}
+	}
+}
+
+struct octantOrder_f
+{
+	octantOrder_f(const point3d_t &m):mid(m) {};
+	int octant(const sssPoint_t &p)const
+	{
+		return (p.P.x>mid.x) | ((p.P.y>mid.y)<<1) | ((p.P.z>mid.z)<<2);
+	};
+	bool operator () (const sssPoint_t &a,const sssPoint_t &b)const
+	{
+		return octant(a)<octant(b);
+	};
+	point3d_t mid;
+};
+
+sssTree_t::sssTree_t(const vector<sssPoint_t> &p):points(p)
+{
+	if(!points.empty()) build(0,points.size(),0);
+}
+
+int sssTree_t::build(unsigned int first,unsigned int count,int depth)
+{
+	int index=nodes.size();
+	nodes.push_back(node_t());
+	node_t n;
+	n.min=n.max=points[first].P;
+	n.area=0;
+	n.power=color_t(0.0);
+	point3d_t center(0,0,0);
+	for(unsigned int i=first;i<first+count;++i)
+	{
+		const sssPoint_t &p=points[i];
+		if(p.P.x<n.min.x) n.min.x=p.P.x;
+		if(p.P.y<n.min.y) n.min.y=p.P.y;
+		if(p.P.z<n.min.z) n.min.z=p.P.z;
+		if(p.P.x>n.max.x) n.max.x=p.P.x;
+		if(p.P.y>n.max.y) n.max.y=p.P.y;
+		if(p.P.z>n.max.z) n.max.z=p.P.z;
+		n.area+=p.area;
+		n.power+=p.E*p.area;
+		center=center+p.area*p.P;
+	}
+	n.center=(n.area>0) ? center/n.area : points[first].P;
+	n.first=first;
+	n.count=count;
+	n.leaf=(count<=8) || (depth>=24);
+	for(int c=0;c<8;++c) n.child[c]=-1;
+	if(!n.leaf)
+	{
+		octantOrder_f order((n.min+n.max)*0.5);
+		sort(points.begin()+first,points.begin()+first+count,order);
+		unsigned int start=first;
+		for(int c=0;c<8;++c)
+		{
+			unsigned int end=start;
+			while((end<first+count) && (order.octant(points[end])==c)) ++end;
+			if(end>start) n.child[c]=build(start,end-start,depth+1);
+			start=end;
+		}
+	}
+	nodes[index]=n;
+	return index;
+}
+
+color_t sssTree_t::eval(const point3d_t &P,PFLOAT a,PFLOAT cutoff,PFLOAT maxangle)const
+{
+	color_t total(0.0);
+	if(nodes.empty()) return total;
+	PFLOAT cutoff2=cutoff*cutoff;
+	int stack[24*8+1];
+	int top=0;
+	stack[top++]=0;
+	while(top>0)
+	{
+		const node_t &n=nodes[stack[--top]];
+		PFLOAT dx=max(max(n.min.x-P.x,P.x-n.max.x),(PFLOAT)0);
+		PFLOAT dy=max(max(n.min.y-P.y,P.y-n.max.y),(PFLOAT)0);
+		PFLOAT dz=max(max(n.min.z-P.z,P.z-n.max.z),(PFLOAT)0);
+		PFLOAT dbox=dx*dx+dy*dy+dz*dz;
+		if(dbox>cutoff2) continue;
+		if(n.leaf)
+		{
+			for(unsigned int i=n.first;i<n.first+n.count;++i)
+			{
+				PFLOAT r=(points[i].P-P).length();
+				if(r<cutoff) total+=points[i].E*(points[i].area*exp(-a*r));
+			}
+			continue;
+		}
+		vector3d_t D=n.center-P;
+		PFLOAT d2=D*D;
+		if((dbox>0) && (n.area<maxangle*d2))
+		{
+			total+=n.power*exp(-a*sqrt(d2));
+			continue;
+		}
+		for(int c=0;c<8;++c)
+			if(n.child[c]>=0) stack[top++]=n.child[c];
+	}
+	return total*(a*a/(2.0*M_PI));
+}
+
 shader_t * sssNode_t::factory(paramMap_t &bparams,std::list<paramMap_t> &lparams,
 				        renderEnvironment_t &render)
 {
@@ -137,7 +312,18 @@ shader_t * sssNode_t::factory(paramMap_t &bparams,std::list<paramMap_t> &lparams
 	bparams.getParam("radius",radius);
 	bparams.getParam("samples",samples);
 
-	return new sssNode_t(color,radius,samples);
+	string _mode;
+	const string *mode=&_mode;
+	bparams.getParam("mode",mode);
+	sssNode_t *node=new sssNode_t(color,radius,samples);
+	if(*mode=="pointcloud")
+	{
+		float spacing=radius*0.25;
+		bparams.getParam("spacing",spacing);
+		if(spacing<=0) spacing=radius*0.25;
+		node->setCloud(spacing);
+	}
+	return node;
 }
 extern "C"
 {
@@ -4,6 +4,9 @@
 #include "metashader.h"
 #include "basictex.h"
 #include "params.h"
+#include "ccthreads.h"
+#include <vector>
+#include <map>
 
 #ifdef HAVE_CONFIG_H
 #include<config.h>
@@ -11,16 +14,65 @@
 
 __BEGIN_YAFRAY
 
+/// Point of the irradiance cloud of an object
+struct sssPoint_t
+{
+	point3d_t P;
+	PFLOAT area;
+	color_t E;
+};
+
+/** Octree over the irradiance cloud of one object.
+ *
+ * Every node keeps the total area and power of its points and their area
+ * weighted center, so a node that is small as seen from the shading point
+ * is used as a single point. See Jensen and Buhler, "A rapid hierarchical
+ * rendering technique for translucent materials" (2002).
+ */
+class sssTree_t
+{
+	public:
+		sssTree_t(const std::vector<sssPoint_t> &p);
+		/// Irradiance spread with a normalized exp(-a*r) falloff
+		color_t eval(const point3d_t &P,PFLOAT a,PFLOAT cutoff,PFLOAT maxangle)const;
+		unsigned int size()const {return points.size();};
+	protected:
+		struct node_t
+		{
+			point3d_t min,max,center;
+			PFLOAT area;
+			color_t power;
+			int child[8];
+			unsigned int first,count;
+			bool leaf;
+		};
+		int build(unsigned int first,unsigned int count,int depth);
+
+		std::vector<sssPoint_t> points;
+		std::vector<node_t> nodes;
+};
+
+/// Clouds already found by one render thread, so they are seen without locking
+class sssClouds_t : public context_t::destructible
+{
+	public:
+		virtual ~sssClouds_t() {};
+		std::map<const object3d_t *,const sssTree_t *> clouds;
+};
 
 class sssNode_t : public shaderNode_t
 {
 	public:
 		sssNode_t(const color_t &c,PFLOAT r,int s);
+		/** Point cloud mode: the irradiance is computed once at points spread
+		 * over the object, with the given spacing, and gathered from an
+		 * octree instead of shooting probe rays at every shading point */
+		void setCloud(PFLOAT sp) {cloud=true;spacing=sp;};
 
 		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
 				const scene_t *scene)const;
 
-		virtual ~sssNode_t() {};
+		virtual ~sssNode_t();
 		static shader_t * factory(paramMap_t &,std::list<paramMap_t> &,
 				        renderEnvironment_t &);
 	protected:
@@ -29,10 +81,20 @@ class sssNode_t : public shaderNode_t
 												 const point3d_t &outpoint,
 												 CFLOAT &W,const scene_t *scene)const;
 		point3d_t getSamplingPoint(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye)const;
+		const sssTree_t *getCloud(renderState_t &state,const object3d_t *obj,
+				const scene_t *scene)const;
+		void buildCloud(renderState_t &state,const object3d_t *obj,const scene_t *scene,
+				std::vector<sssPoint_t> &points)const;
 
 		color_t color;
 		PFLOAT radius,halfradius,farradius,exponent,expinv;
 		int samples,sqrtsamples;
+		bool cloud;
+		PFLOAT spacing;
+		/// Shared by all the threads, built the first time an object is shaded
+		mutable std::map<const object3d_t *,sssTree_t *> clouds;
+		mutable yafthreads::mutex_t mutex;
+		sssClouds_t *_clouds;
 };
 
 
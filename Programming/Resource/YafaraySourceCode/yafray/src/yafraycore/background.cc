@@ -1,5 +1,137 @@
 #include "background.h"
+#include "texture.h"
+#include <algorithm>
 
 using namespace std;
 
+__BEGIN_YAFRAY
 
+envSampler_t::envSampler_t(const vector<float> &lum,int w,int h,mapping_t m):
+	mapping(m),transformed(false),width(w),height(h),func(lum),cdf((w+1)*h),rowcdf(h+1),total(0)
+{
+	rowcdf[0]=0;
+	for(int y=0;y<h;++y)
+	{
+		PFLOAT v=(y+0.5)/(PFLOAT)h;
+		float *f=&func[y*w],*c=&cdf[y*(w+1)];
+		double sum=0;
+		for(int x=0;x<w;++x)
+		{
+			f[x]*=jacobian((x+0.5)/(PFLOAT)w,v);
+			// also gets rid of NaNs
+			if(!(f[x]>0)) f[x]=0;
+			sum+=f[x];
+		}
+		double acc=0;
+		c[0]=0;
+		for(int x=0;x<w;++x)
+		{
+			acc+=f[x];
+			c[x+1]=(sum>0) ? acc/sum : (x+1)/(double)w;
+		}
+		c[w]=1;
+		rowcdf[y+1]=rowcdf[y]+sum;
+	}
+	total=rowcdf[h];
+	if(total>0)
+		for(int y=1;y<=h;++y) rowcdf[y]/=total;
+}
+
+void envSampler_t::setTransform(const matrix4x4_t &m)
+{
+	transformed=true;
+	mtx=imtx=m;
+	imtx.inverse();
+}
+
+PFLOAT envSampler_t::jacobian(PFLOAT u,PFLOAT v)const
+{
+	if(mapping==MAP_SPHERE) return 2.0*M_PI*M_PI*sin(M_PI*v);
+	// angular map, the angle to the axis grows with the distance to the center
+	PFLOAT a=1.0-2.0*u,b=2.0*v-1.0;
+	PFLOAT r=sqrt(a*a+b*b);
+	if(r>1) return 0;
+	if(r==0) return 4.0*M_PI*M_PI;
+	return 4.0*M_PI*sin(M_PI*r)/r;
+}
+
+PFLOAT envSampler_t::pdfUV(int x,int y,PFLOAT u,PFLOAT v)const
+{
+	PFLOAT j=jacobian(u,v);
+	if(j<=0) return 0;
+	return func[y*width+x]*width*height/(total*j);
+}
+
+vector3d_t envSampler_t::sample(PFLOAT s1,PFLOAT s2,PFLOAT &pdf)const
+{
+	pdf=0;
+	if(total<=0) return vector3d_t(0,0,1);
+	int y=upper_bound(rowcdf.begin(),rowcdf.end(),(double)s1)-rowcdf.begin()-1;
+	if(y<0) y=0;
+	if(y>=height) y=height-1;
+	double dy=rowcdf[y+1]-rowcdf[y];
+	PFLOAT v=(y+((dy>0) ? (s1-rowcdf[y])/dy : 0.5))/height;
+	const float *c=&cdf[y*(width+1)];
+	int x=upper_bound(c,c+width+1,(float)s2)-c-1;
+	if(x<0) x=0;
+	if(x>=width) x=width-1;
+	float dx=c[x+1]-c[x];
+	PFLOAT u=(x+((dx>0) ? (s2-c[x])/dx : 0.5))/width;
+	pdf=pdfUV(x,y,u,v);
+	vector3d_t dir;
+	if(mapping==MAP_SPHERE)
+	{
+		PFLOAT phi=M_PI*(1.0-2.0*u),theta=M_PI*v;
+		PFLOAT st=sin(theta);
+		dir.set(st*sin(phi),st*cos(phi),cos(theta));
+	}
+	else
+	{
+		PFLOAT a=1.0-2.0*u,b=2.0*v-1.0;
+		PFLOAT r=sqrt(a*a+b*b);
+		PFLOAT sr=(r>0) ? sin(M_PI*r)/r : M_PI;
+		dir.set(a*sr,cos(M_PI*r),b*sr);
+	}
+	return transformed ? imtx*dir : dir;
+}
+
+PFLOAT envSampler_t::pdf(const vector3d_t &dir)const
+{
+	if(total<=0) return 0;
+	vector3d_t d=transformed ? mtx*dir : dir;
+	PFLOAT u,v;
+	if(mapping==MAP_SPHERE)
+		spheremap(point3d_t(d.x,d.y,d.z),u,v);
+	else
+		angmap(point3d_t(d.x,d.y,d.z),u,v);
+	int x=(int)(u*width),y=(int)(v*height);
+	if(x>=width) x=width-1;
+	if(y>=height) y=height-1;
+	return pdfUV(x,y,u,v);
+}
+
+background_t::~background_t()
+{
+	if(envsam!=NULL) delete envsam;
+}
+
+// only lights being set up ask for it, so it is locked every time
+const envSampler_t *background_t::sampler()const
+{
+	samplerlock.wait();
+	if(!sampled)
+	{
+		envsam=buildSampler();
+		if((envsam!=NULL) && !envsam->valid())
+		{
+			delete envsam;
+			envsam=NULL;
+		}
+		sampled=true;
+	}
+	const envSampler_t *s=envsam;
+	samplerlock.signal();
+	return s;
+}
+
+__END_YAFRAY
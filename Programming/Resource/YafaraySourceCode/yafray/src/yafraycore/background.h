@@ -3,6 +3,9 @@
 
 #include "color.h"
 #include "vector3d.h"
+#include "matrix4.h"
+#include "ccthreads.h"
+#include <vector>
 
 #ifdef HAVE_CONFIG_H
 #include<config.h>
@@ -12,11 +15,63 @@ __BEGIN_YAFRAY
 
 struct renderState_t;
 
+/** Picks directions of an environment image in proportion to its brightness.
+ *
+ * The image is a piecewise constant 2D distribution in the u,v that
+ * spheremap() or angmap() give for a direction. A row is picked from the
+ * marginal table first, then a column from the conditional table of that
+ * row, both by inverting their cumulative sums. The pixel weights include
+ * the solid angle the pixel covers, so the pdf per solid angle follows the
+ * brightness alone.
+ */
+class YAFRAYCORE_EXPORT envSampler_t
+{
+	public:
+		enum mapping_t {MAP_SPHERE, MAP_ANGULAR};
+		/// lum holds w*h brightness values, row by row, v growing with rows
+		envSampler_t(const std::vector<float> &lum,int w,int h,mapping_t m);
+		/// False when there is nothing bright to sample
+		bool valid()const {return total>0;};
+		/// Rotation from world directions to the ones the image is mapped with
+		void setTransform(const matrix4x4_t &m);
+		/** Direction for s1,s2 in [0,1), with its pdf per solid angle. A pdf
+		 * of 0 means no direction, it fell off the edge of an angular map.
+		 */
+		vector3d_t sample(PFLOAT s1,PFLOAT s2,PFLOAT &pdf)const;
+		PFLOAT pdf(const vector3d_t &dir)const;
+	protected:
+		/// Solid angle per unit of u,v around u,v
+		PFLOAT jacobian(PFLOAT u,PFLOAT v)const;
+		PFLOAT pdfUV(int x,int y,PFLOAT u,PFLOAT v)const;
+
+		mapping_t mapping;
+		bool transformed;
+		matrix4x4_t mtx,imtx;
+		int width,height;
+		/// Pixel weights, normalized row cdfs (width+1 each) and row cdf
+		std::vector<float> func,cdf;
+		std::vector<double> rowcdf;
+		double total;
+};
+
 class YAFRAYCORE_EXPORT background_t
 {
 	public:
+		background_t():envsam(NULL),sampled(false) {};
 		virtual color_t operator() (const vector3d_t &dir, renderState_t &state, bool filtered=false) const=0;
-		virtual ~background_t() {};
+		/** Sampler over the background, for lights that take their color
+		 * from it. NULL if the background has none, it is built with
+		 * buildSampler() the first time it is asked for.
+		 */
+		const envSampler_t *sampler() const;
+		virtual ~background_t();
+	protected:
+		/// A new sampler over the background or NULL, called once at most
+		virtual envSampler_t *buildSampler() const {return NULL;};
+
+		mutable envSampler_t *envsam;
+		mutable bool sampled;
+		mutable yafthreads::mutex_t samplerlock;
 };
 
 __END_YAFRAY
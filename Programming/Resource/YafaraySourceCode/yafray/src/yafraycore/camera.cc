@@ -91,6 +91,36 @@ camera_t::~camera_t()
 }
 
 
+// Gives the pixel position where P is seen and its distance along the ray.
+// Returns false when P is behind the camera or the type can't be inverted.
+bool camera_t::project(const point3d_t &P, PFLOAT &px, PFLOAT &py, PFLOAT &dist) const
+{
+	vector3d_t a, b, c, d;
+	switch (camtype) {
+		case CM_ORTHO:
+			a = vright_O;  b = vup_O;  c = dir_O;  d = P - eye_O;
+			break;
+		case CM_PERSPECTIVE:
+			a = vright;  b = vup;  c = vto;  d = P - _eye;
+			break;
+		default:
+			return false;
+	}
+	// solve d = a*px + b*py + c*t, rays are a*px + b*py + c scaled
+	PFLOAT det = a*(b^c);
+	if (det==0) return false;
+	PFLOAT t = (a*(b^d))/det;
+	if (t<=0) return false;
+	px = (d*(b^c))/(det*t);
+	py = (a*(d^c))/(det*t);
+	if (camtype==CM_ORTHO) {
+		dist = t*c.length();
+		px *= t;  py *= t;
+	}
+	else dist = d.length();
+	return true;
+}
+
 void camera_t::biasDist(PFLOAT &r) const
 {
 	switch (bkhbias) {
@@ -208,4 +238,35 @@ vector3d_t camera_t::shootRay(PFLOAT px, PFLOAT py, PFLOAT &wt)
 
 	return ray;
 }
+
+void camera_t::rayCone(PFLOAT px, PFLOAT py, PFLOAT &width, PFLOAT &spread) const
+{
+	width = spread = 0;
+	switch (camtype) {
+		case CM_ORTHO: {
+			width = sqrt(vright_O.length()*vup_O.length());
+			break;
+		}
+		case CM_SPHERICAL: {
+			PFLOAT sp = sin(M_PI - M_PI * (py/(PFLOAT)(resy-1)));
+			if (sp<0.01) sp = 0.01;
+			spread = sqrt((2.0*M_PI*sp/(PFLOAT)(resx-1)) * (M_PI/(PFLOAT)(resy-1)));
+			break;
+		}
+		case CM_LIGHTPROBE: {
+			spread = 2.0*M_PI/sqrt((PFLOAT)(resx-1)*(PFLOAT)(resy-1));
+			break;
+		}
+		default:
+		case CM_PERSPECTIVE: {
+			// change of the normalized direction from one pixel to the next
+			vector3d_t d = vright*px + vup*py + vto;
+			PFLOAT l = d.normLen();
+			vector3d_t du = (vright - d*(d*vright))/l;
+			vector3d_t dv = (vup - d*(d*vup))/l;
+			spread = sqrt(du.length()*dv.length());
+		}
+	}
+}
+
 __END_YAFRAY
@@ -50,6 +50,11 @@ class YAFRAYCORE_EXPORT camera_t
 		int resY() const { return resy; }
 		const point3d_t & position() const { return _position; }
 		vector3d_t shootRay(PFLOAT px, PFLOAT py, PFLOAT &wt);
+		// width at the origin and spread angle of the cone one pixel sees around
+		// the ray shootRay gives for px, py, the lens is ignored
+		void rayCone(PFLOAT px, PFLOAT py, PFLOAT &width, PFLOAT &spread) const;
+		// inverse of shootRay without dof, only perspective and ortho
+		bool project(const point3d_t &P, PFLOAT &px, PFLOAT &py, PFLOAT &dist) const;
 		PFLOAT getFocal() const { return focal_distance; }
 	protected:
 		void biasDist(PFLOAT &r) const;
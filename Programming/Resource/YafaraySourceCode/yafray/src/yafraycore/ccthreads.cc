@@ -1,5 +1,6 @@
 #include"ccthreads.h"
 #include<iostream>
+#include<vector>
 
 using namespace std;
 
@@ -147,4 +148,62 @@ mysemaphore_t::~mysemaphore_t()
 
 #endif
 
+#if HAVE_PTHREAD
+// takes chunks from the shared counter until there are no more
+class forWorker_t : public thread_t
+{
+	public:
+		forWorker_t(parallelWork_t &w,mutex_t &m,int &nx,int n,int c,int t):
+			work(w),mutex(m),next(nx),total(n),chunk(c),thread(t) {};
+		virtual void body();
+	protected:
+		parallelWork_t &work;
+		mutex_t &mutex;
+		int &next;
+		int total,chunk,thread;
+};
+
+void forWorker_t::body()
+{
+	while(true)
+	{
+		mutex.wait();
+		int begin=next;
+		next+=chunk;
+		mutex.signal();
+		if(begin>=total) return;
+		int end=begin+chunk;
+		if(end>total) end=total;
+		work.work(begin,end,thread);
+	}
+}
+#endif
+
+void parallelFor(parallelWork_t &w,int n,int threads,int chunk)
+{
+	if(n<=0) return;
+#if HAVE_PTHREAD
+	if((threads>1) && (n>chunk))
+	{
+		mutex_t mutex;
+		int next=0;
+		vector<forWorker_t *> workers;
+		for(int i=1;i<threads;++i)
+		{
+			workers.push_back(new forWorker_t(w,mutex,next,n,chunk,i));
+			workers.back()->run();
+		}
+		forWorker_t self(w,mutex,next,n,chunk,0);
+		self.body();
+		for(unsigned int i=0;i<workers.size();++i)
+		{
+			workers[i]->wait();
+			delete workers[i];
+		}
+		return;
+	}
+#endif
+	w.work(0,n,0);
+}
+
 } // yafthreads
@@ -52,6 +52,24 @@ class YAFRAYCORE_EXPORT locked_t : public T
 #endif
 };
                                                                                                                 
+/** Piece of work that can be split over several threads.
+ *
+ * work() is called with consecutive ranges of indexes, each from the
+ * thread number given (0 is the calling one). Ranges never overlap.
+ */
+class YAFRAYCORE_EXPORT parallelWork_t
+{
+	public:
+		virtual ~parallelWork_t() {};
+		virtual void work(int begin,int end,int thread)=0;
+};
+
+/** Calls w.work() for all indexes in [0,n), chunk indexes at a time,
+ * using up to threads threads. Returns when everything is done. Without
+ * pthreads it is just a loop.
+ */
+YAFRAYCORE_EXPORT void parallelFor(parallelWork_t &w,int n,int threads,int chunk=64);
+
 #if HAVE_PTHREAD
 
 
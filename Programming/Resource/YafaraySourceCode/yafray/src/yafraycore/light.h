@@ -33,6 +33,7 @@ __END_YAFRAY
 #include"vector3d.h"
 #include"scene.h"
 #include"color.h"
+#include"mapfile.h"
 
 
 __BEGIN_YAFRAY
@@ -44,6 +45,25 @@ class YAFRAYCORE_EXPORT emitter_t
 		virtual void numSamples(int n) {};
 		virtual void getDirection(int num,point3d_t &p,vector3d_t &dir,color_t &c)const=0;
 		virtual bool storeDirect()const {return false;};
+		/** Adds to the key everything that changes the emitted photons.
+		 * Emitters that don't say return false, then nothing they take
+		 * part in can be cached.
+		 */
+		virtual bool hashEmission(keyHash_t &h)const {return false;};
+};
+
+/** Emission bounds of a light, used to pick lights by importance.
+ *
+ * The light sits inside the box min-max and emits around axis, fully
+ * up to thetaO away from it and fading to nothing thetaE further.
+ * A light emitting in all directions has thetaO=M_PI.
+ */
+struct lightBound_t
+{
+	point3d_t min,max;
+	vector3d_t axis;
+	PFLOAT thetaO,thetaE;
+	CFLOAT power;
 };
 
 /** Abstract interface for light rendering.
@@ -75,6 +95,22 @@ class YAFRAYCORE_EXPORT light_t
 		/// Returns the position if it's possible.
 		virtual point3d_t position() const=0;
 		virtual emitter_t * getEmitter(int maxsamples)const {return NULL;};
+		/** Fills the emission bounds of the light.
+		 *
+		 * Only lights whose whole contribution at a point comes from those
+		 * bounds should answer. The rest return false and are always
+		 * evaluated.
+		 */
+		virtual bool emissionBound(lightBound_t &b)const {return false;};
+		/** Shading of the light as if nothing was in the way.
+		 *
+		 * Used for adaptive shadow testing. Fills lit with the part that
+		 * depends on visibility and extra with the rest, and to with the
+		 * point a shadow ray has to reach. Lights that cannot be split
+		 * like this return false and are shaded with illuminate().
+		 */
+		virtual bool unshadowed(renderState_t &state,const scene_t &s,const surfacePoint_t &sp,
+				const vector3d_t &eye,color_t &lit,color_t &extra,point3d_t &to)const {return false;};
 
 		/** Light initialization.
 		 * 
@@ -0,0 +1,185 @@
+/****************************************************************************
+ *
+ * 			lighttree.cc: Light tree for sampling many lights
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "lighttree.h"
+#include <algorithm>
+
+using namespace std;
+
+__BEGIN_YAFRAY
+
+/// Smallest cone holding both cones, as in Conty and Kulla
+static void mergeCones(const lightBound_t &a,const lightBound_t &b,lightBound_t &r)
+{
+	r.thetaE=max(a.thetaE,b.thetaE);
+	const lightBound_t &w=(a.thetaO>=b.thetaO) ? a : b;
+	const lightBound_t &n=(a.thetaO>=b.thetaO) ? b : a;
+	PFLOAT c=w.axis*n.axis;
+	if(c>1) c=1; else if(c<-1) c=-1;
+	PFLOAT thetaD=acos(c);
+	r.axis=w.axis;
+	r.thetaO=w.thetaO;
+	if(min(thetaD+n.thetaO,(PFLOAT)M_PI)<=w.thetaO) return;
+	PFLOAT thetaO=(w.thetaO+thetaD+n.thetaO)*0.5;
+	if(thetaO>=M_PI) {r.thetaO=M_PI;return;}
+	// turn the wide axis towards the narrow one
+	vector3d_t side=n.axis-w.axis*c;
+	if(side.normLen()<1e-6) {r.thetaO=M_PI;return;}
+	PFLOAT turn=thetaO-w.thetaO;
+	r.axis=w.axis*cos(turn)+side*sin(turn);
+	r.axis.normalize();
+	r.thetaO=thetaO;
+}
+
+static void mergeBounds(const lightBound_t &a,const lightBound_t &b,lightBound_t &r)
+{
+	lightBound_t m;
+	m.min.set(min(a.min.x,b.min.x),min(a.min.y,b.min.y),min(a.min.z,b.min.z));
+	m.max.set(max(a.max.x,b.max.x),max(a.max.y,b.max.y),max(a.max.z,b.max.z));
+	m.power=a.power+b.power;
+	mergeCones(a,b,m);
+	r=m;
+}
+
+struct entryOrder_f
+{
+	entryOrder_f(int a):axis(a) {};
+	template<class T>
+	bool operator () (const T &a,const T &b)const
+	{
+		return (a.bound.min[axis]+a.bound.max[axis])<(b.bound.min[axis]+b.bound.max[axis]);
+	};
+	int axis;
+};
+
+lightTree_t::lightTree_t(const vector<light_t *> &lights):count(0)
+{
+	vector<entry_t> entries;
+	for(vector<light_t *>::const_iterator i=lights.begin();i!=lights.end();++i)
+	{
+		entry_t e;
+		if(!(*i)->emissionBound(e.bound)) continue;
+		e.light=*i;
+		entries.push_back(e);
+	}
+	count=entries.size();
+	if(count>0) build(entries,0,count);
+}
+
+int lightTree_t::build(vector<entry_t> &entries,int first,int count)
+{
+	int index=nodes.size();
+	nodes.push_back(node_t());
+	if(count==1)
+	{
+		nodes[index].bound=entries[first].bound;
+		nodes[index].light=entries[first].light;
+		nodes[index].child[0]=nodes[index].child[1]=-1;
+		return index;
+	}
+	// split at the median of the centers along the longest side
+	point3d_t a=entries[first].bound.min,g=entries[first].bound.max;
+	for(int i=first+1;i<first+count;++i)
+	{
+		const lightBound_t &b=entries[i].bound;
+		a.set(min(a.x,b.min.x),min(a.y,b.min.y),min(a.z,b.min.z));
+		g.set(max(g.x,b.max.x),max(g.y,b.max.y),max(g.z,b.max.z));
+	}
+	vector3d_t size=g-a;
+	int axis=(size.x>=size.y) ? ((size.x>=size.z) ? 0 : 2) : ((size.y>=size.z) ? 1 : 2);
+	int half=count/2;
+	nth_element(entries.begin()+first,entries.begin()+first+half,entries.begin()+first+count,
+			entryOrder_f(axis));
+	int l=build(entries,first,half);
+	int r=build(entries,first+half,count-half);
+	node_t &n=nodes[index];
+	mergeBounds(nodes[l].bound,nodes[r].bound,n.bound);
+	n.light=NULL;
+	n.child[0]=l;
+	n.child[1]=r;
+	return index;
+}
+
+CFLOAT lightTree_t::importance(const node_t &n,const point3d_t &P)const
+{
+	const lightBound_t &b=n.bound;
+	point3d_t center=(b.min+b.max)*0.5;
+	vector3d_t D=P-center;
+	vector3d_t diag=b.max-b.min;
+	PFLOAT r2=(diag*diag)*0.25;
+	PFLOAT d2=D*D;
+	if(d2<=r2) return b.power/max(r2,(PFLOAT)1e-8); // inside the box, any direction
+	PFLOAT d=sqrt(d2);
+	PFLOAT c=(b.axis*D)/d;
+	if(c>1) c=1; else if(c<-1) c=-1;
+	PFLOAT thetaU=asin(sqrt(r2/d2));
+	PFLOAT theta=acos(c)-b.thetaO-thetaU;
+	if(theta<0) theta=0;
+	if(theta>b.thetaE) return 0;
+	return b.power*cos(theta)/max(d2,(PFLOAT)1e-8);
+}
+
+const light_t *lightTree_t::pick(const point3d_t &P,PFLOAT u,PFLOAT &pdf)const
+{
+	pdf=1;
+	int current=0;
+	while(nodes[current].light==NULL)
+	{
+		const node_t &n=nodes[current];
+		CFLOAT il=importance(nodes[n.child[0]],P);
+		CFLOAT ir=importance(nodes[n.child[1]],P);
+		if((il+ir)<=0) return NULL;
+		PFLOAT pl=il/(il+ir);
+		// reuse the random number inside the chosen interval
+		if(u<pl)
+		{
+			u/=pl;
+			pdf*=pl;
+			current=n.child[0];
+		}
+		else
+		{
+			u=(u-pl)/(1.0-pl);
+			pdf*=1.0-pl;
+			current=n.child[1];
+		}
+		if(u>=1) u=0.999999;
+	}
+	return nodes[current].light;
+}
+
+color_t lightTree_t::illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t &sp,
+		const vector3d_t &eye,int samples)const
+{
+	color_t total(0.0);
+	if(nodes.empty()) return total;
+	for(int i=0;i<samples;++i)
+	{
+		PFLOAT u=(i+ourRandom())/(PFLOAT)samples;
+		PFLOAT pdf;
+		const light_t *light=pick(sp.P(),u,pdf);
+		if((light==NULL) || (pdf<=0)) continue;
+		total+=light->illuminate(state,s,sp,eye)*(CFLOAT)(1.0/(pdf*samples));
+	}
+	return total;
+}
+
+__END_YAFRAY
@@ -0,0 +1,73 @@
+/****************************************************************************
+ *
+ * 			lighttree.h: Light tree for sampling many lights
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#ifndef __LIGHTTREE_H
+#define __LIGHTTREE_H
+
+#ifdef HAVE_CONFIG_H
+#include<config.h>
+#endif
+
+#include <vector>
+#include "light.h"
+
+__BEGIN_YAFRAY
+
+/** Bounding hierarchy over the lights of a scene.
+ *
+ * Every node keeps the box, the emission cone and the power of the
+ * lights below it. A shading point walks down the tree choosing each
+ * child with probability proportional to its estimated contribution,
+ * and the light found is weighted by the inverse of that probability.
+ * See Conty and Kulla, "Importance sampling of many lights with adaptive
+ * tree splitting" (2018).
+ */
+class YAFRAYCORE_EXPORT lightTree_t
+{
+	public:
+		lightTree_t(const std::vector<light_t *> &lights);
+		/// Averages the given number of lights picked for the point
+		color_t illuminate(renderState_t &state,const scene_t &s,const surfacePoint_t &sp,
+				const vector3d_t &eye,int samples)const;
+		int size()const {return count;};
+	protected:
+		struct node_t
+		{
+			lightBound_t bound;
+			/// Leaf light, or NULL for inner nodes
+			const light_t *light;
+			int child[2];
+		};
+		struct entry_t
+		{
+			lightBound_t bound;
+			const light_t *light;
+		};
+		int build(std::vector<entry_t> &entries,int first,int count);
+		CFLOAT importance(const node_t &n,const point3d_t &P)const;
+		const light_t *pick(const point3d_t &P,PFLOAT u,PFLOAT &pdf)const;
+
+		std::vector<node_t> nodes;
+		int count;
+};
+
+__END_YAFRAY
+
+#endif
@@ -0,0 +1,184 @@
+/****************************************************************************
+ *
+ * 			mapfile.cc: Binary cache files for precomputed render data
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "mapfile.h"
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+__BEGIN_YAFRAY
+
+#define CACHE_VERSION 1
+#define CACHE_ENDIAN 0x01020304
+
+struct cacheHeader_t
+{
+	char tag[8];
+	unsigned int version;
+	unsigned int endian;
+	unsigned long long key;
+};
+
+struct arrayHeader_t
+{
+	unsigned int size;
+	unsigned int count;
+};
+
+static size_t pad8(size_t len) {return (len+7)&~((size_t)7);}
+
+mappedFile_t::mappedFile_t(const string &name):data(NULL),len(0),mapped(false)
+{
+#ifndef WIN32
+	int fd=open(name.c_str(),O_RDONLY);
+	if(fd<0) return;
+	struct stat st;
+	if((fstat(fd,&st)==0) && (st.st_size>0))
+	{
+		void *m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(m!=MAP_FAILED)
+		{
+			data=(char *)m;
+			len=st.st_size;
+			mapped=true;
+		}
+	}
+	close(fd);
+	if(mapped) return;
+#endif
+	FILE *fp=fopen(name.c_str(),"rb");
+	if(fp==NULL) return;
+	fseek(fp,0,SEEK_END);
+	long l=ftell(fp);
+	fseek(fp,0,SEEK_SET);
+	if(l>0)
+	{
+		// new[] memory is aligned enough for the records we keep
+		data=new char[l];
+		if(fread(data,1,l,fp)!=(size_t)l)
+		{
+			delete [] data;
+			data=NULL;
+		}
+		else len=l;
+	}
+	fclose(fp);
+}
+
+mappedFile_t::~mappedFile_t()
+{
+	if(data==NULL) return;
+#ifndef WIN32
+	if(mapped)
+	{
+		munmap(data,len);
+		return;
+	}
+#endif
+	delete [] data;
+}
+
+cacheWriter_t::cacheWriter_t(const string &n,const char *tag,unsigned long long key):name(n)
+{
+	file=fopen((name+".tmp").c_str(),"wb");
+	good=(file!=NULL);
+	if(!good)
+	{
+		cerr<<"Can't write cache file "<<name<<endl;
+		return;
+	}
+	cacheHeader_t head;
+	memset(&head,0,sizeof(cacheHeader_t));
+	// the tag fills its 8 chars, there is no terminating 0
+	memcpy(head.tag,tag,8);
+	head.version=CACHE_VERSION;
+	head.endian=CACHE_ENDIAN;
+	head.key=key;
+	good=(fwrite(&head,sizeof(cacheHeader_t),1,file)==1);
+}
+
+cacheWriter_t::~cacheWriter_t()
+{
+	if(file==NULL) return;
+	string tmp=name+".tmp";
+	if((fclose(file)==0) && good)
+	{
+#ifdef WIN32
+		// rename doesn't replace files there
+		remove(name.c_str());
+#endif
+		if(rename(tmp.c_str(),name.c_str())==0) return;
+		cerr<<"Can't write cache file "<<name<<endl;
+	}
+	remove(tmp.c_str());
+}
+
+void cacheWriter_t::write(const void *d,size_t size,unsigned int count)
+{
+	if(!good) return;
+	arrayHeader_t ah;
+	ah.size=size;
+	ah.count=count;
+	size_t len=size*count;
+	size_t padding=pad8(len)-len;
+	const char zeros[8]={0,0,0,0,0,0,0,0};
+	good=(fwrite(&ah,sizeof(arrayHeader_t),1,file)==1);
+	if(good && len) good=(fwrite(d,1,len,file)==len);
+	if(good && padding) good=(fwrite(zeros,1,padding,file)==padding);
+}
+
+cacheReader_t::cacheReader_t(const string &name,const char *tag,unsigned long long key):
+	file(name),offset(sizeof(cacheHeader_t)),good(false)
+{
+	if(!file.isOpen() || (file.size()<sizeof(cacheHeader_t))) return;
+	const cacheHeader_t *head=(const cacheHeader_t *)file.begin();
+	good=(strncmp(head->tag,tag,8)==0) && (head->version==CACHE_VERSION) &&
+		(head->endian==CACHE_ENDIAN) && (head->key==key);
+}
+
+const void * cacheReader_t::read(size_t size,unsigned int &count)
+{
+	count=0;
+	if(!good) return NULL;
+	good=false;
+	if(offset+sizeof(arrayHeader_t)>file.size()) return NULL;
+	const arrayHeader_t *ah=(const arrayHeader_t *)(file.begin()+offset);
+	if(ah->size!=size) return NULL;
+	size_t len=size*(size_t)ah->count;
+	offset+=sizeof(arrayHeader_t);
+	if(offset+len>file.size()) return NULL;
+	const void *d=file.begin()+offset;
+	offset+=pad8(len);
+	count=ah->count;
+	good=true;
+	return d;
+}
+
+__END_YAFRAY
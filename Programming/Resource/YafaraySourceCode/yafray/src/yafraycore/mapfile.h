@@ -0,0 +1,155 @@
+/****************************************************************************
+ *
+ * 			mapfile.h: Binary cache files for precomputed render data
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#ifndef __MAPFILE_H
+#define __MAPFILE_H
+
+#ifdef HAVE_CONFIG_H
+#include<config.h>
+#endif
+
+#include "vector3d.h"
+#include "color.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+
+__BEGIN_YAFRAY
+
+/** 64 bit FNV-1a hash.
+ *
+ * Used to build the key that ties a cache file to the scene data it was
+ * computed from. Floats are hashed bitwise, so any change in the input
+ * (even the tiniest one) gives a different key.
+ */
+class keyHash_t
+{
+	public:
+		keyHash_t() {h=0xcbf29ce484222325ULL;};
+		void add(const void *data,size_t len)
+		{
+			const unsigned char *c=(const unsigned char *)data;
+			for(size_t i=0;i<len;++i)
+			{
+				h^=c[i];
+				h*=0x100000001b3ULL;
+			}
+		}
+		void add(bool b) {unsigned char c=b;add(&c,1);};
+		void add(int i) {add(&i,sizeof(int));};
+		void add(unsigned int i) {add(&i,sizeof(unsigned int));};
+		void add(float f) {add(&f,sizeof(float));};
+		void add(double f) {add(&f,sizeof(double));};
+		void add(const point3d_t &p) {add(p.x);add(p.y);add(p.z);};
+		void add(const vector3d_t &v) {add(v.x);add(v.y);add(v.z);};
+		void add(const color_t &c) {add(c.getR());add(c.getG());add(c.getB());};
+		void add(const std::string &s) {add(s.c_str(),s.size());};
+		unsigned long long value()const {return h;};
+	protected:
+		unsigned long long h;
+};
+
+/** Read only view of a whole file.
+ *
+ * The file is mapped in memory where the system allows it, so big caches
+ * are paged in on demand. Otherwise it is read in a buffer.
+ */
+class YAFRAYCORE_EXPORT mappedFile_t
+{
+	public:
+		mappedFile_t(const std::string &name);
+		~mappedFile_t();
+		bool isOpen()const {return data!=NULL;};
+		size_t size()const {return len;};
+		const char *begin()const {return data;};
+	protected:
+		mappedFile_t(const mappedFile_t &m) {}; //forbiden
+		char *data;
+		size_t len;
+		bool mapped;
+};
+
+/** Writes a cache file.
+ *
+ * A cache file starts with a header holding an 8 char tag, the format
+ * version and the scene key. Then come arrays of plain records, each one
+ * stored as record size, record count and the raw records padded to 8
+ * bytes, so they can be used in place from the mapped file.
+ *
+ * The data goes to name.tmp, which only takes the real name once it is
+ * all written, so an interrupted render never leaves a truncated cache.
+ */
+class YAFRAYCORE_EXPORT cacheWriter_t
+{
+	public:
+		cacheWriter_t(const std::string &name,const char *tag,unsigned long long key);
+		~cacheWriter_t();
+		bool ok()const {return good;};
+		void write(const void *d,size_t size,unsigned int count);
+		template<class T>
+		void writeArray(const std::vector<T> &v)
+		{write(v.empty() ? NULL : &v[0],sizeof(T),v.size());};
+		template<class T>
+		void writeArray(const T *a,unsigned int count) {write(a,sizeof(T),count);};
+	protected:
+		cacheWriter_t(const cacheWriter_t &w) {}; //forbiden
+		FILE *file;
+		std::string name;
+		bool good;
+};
+
+/** Reads back a cache file written by cacheWriter_t.
+ *
+ * ok() is false when the file is missing, has a different tag, version
+ * or key, or was written on a machine with a different byte order. In
+ * all those cases the data must be computed again.
+ */
+class YAFRAYCORE_EXPORT cacheReader_t
+{
+	public:
+		cacheReader_t(const std::string &name,const char *tag,unsigned long long key);
+		bool ok()const {return good;};
+		/// Returns a pointer to the records inside the mapped file
+		const void *read(size_t size,unsigned int &count);
+		template<class T>
+		bool readArray(const T *&a,unsigned int &count)
+		{
+			a=(const T *)read(sizeof(T),count);
+			return good;
+		};
+		template<class T>
+		bool readArray(std::vector<T> &v)
+		{
+			unsigned int count;
+			const T *a=(const T *)read(sizeof(T),count);
+			if(good) v.assign(a,a+count);
+			return good;
+		};
+		/// Position in the file of data returned by read()
+		size_t offsetOf(const void *d)const {return (const char *)d-file.begin();};
+	protected:
+		mappedFile_t file;
+		size_t offset;
+		bool good;
+};
+
+__END_YAFRAY
+
+#endif
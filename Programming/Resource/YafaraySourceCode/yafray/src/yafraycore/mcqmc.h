@@ -5,6 +5,9 @@
 #ifndef __MCQMC_H
 #define __MCQMC_H
 
+#include <vector>
+#include "vector3d.h"
+
 __BEGIN_YAFRAY
 // fast incremental Halton sequence generator
 // calculation of value must be double prec.
@@ -80,6 +83,85 @@ inline PFLOAT RI_LP(unsigned int i, unsigned int r=0)
 	return double(r)/4294967296.0;
 }
 
+/** Point i of n jittered over the unit square, on a grid as square as n
+ * allows. The few points that don't fit the grid are not stratified.
+ */
+inline void jitteredSample(int i, int n, PFLOAT &z1, PFLOAT &z2)
+{
+	int rows = int(sqrt((float)n)), cols = n/rows;
+	if (i<rows*cols) {
+		z1 = (PFLOAT(i / cols) + ourRandom()) / PFLOAT(rows);
+		z2 = (PFLOAT(i % cols) + ourRandom()) / PFLOAT(cols);
+	}
+	else { z1 = ourRandom();  z2 = ourRandom(); }
+}
+
+/** Precomputed sets of stratified points in the unit square.
+ *
+ * Each set is the (0,2) sequence of van der Corput and Sobol with its
+ * own random scramble. Any first power of two points of a set are
+ * already stratified, so a light can stop after a few of them and still
+ * have covered its whole area. Every call takes a random set, so pixels
+ * next to each other do not repeat the same pattern.
+ */
+class sampleTable_t
+{
+	public:
+		sampleTable_t():n(0),sets(0) {};
+		void init(int samples,int nsets=64)
+		{
+			n=samples;
+			sets=nsets;
+			table.resize(2*n*sets);
+			for(int s=0;s<sets;++s)
+			{
+				unsigned int r1=((unsigned int)ourRandomI()<<1)^ourRandomI();
+				unsigned int r2=((unsigned int)ourRandomI()<<1)^ourRandomI();
+				PFLOAT *t=&table[2*n*s];
+				for(int i=0;i<n;++i)
+				{
+					t[2*i]=RI_vdC(i,r1);
+					t[2*i+1]=RI_S(i,r2);
+				}
+			}
+		};
+		int size()const {return n;};
+		/** Samples to test before a point is taken as fully lit or shadowed
+		 * when the light is not told: a quarter of them, rounded down to a
+		 * power of two so that they are a stratified subset of the set.
+		 * Lights with less than 16 samples always take them all.
+		 */
+		static int prediction(int total)
+		{
+			if(total<16) return 0;
+			int n=4;
+			while(8*n<=total) n*=2;
+			return n;
+		};
+		/** Sample count to check at next once the tested ones found a penumbra.
+		 *
+		 * The count follows the variance of the visibility, p(1-p): the
+		 * point gets all total samples while between about 15% and 85% of
+		 * them are lit, and fewer closer to the edges of the penumbra. It
+		 * at most doubles so p is estimated again on the way, and it is
+		 * tested itself when those are already enough.
+		 */
+		static int adaptive(int lit,int tested,int total)
+		{
+			PFLOAT p=(PFLOAT)lit/(PFLOAT)tested;
+			int need=(int)ceil(total*8.0*p*(1.0-p));
+			if(need<=tested) return tested;
+			if(need>2*tested) need=2*tested;
+			return (need<total) ? need : total;
+		};
+		/// Returns the points of a set as consecutive u,v pairs
+		const PFLOAT *getSet()const {return &table[2*n*(ourRandomI()%sets)];};
+		/// The same set every time, for estimates that must not be noisy
+		const PFLOAT *firstSet()const {return &table[0];};
+	protected:
+		int n,sets;
+		std::vector<PFLOAT> table;
+};
 
 inline int nextPrime(int lastPrime)
 {
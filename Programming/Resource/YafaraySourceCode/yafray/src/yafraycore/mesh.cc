@@ -419,6 +419,21 @@ meshObject_t::~meshObject_t()
 	if(n_tree) delete n_tree;
 }
 
+void meshObject_t::hashGeometry(keyHash_t &h) const
+{
+	object3d_t::hashGeometry(h);
+	h.add((unsigned int)vertices.size());
+	h.add((unsigned int)triangles.size());
+	if(!vertices.empty()) h.add(&vertices[0],vertices.size()*sizeof(point3d_t));
+	const point3d_t *base=vertices.empty() ? NULL : &vertices[0];
+	for(vector<triangle_t>::const_iterator i=triangles.begin();i!=triangles.end();++i)
+	{
+		h.add((int)(i->a-base));
+		h.add((int)(i->b-base));
+		h.add((int)(i->c-base));
+	}
+}
+
 void meshObject_t::transform(const matrix4x4_t &m)
 {
 	matrix4x4_t mnotras=m;
@@ -575,6 +590,20 @@ bool meshObject_t::shoot(renderState_t &state,surfacePoint_t &where,
 	where=temp;
 	return true;
 }
+
+// the element is the triangle, no need to go through the tree again
+bool meshObject_t::surface(renderState_t &state,surfacePoint_t &where,const void *element,
+		const point3d_t &from,const vector3d_t &ray,PFLOAT Z)const
+{
+	const triangle_t *hitt=(const triangle_t *)element;
+	if(hitt==NULL) return shoot(state,where,from,ray);
+	point3d_t h=from+Z*ray;
+	where=hitt->getSurface(h,Z,hasorco);
+	where.setObject((object3d_t *)this);
+	where.setOrigin(hitt);
+	if(where.getShader()==NULL) where.setShader(shader);
+	return true;
+}
 /*
 static bool crossLineZ(const point3d_t &a,const point3d_t &b,const point3d_t &c,
 		PFLOAT cut,point3d_t &ra,point3d_t &rb)
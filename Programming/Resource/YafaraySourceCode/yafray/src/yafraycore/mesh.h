@@ -63,7 +63,10 @@ class YAFRAYCORE_EXPORT meshObject_t : public object3d_t
 		virtual point3d_t toObjectOrco(const point3d_t &p) const;
 		virtual bool shoot(renderState_t &state,surfacePoint_t &where,const point3d_t &from,
 				const vector3d_t &ray,bool shadow=false,PFLOAT dis=-1) const;
+		virtual bool surface(renderState_t &state,surfacePoint_t &where,const void *element,
+				const point3d_t &from,const vector3d_t &ray,PFLOAT Z)const;
 		virtual bound_t getBound() const {return bound;};
+		virtual void hashGeometry(keyHash_t &h) const;
 
 		static meshObject_t *factory(const std::vector<point3d_t> &ver, const std::vector<vector3d_t> &nor,
 				        const std::vector<triangle_t> &ts, const std::vector<GFLOAT> &fuv, const std::vector<CFLOAT> &fvcol);
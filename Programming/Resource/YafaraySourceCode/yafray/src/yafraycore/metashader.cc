@@ -1,5 +1,8 @@
 
 #include "metashader.h"
+#include <iostream>
+
+using namespace std;
 
 __BEGIN_YAFRAY
 
@@ -36,6 +39,118 @@ shaderNode_t::~shaderNode_t()
 {
 }
 
+nodeSlot_t & sharedNode_t::getSlot(renderState_t &state,const surfacePoint_t &sp,
+		const vector3d_t &eye)const
+{
+	bool present;
+	nodeSlots_t *data=state.context.getDestructible(graph._slots,present);
+	if(!present)
+	{
+		data=new nodeSlots_t;
+		data->slots.resize(graph.slots());
+		state.context.storeDestructible(graph._slots,data);
+	}
+	nodeSlot_t &s=data->slots[slot];
+	nodeKey_t key;
+	key.set(sp,eye);
+	if(!(key==s.key))
+	{
+		s.key=key;
+		s.hasColor=s.hasFloat=false;
+	}
+	return s;
+}
+
+colorA_t sharedNode_t::stdoutColor(renderState_t &state,const surfacePoint_t &sp,
+		const vector3d_t &eye,const scene_t *scene)const
+{
+	if(scene!=NULL) return node->stdoutColor(state,sp,eye,scene);
+	nodeSlot_t &s=getSlot(state,sp,eye);
+	if(!s.hasColor)
+	{
+		s.color=node->stdoutColor(state,sp,eye,scene);
+		s.hasColor=true;
+	}
+	return s.color;
+}
+
+CFLOAT sharedNode_t::stdoutFloat(renderState_t &state,const surfacePoint_t &sp,
+		const vector3d_t &eye,const scene_t *scene)const
+{
+	if(scene!=NULL) return node->stdoutFloat(state,sp,eye,scene);
+	nodeSlot_t &s=getSlot(state,sp,eye);
+	if(!s.hasFloat)
+	{
+		s.value=node->stdoutFloat(state,sp,eye,scene);
+		s.hasFloat=true;
+	}
+	return s.value;
+}
+
+shaderGraph_t::~shaderGraph_t()
+{
+	for(int i=(int)rewired.size()-1;i>=0;--i)
+		*(rewired[i].first)=rewired[i].second;
+	for(vector<sharedNode_t *>::iterator i=shared.begin();i!=shared.end();++i)
+		delete *i;
+}
+
+// depth first walk, marks are 1 while the node is on the stack and 2 when done
+bool shaderGraph_t::visit(shader_t *s,map<shader_t *,int> &mark,map<const shader_t *,int> &uses)
+{
+	int &m=mark[s];
+	if(m==2) return true;
+	if(m==1) return false;
+	m=1;
+	vector<const shader_t **> in;
+	s->getInputs(in);
+	for(vector<const shader_t **>::iterator i=in.begin();i!=in.end();++i)
+	{
+		if(*(*i)==NULL) continue;
+		if(!visit(const_cast<shader_t *>(*(*i)),mark,uses))
+		{
+			cout<<"Shader graph: cycle through an input, it is left unshared\n";
+			continue;
+		}
+		uses[*(*i)]++;
+	}
+	mark[s]=2;
+	order.push_back(s);
+	return true;
+}
+
+void shaderGraph_t::compile(const map<string,shader_t *> &shaders)
+{
+	map<shader_t *,int> mark;
+	map<const shader_t *,int> uses;
+	for(map<string,shader_t *>::const_iterator i=shaders.begin();i!=shaders.end();++i)
+		visit(i->second,mark,uses);
+
+	// slots follow the evaluation order, then every parent is pointed at them
+	map<const shader_t *,sharedNode_t *> proxy;
+	for(vector<shader_t *>::iterator i=order.begin();i!=order.end();++i)
+	{
+		if(uses[*i]<2) continue;
+		sharedNode_t *n=new sharedNode_t(*i,(int)shared.size(),*this);
+		shared.push_back(n);
+		proxy[*i]=n;
+	}
+	if(shared.empty()) return;
+	for(vector<shader_t *>::iterator i=order.begin();i!=order.end();++i)
+	{
+		vector<const shader_t **> in;
+		(*i)->getInputs(in);
+		for(vector<const shader_t **>::iterator j=in.begin();j!=in.end();++j)
+		{
+			map<const shader_t *,sharedNode_t *>::iterator p=proxy.find(*(*j));
+			if(p==proxy.end()) continue;
+			rewired.push_back(make_pair(*j,*(*j)));
+			*(*j)=p->second;
+		}
+	}
+	cout<<"Shader graph: "<<order.size()<<" nodes, "<<shared.size()<<" shared\n";
+}
+
 
 __END_YAFRAY
 
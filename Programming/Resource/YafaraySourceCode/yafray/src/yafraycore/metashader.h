@@ -3,6 +3,9 @@
 
 #include "shader.h"
 #include "texture.h"
+#include <map>
+#include <string>
+#include <vector>
 
 #ifdef HAVE_CONFIG_H
 #include<config.h>
@@ -26,5 +29,129 @@ class YAFRAYCORE_EXPORT shaderNode_t : public shader_t
 		virtual ~shaderNode_t();
 };
 
+/// The shading point a shared node result was computed for
+struct nodeKey_t
+{
+	void set(const surfacePoint_t &sp,const vector3d_t &eye)
+	{
+		obj=sp.getObject();
+		P=sp.P();  N=sp.N();  E=eye;
+		u=sp.u();  v=sp.v();  orco=sp.hasOrco();
+		fprint=sp.footprint();
+	}
+	bool operator == (const nodeKey_t &k)const
+	{
+		return (obj==k.obj) && (P==k.P) && (N==k.N) && (E==k.E) &&
+			(u==k.u) && (v==k.v) && (orco==k.orco) && (fprint==k.fprint);
+	}
+	const object3d_t *obj;
+	point3d_t P;
+	vector3d_t N,E;
+	GFLOAT u,v;
+	bool orco;
+	PFLOAT fprint;
+};
+
+/// Result of one shared node for the last point it was asked for
+struct nodeSlot_t
+{
+	nodeSlot_t():hasColor(false),hasFloat(false) {};
+	nodeKey_t key;
+	colorA_t color;
+	CFLOAT value;
+	bool hasColor,hasFloat;
+};
+
+/// Per thread slot storage of a compiled graph
+struct nodeSlots_t : public context_t::destructible
+{
+	virtual ~nodeSlots_t() {};
+	std::vector<nodeSlot_t> slots;
+};
+
+class shaderGraph_t;
+
+/** Stands for a node read by more than one parent.
+ *
+ * The color and float outputs are kept in a slot for the last shading
+ * point, so the other parents get them without evaluating the node again.
+ * Calls that trace rays (a scene is given) are not cached, neither the
+ * external float input used by the ramps.
+ */
+class YAFRAYCORE_EXPORT sharedNode_t : public shader_t
+{
+	public:
+		sharedNode_t(const shader_t *n,int s,const shaderGraph_t &g):node(n),slot(s),graph(g) {};
+		virtual ~sharedNode_t() {};
+		virtual color_t fromRadiosity(renderState_t &state,const surfacePoint_t &sp,
+					const energy_t &ene,const vector3d_t &eye)const
+		{return node->fromRadiosity(state,sp,ene,eye);};
+		virtual color_t fromLight(renderState_t &state,const surfacePoint_t &sp,
+					const energy_t &ene,const vector3d_t &eye)const
+		{return node->fromLight(state,sp,ene,eye);};
+		virtual color_t fromWorld(renderState_t &state,const surfacePoint_t &sp,
+					const scene_t &scene,const vector3d_t &eye)const
+		{return node->fromWorld(state,sp,scene,eye);};
+		virtual const color_t getDiffuse(renderState_t &state,
+					const surfacePoint_t &sp,const vector3d_t &eye)const
+		{return node->getDiffuse(state,sp,eye);};
+		virtual void displace(renderState_t &state,surfacePoint_t &sp,
+					const vector3d_t &eye,PFLOAT res)const
+		{node->displace(state,sp,eye,res);};
+		virtual colorA_t stdoutColor(renderState_t &state,const surfacePoint_t &sp,
+				const vector3d_t &eye,const scene_t *scene=NULL)const;
+		virtual CFLOAT stdoutFloat(renderState_t &state,const surfacePoint_t &sp,
+				const vector3d_t &eye,const scene_t *scene=NULL)const;
+		virtual vector3d_t stdoutVector(renderState_t &state,const surfacePoint_t &sp,
+				const vector3d_t &eye,const scene_t *scene=NULL)const
+		{return node->stdoutVector(state,sp,eye,scene);};
+		virtual colorA_t stdoutColor(CFLOAT x,renderState_t &state,
+				const surfacePoint_t &sp,const vector3d_t &eye,const scene_t *scene=NULL)const
+		{return node->stdoutColor(x,state,sp,eye,scene);};
+		virtual bool getCaustics(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
+				color_t &ref,color_t &trans,PFLOAT &ior)const
+		{return node->getCaustics(state,sp,eye,ref,trans,ior);};
+		virtual bool discrete()const {return node->discrete();};
+		virtual bool isRGB()const {return node->isRGB();};
+		virtual void getDispersion(PFLOAT &disp_pw,PFLOAT &A,PFLOAT &B,color_t &beer)const
+		{node->getDispersion(disp_pw,A,B,beer);};
+	protected:
+		nodeSlot_t &getSlot(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye)const;
+
+		const shader_t *node;
+		int slot;
+		const shaderGraph_t &graph;
+};
+
+/** Compiled form of the shader node graphs of a render.
+ *
+ * compile() walks the graphs from every shader and lists the nodes so
+ * each one comes after its inputs. Every node read by more than one
+ * parent gets a result slot, and the parents are rewired to read it
+ * through a sharedNode_t, so a shared sub-expression is evaluated once
+ * per shading point instead of once per path that reaches it.
+ * The original wiring is restored when the graph is destroyed.
+ */
+class YAFRAYCORE_EXPORT shaderGraph_t
+{
+	friend class sharedNode_t;
+	public:
+		shaderGraph_t():_slots(NULL) {};
+		~shaderGraph_t();
+		void compile(const std::map<std::string,shader_t *> &shaders);
+		/// Nodes in evaluation order, inputs first
+		const std::vector<shader_t *> &program()const {return order;};
+		int slots()const {return (int)shared.size();};
+	protected:
+		bool visit(shader_t *s,std::map<shader_t *,int> &mark,std::map<const shader_t *,int> &uses);
+
+		std::vector<shader_t *> order;
+		std::vector<sharedNode_t *> shared;
+		/// Rewired inputs and the node they read before
+		std::vector<std::pair<const shader_t **,const shader_t *> > rewired;
+		/// Only its address is used, as the key of the per thread slots
+		nodeSlots_t *_slots;
+};
+
 __END_YAFRAY
 #endif
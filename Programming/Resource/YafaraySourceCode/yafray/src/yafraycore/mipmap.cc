@@ -0,0 +1,426 @@
+/****************************************************************************
+ *
+ * 			mipmap.cc: Tiled image pyramids, their registry and the tile cache
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "mipmap.h"
+#include "mapfile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cmath>
+#include <iostream>
+using namespace std;
+
+__BEGIN_YAFRAY
+
+#define TILE_TAG "YAFTILES"
+
+// 64MB unless the render asks for something else
+static tileCache_t globalCache(64<<20);
+
+tileCache_t & tileCache_t::global() {return globalCache;}
+
+tileCache_t::tileCache_t(size_t bytes):used(0),maxBytes(bytes)
+{
+	lru.prev=lru.next=&lru;
+}
+
+tileCache_t::~tileCache_t()
+{
+	while(lru.next!=&lru) drop(lru.next);
+}
+
+void tileCache_t::setMaxSize(size_t bytes)
+{
+	mutex.wait();
+	maxBytes=bytes;
+	trim();
+	mutex.signal();
+}
+
+void tileCache_t::drop(entry_t *e)
+{
+	unlink(e);
+	table.erase(make_pair(e->owner,e->tile));
+	used-=e->size;
+	delete [] e->data;
+	delete e;
+}
+
+// pinned tiles stay, even if they alone are over the budget
+void tileCache_t::trim()
+{
+	entry_t *e=lru.prev;
+	while((used>maxBytes) && (e!=&lru))
+	{
+		entry_t *prev=e->prev;
+		if(e->pins==0) drop(e);
+		e=prev;
+	}
+}
+
+tileCache_t::entry_t * tileCache_t::pin(const mipMap_t *m,int t)
+{
+	mutex.wait();
+	table_t::iterator i=table.find(make_pair(m,t));
+	if(i!=table.end())
+	{
+		entry_t *e=i->second;
+		e->pins++;
+		if(lru.next!=e)
+		{
+			unlink(e);
+			pushFront(e);
+		}
+		bool loading=e->loading;
+		mutex.signal();
+		if(loading)
+		{
+			// the reader holds it until the data is there
+			e->loadlock.wait();
+			e->loadlock.signal();
+		}
+		return e;
+	}
+	entry_t *e=new entry_t;
+	e->owner=m;
+	e->tile=t;
+	e->size=m->tileBytes();
+	e->pins=1;
+	e->loading=true;
+	e->loadlock.wait();
+	table[make_pair(m,t)]=e;
+	pushFront(e);
+	used+=e->size;
+	trim();
+	mutex.signal();
+
+	e->data=new unsigned char[e->size];
+	m->readTile(t,e->data);
+	mutex.wait();
+	e->loading=false;
+	mutex.signal();
+	e->loadlock.signal();
+	return e;
+}
+
+void tileCache_t::unpin(entry_t *e)
+{
+	mutex.wait();
+	e->pins--;
+	trim();
+	mutex.signal();
+}
+
+void tileCache_t::forget(const mipMap_t *m)
+{
+	mutex.wait();
+	table_t::iterator i=table.lower_bound(make_pair(m,0));
+	while((i!=table.end()) && (i->first.first==m))
+	{
+		entry_t *e=(i++)->second;
+		drop(e);
+	}
+	mutex.signal();
+}
+
+void mipMap_t::setLevels(int rx,int ry,bool mipmap,bool h)
+{
+	hdr=h;
+	psize=hdr ? 4*sizeof(float) : 4;
+	tsize=psize*MIP_TILE_SIZE*MIP_TILE_SIZE;
+	ntiles=0;
+	for(;;)
+	{
+		mipLevel_t lv;
+		lv.resx=rx;
+		lv.resy=ry;
+		lv.tilesx=(rx+MIP_TILE_MASK)>>MIP_TILE_BITS;
+		lv.tilesy=(ry+MIP_TILE_MASK)>>MIP_TILE_BITS;
+		lv.first=ntiles;
+		ntiles+=lv.tilesx*lv.tilesy;
+		level.push_back(lv);
+		if(!mipmap || ((rx==1) && (ry==1))) break;
+		rx=(rx+1)>>1;
+		ry=(ry+1)>>1;
+	}
+}
+
+mipMap_t::mipMap_t(cBuffer_t &image,bool mipmap):file(NULL)
+{
+	setLevels(image.resx(),image.resy(),mipmap,false);
+	tiles=new unsigned char[ntiles*tsize];
+	memset(tiles,0,ntiles*tsize);
+	for(int y=0;y<image.resy();++y)
+		for(int x=0;x<image.resx();++x)
+			memcpy(address(0,x,y),image(x,y),psize);
+	reduce();
+}
+
+mipMap_t::mipMap_t(fcBuffer_t &image,bool mipmap):file(NULL)
+{
+	setLevels(image.resx(),image.resy(),mipmap,true);
+	tiles=new unsigned char[ntiles*tsize];
+	memset(tiles,0,ntiles*tsize);
+	for(int y=0;y<image.resy();++y)
+		for(int x=0;x<image.resx();++x)
+			memcpy(address(0,x,y),image(x,y),psize);
+	reduce();
+}
+
+mipMap_t::~mipMap_t()
+{
+	if(tiles!=NULL) delete [] tiles;
+	if(file!=NULL)
+	{
+		tileCache_t::global().forget(this);
+		fclose(file);
+	}
+}
+
+// Odd sizes just repeat the last row or column, good enough for filtering
+void mipMap_t::reduce()
+{
+	for(int l=1;l<levels();++l)
+	{
+		const mipLevel_t &up=level[l-1];
+		for(int y=0;y<level[l].resy;++y)
+		{
+			int y0=2*y, y1=min(2*y+1,up.resy-1);
+			for(int x=0;x<level[l].resx;++x)
+			{
+				int x0=2*x, x1=min(2*x+1,up.resx-1);
+				colorA_t c[4];
+				texels(l-1,&x0,1,&y0,1,&c[0]);
+				texels(l-1,&x1,1,&y0,1,&c[1]);
+				texels(l-1,&x0,1,&y1,1,&c[2]);
+				texels(l-1,&x1,1,&y1,1,&c[3]);
+				colorA_t avg=(c[0]+c[1]+c[2]+c[3])*0.25;
+				if(hdr)
+					((float *)address(l,x,y)) << avg;
+				else
+					address(l,x,y) << (avg+colorA_t(0.5/255.0));
+			}
+		}
+	}
+}
+
+PFLOAT mipMap_t::lod(PFLOAT width)const
+{
+	if((width<=0) || (levels()==1)) return 0;
+	PFLOAT l=log(width*max(level[0].resx,level[0].resy))/M_LN2;
+	if(l<0) return 0;
+	if(l>levels()-1) return levels()-1;
+	return l;
+}
+
+void mipMap_t::texels(int l,const int *xs,int nx,const int *ys,int ny,colorA_t *out)const
+{
+	const mipLevel_t &lv=level[l];
+	tileCache_t &cache=tileCache_t::global();
+	tileCache_t::entry_t *e=NULL;
+	int last=-1;
+	const unsigned char *d=NULL;
+	for(int j=0;j<ny;++j)
+	{
+		int y=ys[j];
+		for(int i=0;i<nx;++i)
+		{
+			int x=xs[i];
+			int t=lv.first+(y>>MIP_TILE_BITS)*lv.tilesx+(x>>MIP_TILE_BITS);
+			if(t!=last)
+			{
+				if(paged())
+				{
+					if(e!=NULL) cache.unpin(e);
+					e=cache.pin(this,t);
+					d=e->data;
+				}
+				else d=tiles+t*tsize;
+				last=t;
+			}
+			unsigned char *p=(unsigned char *)d+(((y&MIP_TILE_MASK)<<MIP_TILE_BITS)+(x&MIP_TILE_MASK))*psize;
+			if(hdr)
+				((float *)p) >> *out++;
+			else
+				p >> *out++;
+		}
+	}
+	if(e!=NULL) cache.unpin(e);
+}
+
+void mipMap_t::readTile(int t,unsigned char *d)const
+{
+	filelock.wait();
+	bool ok=(fseek(file,offset+(long)t*tsize,SEEK_SET)==0) && (fread(d,1,tsize,file)==tsize);
+	filelock.signal();
+	if(!ok)
+	{
+		cerr << "Error reading texture tile " << t << endl;
+		memset(d,0,tsize);
+	}
+}
+
+unsigned long long mipMap_t::fileKey(const string &image,bool mipmap)
+{
+	keyHash_t key;
+	key.add(image);
+	struct stat st;
+	if(stat(image.c_str(),&st)==0)
+	{
+		key.add((double)st.st_size);
+		key.add((double)st.st_mtime);
+	}
+	key.add(mipmap);
+	key.add(MIP_TILE_BITS);
+	return key.value();
+}
+
+bool mipMap_t::save(const string &name,unsigned long long key)const
+{
+	if(tiles==NULL) return false;
+	cacheWriter_t cache(name,TILE_TAG,key);
+	int h=hdr;
+	cache.writeArray(level);
+	cache.writeArray(&h,1);
+	cache.write(tiles,tsize,ntiles);
+	return cache.ok();
+}
+
+mipMap_t * mipMap_t::open(const string &name,unsigned long long key)
+{
+	cacheReader_t cache(name,TILE_TAG,key);
+	std::vector<mipLevel_t> lv;
+	const int *h;
+	unsigned int count;
+	if(!cache.readArray(lv) || lv.empty() || !cache.readArray(h,count) || (count!=1))
+		return NULL;
+	mipMap_t *m=new mipMap_t;
+	m->setLevels(lv[0].resx,lv[0].resy,lv.size()>1,*h!=0);
+	const void *d=cache.read(m->tsize,count);
+	if(!cache.ok() || (count!=(unsigned int)m->ntiles) || (m->levels()!=(int)lv.size()))
+	{
+		delete m;
+		return NULL;
+	}
+	// the tiles are read one by one when needed, not through the mapping
+	m->offset=cache.offsetOf(d);
+	m->file=fopen(name.c_str(),"rb");
+	if(m->file==NULL)
+	{
+		delete m;
+		return NULL;
+	}
+	return m;
+}
+
+static imageRegistry_t globalImages;
+
+imageRegistry_t & imageRegistry_t::global() {return globalImages;}
+
+imageRegistry_t::~imageRegistry_t()
+{
+	for(images_t::iterator i=images.begin();i!=images.end();++i)
+	{
+		if(i->second->mipmap!=NULL) delete i->second->mipmap;
+		delete i->second;
+	}
+}
+
+const mipMap_t * imageRegistry_t::image_t::load()
+{
+	mutex.wait();
+	if(!loaded)
+	{
+		mipmap=loader(file,mip,cachefile);
+		loaded=true;
+	}
+	mutex.signal();
+	return mipmap;
+}
+
+static string imageKey(const string &file,bool mipmap,const string &cachefile)
+{
+	return file+(mipmap ? "\n1\n" : "\n0\n")+cachefile;
+}
+
+imageRegistry_t::image_t * imageRegistry_t::use(const string &file,bool mipmap,
+		const string &cachefile,loader_t loader)
+{
+	string key=imageKey(file,mipmap,cachefile);
+	mutex.wait();
+	images_t::iterator i=images.find(key);
+	image_t *img;
+	if(i!=images.end())
+	{
+		img=i->second;
+		cout << "Sharing image file " << file << endl;
+	}
+	else
+	{
+		img=new image_t(file,mipmap,cachefile,loader);
+		images[key]=img;
+	}
+	img->users++;
+	mutex.signal();
+	return img;
+}
+
+void imageRegistry_t::release(image_t *img)
+{
+	mutex.wait();
+	if(--img->users==0)
+	{
+		images.erase(imageKey(img->file,img->mip,img->cachefile));
+		if(img->mipmap!=NULL) delete img->mipmap;
+		delete img;
+	}
+	mutex.signal();
+}
+
+// every image is decoded on its own, the loaders share nothing
+class imageLoadWork_t : public yafthreads::parallelWork_t
+{
+	public:
+		imageLoadWork_t(vector<imageRegistry_t::image_t *> &p):pending(p) {};
+		virtual void work(int begin,int end,int thread)
+		{
+			for(int i=begin;i<end;++i) pending[i]->load();
+		}
+	protected:
+		vector<imageRegistry_t::image_t *> &pending;
+};
+
+void imageRegistry_t::loadAll(int threads)
+{
+	// the scene is still being set up, nothing else loads meanwhile
+	vector<image_t *> pending;
+	mutex.wait();
+	for(images_t::iterator i=images.begin();i!=images.end();++i)
+		if(!i->second->loaded) pending.push_back(i->second);
+	mutex.signal();
+	if(pending.empty()) return;
+	cout << "Loading " << pending.size() << " image files" << endl;
+	imageLoadWork_t work(pending);
+	yafthreads::parallelFor(work,pending.size(),threads,1);
+}
+
+__END_YAFRAY
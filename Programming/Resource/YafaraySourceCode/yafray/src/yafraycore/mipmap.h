@@ -0,0 +1,235 @@
+/****************************************************************************
+ *
+ * 			mipmap.h: Tiled image pyramids, their registry and the tile cache
+ *      This is part of the yafray package
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+#ifndef __MIPMAP_H
+#define __MIPMAP_H
+
+#ifdef HAVE_CONFIG_H
+#include<config.h>
+#endif
+
+#include "color.h"
+#include "buffer.h"
+#include "ccthreads.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+
+__BEGIN_YAFRAY
+
+// tiles are 32x32 texels
+#define MIP_TILE_BITS 5
+#define MIP_TILE_SIZE (1<<MIP_TILE_BITS)
+#define MIP_TILE_MASK (MIP_TILE_SIZE-1)
+
+class mipMap_t;
+
+/// Size and first tile of one pyramid level
+struct mipLevel_t
+{
+	int resx,resy;
+	int tilesx,tilesy;
+	int first;
+};
+
+/** Bounded cache of pyramid tiles.
+ *
+ * Paged pyramids keep no texels of their own, every tile they need is
+ * read from their file into this cache. When the cache is full the least
+ * recently used tiles are dropped. There is one cache for all textures,
+ * so the budget holds no matter how many images the scene uses. Pyramids
+ * that are not paged stay in memory whole and are not counted in it.
+ *
+ * pin() hands out a tile that stays put until unpin(), it is never
+ * dropped meanwhile. The file is read without holding the cache lock,
+ * threads wanting a tile being read wait for that tile alone.
+ */
+class YAFRAYCORE_EXPORT tileCache_t
+{
+	public:
+		struct entry_t
+		{
+			const mipMap_t *owner;
+			int tile;
+			unsigned char *data;
+			size_t size;
+			entry_t *prev,*next;
+			/// Users holding the tile, and whether it is still being read
+			int pins;
+			bool loading;
+			/// Held by the thread reading the tile
+			yafthreads::mutex_t loadlock;
+		};
+
+		tileCache_t(size_t bytes);
+		~tileCache_t();
+		void setMaxSize(size_t bytes);
+		size_t maxSize()const {return maxBytes;};
+		entry_t *pin(const mipMap_t *m,int t);
+		void unpin(entry_t *e);
+		/// Drops all the tiles of a pyramid, it is going away
+		void forget(const mipMap_t *m);
+
+		static tileCache_t & global();
+	protected:
+		typedef std::map<std::pair<const mipMap_t *,int>,entry_t *> table_t;
+		void unlink(entry_t *e) {e->prev->next=e->next;e->next->prev=e->prev;};
+		void pushFront(entry_t *e)
+		{
+			e->prev=&lru;  e->next=lru.next;
+			lru.next->prev=e;  lru.next=e;
+		}
+		void drop(entry_t *e);
+		void trim();
+
+		table_t table;
+		/// Head of the recently used list, most recent first
+		entry_t lru;
+		size_t used,maxBytes;
+		yafthreads::mutex_t mutex;
+};
+
+/** Image pyramid stored in square tiles.
+ *
+ * Level 0 is the image itself with the texels it was loaded with, 8 bit
+ * or float RGBA, so sampling it gives exactly what sampling the image
+ * gives. Every other level is a 2x2 box reduction of the one below, down
+ * to a single texel.
+ *
+ * The tiles are kept in memory, or in a tiled file written with save().
+ * A pyramid opened from a file is paged through tileCache_t::global(),
+ * the source image is not even decoded.
+ */
+class YAFRAYCORE_EXPORT mipMap_t
+{
+	public:
+		/// Builds the pyramid, only level 0 when mipmap is false
+		mipMap_t(cBuffer_t &image,bool mipmap=true);
+		mipMap_t(fcBuffer_t &image,bool mipmap=true);
+		~mipMap_t();
+
+		/// Opens a tiled file written by save(), NULL if missing or stale
+		static mipMap_t *open(const std::string &name,unsigned long long key);
+		bool save(const std::string &name,unsigned long long key)const;
+		/// Key of a tiled file made from the given image file
+		static unsigned long long fileKey(const std::string &image,bool mipmap);
+
+		int levels()const {return (int)level.size();};
+		int resx(int l=0)const {return level[l].resx;};
+		int resy(int l=0)const {return level[l].resy;};
+		bool paged()const {return tiles==NULL;};
+		/** Level to sample for a filter width given in texture space
+		 * (1 is the whole image). Not integer means blending two levels.
+		 */
+		PFLOAT lod(PFLOAT width)const;
+		/** Reads the texels of level l at the crossings of columns xs and
+		 * rows ys, row by row. Coordinates must be inside the level.
+		 */
+		void texels(int l,const int *xs,int nx,const int *ys,int ny,colorA_t *out)const;
+		colorA_t texel(int l,int x,int y)const
+		{
+			colorA_t c;
+			texels(l,&x,1,&y,1,&c);
+			return c;
+		}
+
+		/// Reads tile t from the file, used by the cache
+		void readTile(int t,unsigned char *d)const;
+		size_t tileBytes()const {return tsize;};
+	protected:
+		mipMap_t(): tiles(NULL),file(NULL) {};
+		mipMap_t(const mipMap_t &m) {}; //forbiden
+		void setLevels(int rx,int ry,bool mipmap,bool h);
+		unsigned char *address(int l,int x,int y)const
+		{
+			const mipLevel_t &lv=level[l];
+			int t=lv.first+(y>>MIP_TILE_BITS)*lv.tilesx+(x>>MIP_TILE_BITS);
+			return tiles+t*tsize+(((y&MIP_TILE_MASK)<<MIP_TILE_BITS)+(x&MIP_TILE_MASK))*psize;
+		}
+		void reduce();
+
+		std::vector<mipLevel_t> level;
+		bool hdr;
+		/// Bytes of one texel and of one tile
+		size_t psize,tsize;
+		int ntiles;
+		/// All tiles one after the other, NULL when paged
+		unsigned char *tiles;
+		/// Tiled file and position of the first tile in it
+		FILE *file;
+		long offset;
+		/// Several threads may be reading tiles of the file
+		mutable yafthreads::mutex_t filelock;
+};
+
+/** Pyramids shared by all the image textures of the scene.
+ *
+ * Textures name their file with use() while the scene is parsed and get a
+ * handle at once, the same one for the same file and options. loadAll()
+ * then decodes all the files still pending at the same time, on several
+ * threads, and must have run before rendering starts: get() takes no lock
+ * and only returns what is already there. Setup code that needs the pixels
+ * earlier calls load() on the handle.
+ */
+class YAFRAYCORE_EXPORT imageRegistry_t
+{
+	public:
+		/// Decodes a file into a pyramid, NULL if it can't
+		typedef mipMap_t * (*loader_t)(const std::string &file,bool mipmap,const std::string &cachefile);
+
+		class YAFRAYCORE_EXPORT image_t
+		{
+			friend class imageRegistry_t;
+			public:
+				/// The pyramid, NULL if the file could not be loaded or is not loaded yet
+				const mipMap_t *get()const {return mipmap;};
+				/// Decodes the file if no one did yet, and returns the pyramid
+				const mipMap_t *load();
+				const std::string &fileName()const {return file;};
+			protected:
+				image_t(const std::string &f,bool m,const std::string &c,loader_t l):
+					file(f),cachefile(c),mip(m),loader(l),mipmap(NULL),loaded(false),users(0) {};
+
+				std::string file,cachefile;
+				bool mip;
+				loader_t loader;
+				mipMap_t *mipmap;
+				bool loaded;
+				int users;
+				yafthreads::mutex_t mutex;
+		};
+
+		~imageRegistry_t();
+		image_t *use(const std::string &file,bool mipmap,const std::string &cachefile,loader_t loader);
+		/// Drops a handle from use(), the pyramid goes with the last one
+		void release(image_t *img);
+		void loadAll(int threads);
+
+		static imageRegistry_t & global();
+	protected:
+		typedef std::map<std::string,image_t *> images_t;
+		images_t images;
+		yafthreads::mutex_t mutex;
+};
+
+__END_YAFRAY
+
+#endif
@@ -1,5 +1,9 @@
 #include "noise.h"
 
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+
 __BEGIN_YAFRAY
 
 // needed for voronoi
@@ -182,6 +186,71 @@ PFLOAT newPerlin_t::operator() (const point3d_t &pt) const
 	return (0.5 + 0.5*nv);
 }
 
+#ifdef __SSE2__
+// the 12 gradient directions of grad() as vectors, indexed by the low 4 bits of the hash
+static const float newp_g[16][3] = {
+	{ 1, 1, 0}, {-1, 1, 0}, { 1,-1, 0}, {-1,-1, 0},
+	{ 1, 0, 1}, {-1, 0, 1}, { 1, 0,-1}, {-1, 0,-1},
+	{ 0, 1, 1}, { 0,-1, 1}, { 0, 1,-1}, { 0,-1,-1},
+	{ 1, 1, 0}, { 0,-1, 1}, {-1, 1, 0}, { 0,-1,-1}};
+
+// a*x + b*y + c*z on four lanes
+static inline __m128 dot4(const float *a, const float *b, const float *c, __m128 x, __m128 y, __m128 z)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a), x), _mm_mul_ps(_mm_loadu_ps(b), y)),
+			_mm_mul_ps(_mm_loadu_ps(c), z));
+}
+
+static inline __m128 lerp4(__m128 t, __m128 a, __m128 b)
+{
+	return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+static inline __m128 fade4(__m128 t)
+{
+	const __m128 c6=_mm_set1_ps(6), c15=_mm_set1_ps(15), c10=_mm_set1_ps(10);
+	__m128 t3 = _mm_mul_ps(_mm_mul_ps(t, t), t);
+	return _mm_mul_ps(t3, _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, c6), c15)), c10));
+}
+#endif
+
+// hashing stays scalar, four points are interpolated side by side
+void newPerlin_t::evaluate(const point3d_t *pt, PFLOAT *res, int n) const
+{
+	int i=0;
+#ifdef __SSE2__
+	float fx[4], fy[4], fz[4], g[8][3][4], nv[4];
+	const __m128 one = _mm_set1_ps(1);
+	for (;(i+4)<=n;i+=4) {
+		for (int k=0;k<4;k++) {
+			PFLOAT x=pt[i+k].x, y=pt[i+k].y, z=pt[i+k].z;
+			PFLOAT u=floor(x), v=floor(y), w=floor(z);
+			int X=((int)u) & 255, Y=((int)v) & 255, Z=((int)w) & 255;
+			fx[k]=x-u;  fy[k]=y-v;  fz[k]=z-w;
+			int A=hash[X  ]+Y, AA=hash[A]+Z, AB=hash[A+1]+Z,
+			    B=hash[X+1]+Y, BA=hash[B]+Z, BB=hash[B+1]+Z;
+			// corner c is offset by one in x, y, z for bits 0, 1, 2
+			const int h[8] = {hash[AA  ], hash[BA  ], hash[AB  ], hash[BB  ],
+			                  hash[AA+1], hash[BA+1], hash[AB+1], hash[BB+1]};
+			for (int c=0;c<8;c++) {
+				const float *gr = newp_g[h[c] & 15];
+				g[c][0][k]=gr[0];  g[c][1][k]=gr[1];  g[c][2][k]=gr[2];
+			}
+		}
+		__m128 x0=_mm_loadu_ps(fx), y0=_mm_loadu_ps(fy), z0=_mm_loadu_ps(fz);
+		__m128 x1=_mm_sub_ps(x0, one), y1=_mm_sub_ps(y0, one), z1=_mm_sub_ps(z0, one);
+		__m128 d[8];
+		for (int c=0;c<8;c++)
+			d[c] = dot4(g[c][0], g[c][1], g[c][2], (c&1) ? x1 : x0, (c&2) ? y1 : y0, (c&4) ? z1 : z0);
+		__m128 u=fade4(x0), v=fade4(y0), w=fade4(z0);
+		_mm_storeu_ps(nv, lerp4(w, lerp4(v, lerp4(u, d[0], d[1]), lerp4(u, d[2], d[3])),
+		                           lerp4(v, lerp4(u, d[4], d[5]), lerp4(u, d[6], d[7]))));
+		for (int k=0;k<4;k++) res[i+k] = (0.5 + 0.5*nv[k]);
+	}
+#endif
+	for (;i<n;i++) res[i] = (*this)(pt[i]);
+}
+
 //------------------------------------------------------------------------------------
 // Standard (old) Perlin noise
 
@@ -514,6 +583,8 @@ PFLOAT blenderNoise_t::operator() (const point3d_t &pt) const
 
 void voronoi_t::setDistM(dMetricType dm)
 {
+	if (distfunc) delete distfunc;
+	dmType = dm;
 	switch(dm) {
 		case DIST_SQUARED:
 			distfunc = new dist_Squared();
@@ -543,54 +614,88 @@ void voronoi_t::setDistM(dMetricType dm)
 voronoi_t::voronoi_t(voronoiType vt, dMetricType dm, PFLOAT mex)
 {
 	vType = vt;
-	dmType = dm;
 	mk_exp = mex;
-	setDistM(dmType);
+	distfunc = NULL;
+	setDistM(dm);
+}
+
+// distances of n offsets, the euclidean and chebychev metrics four at a time
+void voronoi_t::distances(const float *x, const float *y, const float *z, float *d, int n) const
+{
+	int i=0;
+#ifdef __SSE2__
+	// manhattan is left out, its scalar sum is done in double
+	if ((dmType==DIST_REAL) || (dmType==DIST_SQUARED) || (dmType==DIST_CHEBYCHEV)) {
+		const __m128 nosign = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		for (;(i+4)<=n;i+=4) {
+			__m128 vx=_mm_loadu_ps(x+i), vy=_mm_loadu_ps(y+i), vz=_mm_loadu_ps(z+i), vd;
+			if (dmType==DIST_CHEBYCHEV)
+				vd = _mm_max_ps(_mm_max_ps(_mm_and_ps(vx, nosign), _mm_and_ps(vy, nosign)), _mm_and_ps(vz, nosign));
+			else {
+				vd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+				if (dmType==DIST_REAL) vd = _mm_sqrt_ps(vd);
+			}
+			_mm_storeu_ps(d+i, vd);
+		}
+	}
+#endif
+	for (;i<n;i++) d[i] = (*distfunc)(x[i], y[i], z[i], mk_exp);
 }
 
-void voronoi_t::getFeatures(const point3d_t &pt) const
+voronoiFeatures_t voronoi_t::getFeatures(const point3d_t &pt) const
 {
-	int xx, yy, zz, xi, yi, zi;
-	//PFLOAT xd, yd, zd, d, *p;
-	//PFLOAT x=pt.x, y=pt.y, z=pt.z;
-	float xd, yd, zd, d, *p;
-	float x=pt.x, y=pt.y, z=pt.z;
+	int xx, yy, zz, xi, yi, zi, n=0;
+	float x=pt.x, y=pt.y, z=pt.z, *p;
+	// the 27 neighbour cells, padded to a multiple of four lanes
+	float px[28], py[28], pz[28], xd[28], yd[28], zd[28], d[28];
 	xi = (int)(floor(x));
 	yi = (int)(floor(y));
 	zi = (int)(floor(z));
-	da[0] = da[1] = da[2] = da[3] = 1e10f;
 	for (xx=xi-1;xx<=xi+1;xx++) {
 		for (yy=yi-1;yy<=yi+1;yy++) {
-			for (zz=zi-1;zz<=zi+1;zz++) {
+			for (zz=zi-1;zz<=zi+1;zz++, n++) {
 				p = HASHPNT(xx, yy, zz);
-				xd = x - (p[0] + xx);
-				yd = y - (p[1] + yy);
-				zd = z - (p[2] + zz);
-				d = (*distfunc)(xd, yd, zd, mk_exp);
-				if (d<da[0]) {
-					da[3]=da[2];  da[2]=da[1];  da[1]=da[0];  da[0]=d;
-					pa[3]=pa[2];  pa[2]=pa[1];  pa[1]=pa[0];  pa[0].set(p[0]+xx, p[1]+yy, p[2]+zz);
-				}
-				else if (d<da[1]) {
-					da[3]=da[2];  da[2]=da[1];  da[1]=d;
-					pa[3]=pa[2];  pa[2]=pa[1];  pa[1].set(p[0]+xx, p[1]+yy, p[2]+zz);
-				}
-				else if (d<da[2]) {
-					da[3]=da[2];  da[2]=d;
-					pa[3]=pa[2];  pa[2].set(p[0]+xx, p[1]+yy, p[2]+zz);
-				}
-				else if (d<da[3]) {
-					da[3]=d;
-					pa[3].set(p[0]+xx, p[1]+yy, p[2]+zz);
-				}
+				px[n] = p[0] + xx;
+				py[n] = p[1] + yy;
+				pz[n] = p[2] + zz;
+				xd[n] = x - px[n];
+				yd[n] = y - py[n];
+				zd[n] = z - pz[n];
 			}
 		}
 	}
+	xd[27] = yd[27] = zd[27] = 0;
+	distances(xd, yd, zd, d, 28);
+
+	voronoiFeatures_t f;
+	PFLOAT *da=f.d;
+	point3d_t *pa=f.p;
+	da[0] = da[1] = da[2] = da[3] = 1e10f;
+	for (n=0;n<27;n++) {
+		if (d[n]<da[0]) {
+			da[3]=da[2];  da[2]=da[1];  da[1]=da[0];  da[0]=d[n];
+			pa[3]=pa[2];  pa[2]=pa[1];  pa[1]=pa[0];  pa[0].set(px[n], py[n], pz[n]);
+		}
+		else if (d[n]<da[1]) {
+			da[3]=da[2];  da[2]=da[1];  da[1]=d[n];
+			pa[3]=pa[2];  pa[2]=pa[1];  pa[1].set(px[n], py[n], pz[n]);
+		}
+		else if (d[n]<da[2]) {
+			da[3]=da[2];  da[2]=d[n];
+			pa[3]=pa[2];  pa[2].set(px[n], py[n], pz[n]);
+		}
+		else if (d[n]<da[3]) {
+			da[3]=d[n];
+			pa[3].set(px[n], py[n], pz[n]);
+		}
+	}
+	return f;
 }
 
 PFLOAT voronoi_t::operator() (const point3d_t &pt) const
 {
-	getFeatures(pt);
+	voronoiFeatures_t f = getFeatures(pt);
+	const PFLOAT *da = f.d;
 	switch (vType) {
 		case V_F2:
 			return da[1];
@@ -635,17 +740,17 @@ PFLOAT cellNoise_t::operator() (const point3d_t &pt) const
  *    ``lacunarity''  is the gap between successive frequencies
  *    ``octaves''  is the number of frequencies in the fBm
  */
-PFLOAT fBm_t::operator() (const point3d_t &pt) const
+PFLOAT fBm_t::operator() (const point3d_t &pt, PFLOAT width) const
 {
+	PFLOAT octs = filterOctaves(octaves, lacunarity, width);
 	PFLOAT value=0, pwr=1, pwHL=pow(lacunarity, -H);
-	point3d_t tp(pt);
-	for (int i=0; i<(int)octaves; i++) {
-		value += getSignedNoise(nGen, tp) * pwr;
+	PFLOAT rmd = octs - floor(octs);
+	octaveNoise_t noise(nGen, pt, lacunarity, (int)octs + ((rmd!=0.f) ? 1 : 0));
+	for (int i=0; i<(int)octs; i++) {
+		value += noise.nextSigned() * pwr;
 		pwr *= pwHL;
-		tp *= lacunarity;
 	}
-	PFLOAT rmd = octaves - floor(octaves);
-	if (rmd!=0.f) value += rmd * getSignedNoise(nGen, tp) * pwr;
+	if (rmd!=0.f) value += rmd * noise.nextSigned() * pwr;
 	return value;
 }
 
@@ -665,17 +770,17 @@ PFLOAT fBm_t::operator() (const point3d_t &pt) const
  /* this one is in fact rather confusing,
  	* there seem to be errors in the original source code (in all three versions of proc.text&mod),
 	* I modified it to something that made sense to me, so it might be wrong... */
-PFLOAT mFractal_t::operator() (const point3d_t &pt) const
+PFLOAT mFractal_t::operator() (const point3d_t &pt, PFLOAT width) const
 {
+	PFLOAT octs = filterOctaves(octaves, lacunarity, width);
 	PFLOAT value=1, pwr=1, pwHL=pow(lacunarity, -H);
-	point3d_t tp(pt);
-	for (int i=0; i<(int)octaves; i++) {
-		value *= (pwr*getSignedNoise(nGen, tp) + (PFLOAT)1.0);
+	PFLOAT rmd = octs - floor(octs);
+	octaveNoise_t noise(nGen, pt, lacunarity, (int)octs + ((rmd!=(PFLOAT)0.0) ? 1 : 0));
+	for (int i=0; i<(int)octs; i++) {
+		value *= (pwr*noise.nextSigned() + (PFLOAT)1.0);
 		pwr *= pwHL;
-		tp *= lacunarity;
 	}
-	PFLOAT rmd = octaves - floor(octaves);
-	if (rmd!=(PFLOAT)0.0) value *= (rmd * getSignedNoise(nGen, tp) * pwr + (PFLOAT)1.0);
+	if (rmd!=(PFLOAT)0.0) value *= (rmd * noise.nextSigned() * pwr + (PFLOAT)1.0);
 	return value;
 }
 
@@ -692,26 +797,25 @@ PFLOAT mFractal_t::operator() (const point3d_t &pt) const
  *       ``octaves''  is the number of frequencies in the fBm
  *       ``offset''  raises the terrain from `sea level'
  */
-PFLOAT heteroTerrain_t::operator() (const point3d_t &pt) const
+PFLOAT heteroTerrain_t::operator() (const point3d_t &pt, PFLOAT width) const
 {
+	PFLOAT octs = filterOctaves(octaves, lacunarity, width);
 	PFLOAT pwHL = pow(lacunarity, -H);
 	PFLOAT pwr = pwHL;	// starts with i=1 instead of 0
-	point3d_t tp(pt);
+	PFLOAT rmd = octs - floor(octs);
+	octaveNoise_t noise(nGen, pt, lacunarity, (int)octs + ((rmd!=(PFLOAT)0.0) ? 1 : 0));
 
 	// first unscaled octave of function; later octaves are scaled
-	PFLOAT value = offset + getSignedNoise(nGen, tp);
-	tp *= lacunarity;
+	PFLOAT value = offset + noise.nextSigned();
 	PFLOAT increment;
-	for (int i=1; i<(int)octaves; i++) {
-		increment = (getSignedNoise(nGen, tp) + offset) * pwr * value;
+	for (int i=1; i<(int)octs; i++) {
+		increment = (noise.nextSigned() + offset) * pwr * value;
 		value += increment;
 		pwr *= pwHL;
-		tp *= lacunarity;
 	}
 
-	PFLOAT rmd = octaves - floor(octaves);
 	if (rmd!=(PFLOAT)0.0) {
-		increment = (getSignedNoise(nGen, tp) + offset) * pwr * value;
+		increment = (noise.nextSigned() + offset) * pwr * value;
 		value += rmd * increment;
 	}
 
@@ -728,8 +832,9 @@ PFLOAT heteroTerrain_t::operator() (const point3d_t &pt) const
  *      H:           0.25
  *      offset:      0.7
  */
-PFLOAT hybridMFractal_t::operator() (const point3d_t &pt) const
+PFLOAT hybridMFractal_t::operator() (const point3d_t &pt, PFLOAT width) const
 {
+	PFLOAT octs = filterOctaves(octaves, lacunarity, width);
 	PFLOAT pwHL = pow(lacunarity, -H);
 	PFLOAT pwr = pwHL;	// starts with i=1 instead of 0
 	point3d_t tp(pt);
@@ -738,7 +843,7 @@ PFLOAT hybridMFractal_t::operator() (const point3d_t &pt) const
 	PFLOAT weight = gain * result;
 	tp *= lacunarity;
 
-	for (int i=1; (weight>(PFLOAT)0.001) && (i<(int)octaves); i++) {
+	for (int i=1; (weight>(PFLOAT)0.001) && (i<(int)octs); i++) {
 		if (weight>(PFLOAT)1.0)  weight=(PFLOAT)1.0;
 		PFLOAT signal = (getSignedNoise(nGen, tp) + offset) * pwr;
 		pwr *= pwHL;
@@ -747,7 +852,7 @@ PFLOAT hybridMFractal_t::operator() (const point3d_t &pt) const
 		tp *= lacunarity;
 	}
 
-	PFLOAT rmd = octaves - floor(octaves);
+	PFLOAT rmd = octs - floor(octs);
 	if (rmd!=(PFLOAT)0.0) result += rmd * ((getSignedNoise(nGen, tp) + offset) * pwr);
 
 	return result;
@@ -765,22 +870,22 @@ PFLOAT hybridMFractal_t::operator() (const point3d_t &pt) const
  *      offset:      1.0
  *      gain:        2.0
  */
-PFLOAT ridgedMFractal_t::operator() (const point3d_t &pt) const
+PFLOAT ridgedMFractal_t::operator() (const point3d_t &pt, PFLOAT width) const
 {
+	PFLOAT octs = filterOctaves(octaves, lacunarity, width);
 	PFLOAT pwHL = pow(lacunarity, -H);
 	PFLOAT pwr = pwHL;	// starts with i=1 instead of 0
-	point3d_t tp(pt);
+	octaveNoise_t noise(nGen, pt, lacunarity, (int)octs);
 
-	PFLOAT signal = offset - fabs(getSignedNoise(nGen, tp));
+	PFLOAT signal = offset - fabs(noise.nextSigned());
 	signal *= signal;
 	PFLOAT result = signal;
 	PFLOAT weight = 1.0;
 
-	for(int i=1; i<(int)octaves; i++ ) {
-		tp *= lacunarity;
+	for(int i=1; i<(int)octs; i++ ) {
 		weight = signal * gain;
 		if (weight>(PFLOAT)1.0) weight=(PFLOAT)1.0; else if (weight<(PFLOAT)0.0) weight=(PFLOAT)0.0;
-		signal = offset - fabs(getSignedNoise(nGen, tp));
+		signal = offset - fabs(noise.nextSigned());
 		signal *= signal;
 		signal *= weight;
 		result += signal * pwr;
@@ -805,13 +910,31 @@ colorA_t cellNoiseColor(const point3d_t &pt)
 }
 
 // turbulence function used by basic blocks
-CFLOAT turbulence(const noiseGenerator_t* ngen, const point3d_t &pt, int oct, PFLOAT size, bool hard)
+CFLOAT turbulence(const noiseGenerator_t* ngen, const point3d_t &pt, int oct, PFLOAT size, bool hard,
+		PFLOAT width)
 {
 	PFLOAT val, amp=1, sum=0;
-	point3d_t tp = ngen->offset(pt)*size;	// only blendernoise adds offset
-	for (int i=0;i<=oct;i++, amp*=0.5, tp*=2.0) {
-		val = (*ngen)(tp);
+	// octave i has frequency size*2^i, the ones past half a period per
+	// footprint are replaced by the noise average, the last one kept fades
+	int keep = oct;
+	PFLOAT fade = 1;
+	if ((width>0) && (size>0)) {
+		PFLOAT o = log((PFLOAT)0.5/(size*width))/M_LN2;
+		if (o<0) { keep = 0;  fade = 0; }
+		else if (o<oct) { keep = (int)o;  fade = o-keep; }
+	}
+	// noise averages 0.5, the hard one about 0.2 to 0.3 depending on the type
+	const PFLOAT avg = hard ? 0.25 : 0.5;
+	// only blendernoise adds offset
+	octaveNoise_t noise(ngen, ngen->offset(pt)*size, 2.0, keep+1);
+	for (int i=0;i<=oct;i++, amp*=0.5) {
+		if (i>keep) {
+			sum += amp*avg;
+			continue;
+		}
+		val = noise.next();
 		if (hard) val = fabs(2.0*val-1.0);
+		if ((i==keep) && (fade<1)) val = fade*val + (1-fade)*avg;
 		sum += amp*val;
 	}
 	
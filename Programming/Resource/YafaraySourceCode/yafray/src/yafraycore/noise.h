@@ -17,6 +17,11 @@ public:
 	noiseGenerator_t() {}
 	virtual ~noiseGenerator_t() {}
 	virtual PFLOAT operator() (const point3d_t &pt) const=0;
+	// n points at once, improved perlin has an SSE2 kernel
+	virtual void evaluate(const point3d_t *pt, PFLOAT *res, int n) const
+	{
+		for (int i=0;i<n;i++) res[i] = (*this)(pt[i]);
+	}
 	// offset only added by blendernoise
 	virtual point3d_t offset(const point3d_t &pt) const { return pt; }
 };
@@ -29,6 +34,7 @@ public:
 	newPerlin_t() {}
 	virtual ~newPerlin_t() {}
 	virtual PFLOAT operator() (const point3d_t &pt) const;
+	virtual void evaluate(const point3d_t *pt, PFLOAT *res, int n) const;
 private:
 	PFLOAT fade(PFLOAT t) const { return t*t*t*(t*(t*6 - 15) + 10); }
 	PFLOAT grad(int hash, PFLOAT x, PFLOAT y, PFLOAT z) const
@@ -129,6 +135,13 @@ struct dist_Minkovsky : public distanceMetric_t
 	}
 };
 
+// the four nearest feature points of a voronoi query, nearest first
+struct voronoiFeatures_t
+{
+	PFLOAT d[4];		// distances
+	point3d_t p[4];	// feature points
+};
+
 class YAFRAYCORE_EXPORT voronoi_t : public noiseGenerator_t
 {
 public:
@@ -141,18 +154,16 @@ public:
 		if (distfunc) { delete distfunc;  distfunc=NULL; }
 	}
 	virtual PFLOAT operator() (const point3d_t &pt) const;
-	PFLOAT getDistance(int x) const { return da[x & 3]; }
-	point3d_t getPoint(int x) const { return pa[x & 3]; }
 	void setMinkovskyExponent(PFLOAT me) { mk_exp=me; }
-	void getFeatures(const point3d_t &pt) const;
+	// nothing is kept in the generator, so one instance can serve all threads
+	voronoiFeatures_t getFeatures(const point3d_t &pt) const;
 	void setDistM(dMetricType dm);
 protected:
+	void distances(const float *x, const float *y, const float *z, float *d, int n) const;
 	voronoiType vType;
 	dMetricType dmType;
 	PFLOAT mk_exp, w1, w2, w3,w4;
 	distanceMetric_t* distfunc;
-	mutable PFLOAT da[4];			// distance array
-	mutable point3d_t pa[4];	// feature point array
 };
 
 // cell noise
@@ -172,7 +183,8 @@ class YAFRAYCORE_EXPORT musgrave_t
 public:
 	musgrave_t() {}
 	virtual ~musgrave_t() {}
-	virtual PFLOAT operator() (const point3d_t &pt) const=0;
+	// width is the footprint around pt, octaves finer than it are left out
+	virtual PFLOAT operator() (const point3d_t &pt, PFLOAT width=0) const=0;
 };
 
 class YAFRAYCORE_EXPORT fBm_t : public musgrave_t
@@ -181,7 +193,7 @@ public:
 	fBm_t(PFLOAT _H, PFLOAT _lacu, PFLOAT _octs, const noiseGenerator_t* _nGen)
 			: H(_H), lacunarity(_lacu), octaves(_octs), nGen(_nGen) {}
 	virtual ~fBm_t() {}
-	virtual PFLOAT operator() (const point3d_t &pt) const;
+	virtual PFLOAT operator() (const point3d_t &pt, PFLOAT width=0) const;
 protected:
 	PFLOAT H, lacunarity, octaves;
 	const noiseGenerator_t* nGen;
@@ -193,7 +205,7 @@ public:
 	mFractal_t(PFLOAT _H, PFLOAT _lacu, PFLOAT _octs, const noiseGenerator_t* _nGen)
 			: H(_H), lacunarity(_lacu), octaves(_octs), nGen(_nGen) {}
 	virtual ~mFractal_t() {}
-	virtual PFLOAT operator() (const point3d_t &pt) const;
+	virtual PFLOAT operator() (const point3d_t &pt, PFLOAT width=0) const;
 protected:
 	PFLOAT H, lacunarity, octaves;
 	const noiseGenerator_t* nGen;
@@ -205,7 +217,7 @@ public:
 	heteroTerrain_t(PFLOAT _H, PFLOAT _lacu, PFLOAT _octs, PFLOAT _offs, const noiseGenerator_t* _nGen)
 			: H(_H), lacunarity(_lacu), octaves(_octs), offset(_offs), nGen(_nGen) {}
 	virtual ~heteroTerrain_t() {}
-	virtual PFLOAT operator() (const point3d_t &pt) const;
+	virtual PFLOAT operator() (const point3d_t &pt, PFLOAT width=0) const;
 protected:
 	PFLOAT H, lacunarity, octaves, offset;
 	const noiseGenerator_t* nGen;
@@ -217,7 +229,7 @@ public:
 	hybridMFractal_t(PFLOAT _H, PFLOAT _lacu, PFLOAT _octs, PFLOAT _offs, PFLOAT _gain, const noiseGenerator_t* _nGen)
 			: H(_H), lacunarity(_lacu), octaves(_octs), offset(_offs), gain(_gain), nGen(_nGen) {}
 	virtual ~hybridMFractal_t() {}
-	virtual PFLOAT operator() (const point3d_t &pt) const;
+	virtual PFLOAT operator() (const point3d_t &pt, PFLOAT width=0) const;
 protected:
 	PFLOAT H, lacunarity, octaves, offset, gain;
 	const noiseGenerator_t* nGen;
@@ -229,7 +241,7 @@ public:
 	ridgedMFractal_t(PFLOAT _H, PFLOAT _lacu, PFLOAT _octs, PFLOAT _offs, PFLOAT _gain, const noiseGenerator_t* _nGen)
 			: H(_H), lacunarity(_lacu), octaves(_octs), offset(_offs), gain(_gain), nGen(_nGen) {}
 	virtual ~ridgedMFractal_t() {}
-	virtual PFLOAT operator() (const point3d_t &pt) const;
+	virtual PFLOAT operator() (const point3d_t &pt, PFLOAT width=0) const;
 protected:
 	PFLOAT H, lacunarity, octaves, offset, gain;
 	const noiseGenerator_t* nGen;
@@ -238,15 +250,63 @@ protected:
 
 // basic turbulence, half amplitude, double frequency defaults
 // returns value in range (0,1)
-CFLOAT YAFRAYCORE_EXPORT turbulence(const noiseGenerator_t* ngen, const point3d_t &pt, int oct, PFLOAT size, bool hard);
+// octaves finer than a footprint of the given width fade to their average
+CFLOAT YAFRAYCORE_EXPORT turbulence(const noiseGenerator_t* ngen, const point3d_t &pt, int oct, PFLOAT size, bool hard,
+		PFLOAT width=0);
 // noise cell color (used with voronoi)
 colorA_t YAFRAYCORE_EXPORT cellNoiseColor(const point3d_t &pt);
 
+// octaves of a fractal sum that a footprint of the given width still
+// resolves, octave i has frequency lacu^i and is kept up to half a period
+inline PFLOAT filterOctaves(PFLOAT octs, PFLOAT lacu, PFLOAT width)
+{
+	if ((width<=0) || (lacu<=1)) return octs;
+	PFLOAT o = (PFLOAT)1.0 + log((PFLOAT)0.5/width)/log(lacu);
+	if (o<1) return 1;
+	return (o<octs) ? o : octs;
+}
+
 inline PFLOAT getSignedNoise(const noiseGenerator_t* nGen, const point3d_t &pt)
 {
 	return (PFLOAT)2.0 * (*nGen)(pt) - (PFLOAT)1.0;
 }
 
+#define OCTAVE_BATCH 8
+
+// noise at the octave points pt, pt*lacu, pt*lacu^2 ... of the fractal sums,
+// they don't depend on each other so they are evaluated in batches
+class octaveNoise_t
+{
+public:
+	octaveNoise_t(const noiseGenerator_t* _nGen, const point3d_t &pt, PFLOAT _lacu, int octs)
+			: nGen(_nGen), tp(pt), lacunarity(_lacu), left(octs), cur(0), count(0) {}
+	PFLOAT next()
+	{
+		if (cur==count) fill();
+		return val[cur++];
+	}
+	PFLOAT nextSigned() { return (PFLOAT)2.0 * next() - (PFLOAT)1.0; }
+protected:
+	void fill()
+	{
+		// past the expected octaves it goes on one point at a time
+		count = (left<OCTAVE_BATCH) ? ((left>0) ? left : 1) : OCTAVE_BATCH;
+		for (int i=0;i<count;i++) {
+			pts[i] = tp;
+			tp *= lacunarity;
+		}
+		nGen->evaluate(pts, val, count);
+		left -= count;
+		cur = 0;
+	}
+	const noiseGenerator_t* nGen;
+	point3d_t tp;
+	PFLOAT lacunarity;
+	int left, cur, count;
+	point3d_t pts[OCTAVE_BATCH];
+	PFLOAT val[OCTAVE_BATCH];
+};
+
 
 __END_YAFRAY
 //---------------------------------------------------------------------------
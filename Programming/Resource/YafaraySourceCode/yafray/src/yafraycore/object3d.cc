@@ -9,6 +9,25 @@ __BEGIN_YAFRAY
 
 typedef geomeTree_t<object3d_t> onode_t;
 
+void object3d_t::hashGeometry(keyHash_t &h) const
+{
+	point3d_t a,g;
+	getBound().get(a,g);
+	h.add(type());
+	h.add(a);
+	h.add(g);
+	h.add(radiosity);
+	h.add(rad_pasive);
+	h.add(shadow);
+	h.add(caus);
+	if(caus)
+	{
+		h.add(caus_rcolor);
+		h.add(caus_tcolor);
+		h.add(caus_IOR);
+	}
+}
+
 struct oTreeDist_f
 {
 	PFLOAT operator () (const onode_t *a,const onode_t *b)const
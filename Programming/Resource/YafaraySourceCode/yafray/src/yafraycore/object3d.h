@@ -33,6 +33,7 @@ __END_YAFRAY
 #include "surface.h"
 #include "shader.h"
 #include "bound.h"
+#include "mapfile.h"
 //#include "spectrum.h"
 
 __BEGIN_YAFRAY
@@ -62,7 +63,16 @@ class YAFRAYCORE_EXPORT object3d_t
 		virtual point3d_t toObjectOrco(const point3d_t &p) const=0;
 		virtual bool shoot(renderState_t &state,surfacePoint_t &where, const point3d_t &from,
 				const vector3d_t &ray,bool shadow=false,PFLOAT dis=-1)const=0;
+		/** Rebuilds the surface point of a hit shoot() found, from the
+		 * element it set as origin and the distance. Shooting again gives
+		 * it, objects that can do better do.
+		 */
+		virtual bool surface(renderState_t &state,surfacePoint_t &where,const void *element,
+				const point3d_t &from,const vector3d_t &ray,PFLOAT Z)const
+		{return shoot(state,where,from,ray);};
 		virtual bound_t getBound() const =0;
+		/// Adds to the key everything that changes how the object scatters light
+		virtual void hashGeometry(keyHash_t &h) const;
 		void setShader(shader_t *shad) {shader=shad;};
 		shader_t *getShader() const {return shader;};
 		bool useForRadiosity() const  {return radiosity;};
@@ -3,28 +3,14 @@
 
 #include<algorithm>
 
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+
 using namespace std;
 
 __BEGIN_YAFRAY
 
-dirConverter_t dirconverter;
-
-dirConverter_t::dirConverter_t()
-{
-	for(int i=0;i<255;++i)
-	{
-		PFLOAT angle=(PFLOAT)i*(1.0/255.0)*M_PI;
-		costheta[i]=cos(angle);
-		sintheta[i]=sin(angle);
-	}
-	for(int i=0;i<256;++i)
-	{
-		PFLOAT angle=(PFLOAT)i*(1.0/256.0)*2.0*M_PI;
-		cosphi[i]=cos(angle);
-		sinphi[i]=sin(angle);
-	}
-}
-
 void runningPhoton_t::position(const point3d_t &_pos,PFLOAT bias)
 {
 	PFLOAT ad=(pos-_pos).length();
@@ -36,44 +22,6 @@ void runningPhoton_t::position(const point3d_t &_pos,PFLOAT bias)
 }
 
 
-// BEGIN OF FUNCTIONS FOR THE TEMPLATED BINARY TREE BUILD FUNTION
-//
-// --------------------------------------------------------------
-
-static bound_t global_photon_calc_bound(const vector<const storedPhoton_t *> &v)
-{
-	int size=v.size();
-	if(size==0) return bound_t(point3d_t(),point3d_t());
-	PFLOAT maxx,maxy,maxz,minx,miny,minz;
-	maxx=minx=v[0]->position().x;
-	maxy=miny=v[0]->position().y;
-	maxz=minz=v[0]->position().z;
-	for(int i=0;i<size;++i)
-	{
-		const point3d_t &p=v[i]->position();
-		if(p.x>maxx) maxx=p.x;
-		if(p.y>maxy) maxy=p.y;
-		if(p.z>maxz) maxz=p.z;
-		if(p.x<minx) minx=p.x;
-		if(p.y<miny) miny=p.y;
-		if(p.z<minz) minz=p.z;
-	}
-	return bound_t(point3d_t(minx,miny,minz),point3d_t(maxx,maxy,maxz));
-}
-
-static bool global_photon_is_in_bound(const storedPhoton_t * const & p,bound_t &b)
-{
-	return b.includes(p->position());
-}
-
-static point3d_t global_photon_get_pos(const storedPhoton_t * const & p)
-{
-	return p->position();
-}
-
-// END OF FUNCTIONS FOR THE TEMPLATED BINARY TREE BUILD FUNTION
-//
-// --------------------------------------------------------------
 /*
 void globalPhotonMap_t::store(const runningPhoton_t &p,const vector3d_t &N) 
 {
@@ -95,13 +43,12 @@ void globalPhotonMap_t::store(const runningPhoton_t &p,const vector3d_t &N)
 }
 */
 
-globalPhotonMap_t::globalPhotonMap_t(PFLOAT r):maxradius(r),tree(NULL)
+globalPhotonMap_t::globalPhotonMap_t(PFLOAT r):maxradius(r)
 {
 }
 
 globalPhotonMap_t::~globalPhotonMap_t()
 {
-	if(tree) delete tree;
 }
 
 void globalPhotonMap_t::store(const storedPhoton_t &p)
@@ -109,52 +56,155 @@ void globalPhotonMap_t::store(const storedPhoton_t &p)
 	photons.push_back(p);
 }
 
-void globalPhotonMap_t::buildTree()
+/// Photons in a leaf, also the size of the distance buffer in gather()
+static const unsigned int LEAF_SIZE=16;
+static const float QSCALE=65535.0;
+
+struct compareAxis_f
 {
-	/*
-	photons.clear();
-	photons.reserve(hash.numBoxes());
-	int c=0;
-	for(hash3d_t<storedPhoton_t>::iterator i=hash.begin();
-			i!=hash.end();++i)
+	compareAxis_f(int a):axis(a) {};
+	bool operator () (const storedPhoton_t &a,const storedPhoton_t &b)const
 	{
-		if((*i).dir.null()) {c++;continue;}
-		photons.push_back(*i);
-		photons.back().dir.normalize();
+		return a.position()[axis]<b.position()[axis];
 	}
-	hash.clear();
-*/
-	vector<const storedPhoton_t *> lpho(photons.size());
-	for(unsigned int i=0;i<photons.size();++i)
-		lpho[i]=&photons[i];
+	int axis;
+};
 
-	if(tree!=NULL) delete tree;
-	tree=buildGenericTree(lpho,global_photon_calc_bound,global_photon_is_in_bound,
-				global_photon_get_pos,8);
+unsigned int globalPhotonMap_t::build(vector<storedPhoton_t> &v,
+		unsigned int begin,unsigned int end)
+{
+	unsigned int n=nodes.size();
+	nodes.push_back(node_t());
+	float mn[3],mx[3];
+	for(int a=0;a<3;++a) mn[a]=mx[a]=v[begin].position()[a];
+	for(unsigned int i=begin+1;i<end;++i)
+	{
+		const point3d_t &p=v[i].position();
+		for(int a=0;a<3;++a)
+		{
+			if(p[a]<mn[a]) mn[a]=p[a];
+			if(p[a]>mx[a]) mx[a]=p[a];
+		}
+	}
+	for(int a=0;a<3;++a)
+	{
+		nodes[n].min[a]=mn[a];
+		nodes[n].max[a]=mx[a];
+	}
+	if((end-begin)<=LEAF_SIZE)
+	{
+		nodes[n].first=colors.size();
+		nodes[n].count=end-begin;
+		float inv[3];
+		for(int a=0;a<3;++a) inv[a]=(mx[a]>mn[a]) ? QSCALE/(mx[a]-mn[a]) : 0.0;
+		for(unsigned int i=begin;i<end;++i)
+		{
+			const point3d_t &p=v[i].position();
+			qx.push_back((unsigned short)((p.x-mn[0])*inv[0]+0.5));
+			qy.push_back((unsigned short)((p.y-mn[1])*inv[1]+0.5));
+			qz.push_back((unsigned short)((p.z-mn[2])*inv[2]+0.5));
+			colors.push_back(v[i].c);
+			dirs.push_back(v[i].dir);
+		}
+		return n;
+	}
+	int axis=0;
+	if((mx[1]-mn[1])>(mx[axis]-mn[axis])) axis=1;
+	if((mx[2]-mn[2])>(mx[axis]-mn[axis])) axis=2;
+	unsigned int mid=(begin+end)/2;
+	nth_element(v.begin()+begin,v.begin()+mid,v.begin()+end,compareAxis_f(axis));
+	build(v,begin,mid);
+	unsigned int right=build(v,mid,end);
+	nodes[n].first=right;
+	nodes[n].count=0;
+	return n;
+}
 
+void globalPhotonMap_t::buildTree()
+{
+	vector<node_t>().swap(nodes);
+	vector<unsigned short>().swap(qx);
+	vector<unsigned short>().swap(qy);
+	vector<unsigned short>().swap(qz);
+	vector<rgbe_t>().swap(colors);
+	vector<octDir_t>().swap(dirs);
+	qx.reserve(photons.size());
+	qy.reserve(photons.size());
+	qz.reserve(photons.size());
+	colors.reserve(photons.size());
+	dirs.reserve(photons.size());
+	if(!photons.empty()) build(photons,0,photons.size());
+	vector<storedPhoton_t>().swap(photons);
 }
 
-struct searchCircle_t
+void globalPhotonMap_t::save(cacheWriter_t &cache)const
 {
-	searchCircle_t(const point3d_t &pp,PFLOAT r):point(pp),radius(r) {};
-	point3d_t point;
-	PFLOAT radius;
-};
+	cache.writeArray(nodes);
+	cache.writeArray(qx);
+	cache.writeArray(qy);
+	cache.writeArray(qz);
+	cache.writeArray(colors);
+	cache.writeArray(dirs);
+}
 
+bool globalPhotonMap_t::load(cacheReader_t &cache)
+{
+	cache.readArray(nodes);
+	cache.readArray(qx);
+	cache.readArray(qy);
+	cache.readArray(qz);
+	cache.readArray(colors);
+	cache.readArray(dirs);
+	return cache.ok();
+}
 
-struct circleCross_f
+static inline PFLOAT boxDistance2(const float *mn,const float *mx,const point3d_t &P)
 {
-	bool operator()(const searchCircle_t &c,const bound_t &b)const 
+	PFLOAT d2=0,t;
+	for(int a=0;a<3;++a)
 	{
-		point3d_t a,g;
-		b.get(a,g);
-		a+=-c.radius;
-		g+=c.radius;
-		bound_t bt(a,g);
-		return bt.includes(c.point);
-	};
-};
+		if(P[a]<mn[a]) {t=mn[a]-P[a];d2+=t*t;}
+		else if(P[a]>mx[a]) {t=P[a]-mx[a];d2+=t*t;}
+	}
+	return d2;
+}
 
+/** Squared distances from P to the n photons of a leaf. Positions are
+ * decoded on the fly, four at a time when SSE2 is available.
+ */
+static inline void leafDistances(const unsigned short *x,const unsigned short *y,
+		const unsigned short *z,unsigned int n,const float *mn,const float *mx,
+		const point3d_t &P,float *d2)
+{
+	float sx=(mx[0]-mn[0])*(1.0/QSCALE);
+	float sy=(mx[1]-mn[1])*(1.0/QSCALE);
+	float sz=(mx[2]-mn[2])*(1.0/QSCALE);
+	float px=P.x-mn[0],py=P.y-mn[1],pz=P.z-mn[2];
+	unsigned int i=0;
+#ifdef __SSE2__
+	const __m128i zero=_mm_setzero_si128();
+	const __m128 vsx=_mm_set1_ps(sx),vsy=_mm_set1_ps(sy),vsz=_mm_set1_ps(sz);
+	const __m128 vpx=_mm_set1_ps(px),vpy=_mm_set1_ps(py),vpz=_mm_set1_ps(pz);
+	for(;(i+4)<=n;i+=4)
+	{
+		__m128 dx=_mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(
+							_mm_loadl_epi64((const __m128i *)(x+i)),zero)),vsx),vpx);
+		__m128 dy=_mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(
+							_mm_loadl_epi64((const __m128i *)(y+i)),zero)),vsy),vpy);
+		__m128 dz=_mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(
+							_mm_loadl_epi64((const __m128i *)(z+i)),zero)),vsz),vpz);
+		_mm_storeu_ps(d2+i,_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx),_mm_mul_ps(dy,dy)),
+					_mm_mul_ps(dz,dz)));
+	}
+#endif
+	for(;i<n;++i)
+	{
+		float dx=(float)x[i]*sx-px;
+		float dy=(float)y[i]*sy-py;
+		float dz=(float)z[i]*sz-pz;
+		d2[i]=dx*dx+dy*dy+dz*dz;
+	}
+}
 
 struct compareFound_f
 {
@@ -170,6 +220,9 @@ void globalPhotonMap_t::gather(const point3d_t &P,const vector3d_t &N,
 {
 	foundPhoton_t temp;
 	compareFound_f cfound;
+	float d2[LEAF_SIZE];
+	// balanced tree, 64 levels are more photons than memory can hold
+	unsigned int stack[64];
 	//found.reserve(K+1);
 	unsigned int reached=0;
 	while((reached<K) && (radius<=maxradius))
@@ -177,28 +230,47 @@ void globalPhotonMap_t::gather(const point3d_t &P,const vector3d_t &N,
 		reached=0;
 		//found.clear();
 		found.resize(0);
-		searchCircle_t circle(P,radius);
-		for(gObjectIterator_t<const storedPhoton_t *,searchCircle_t,circleCross_f> 
-				i(tree,circle);!i;++i)
+		PFLOAT r2=radius*radius;
+		int top=0;
+		if(!nodes.empty()) stack[top++]=0;
+		while(top>0)
 		{
-			vector3d_t sep=(*i)->position()-P;
-			CFLOAT D=sep.length();
-			if((D>radius) || (((*i)->direction()*N)<=mincos)) continue;
-			reached++;
-			temp.photon=*i;
-			temp.dis=D;
-			if((found.size()==K) && (temp.dis>found.front().dis)) continue;
-			if(found.size()==K)
+			unsigned int cur=stack[--top];
+			const node_t &node=nodes[cur];
+			if(boxDistance2(node.min,node.max,P)>r2) continue;
+			if(node.count==0)
 			{
-				found.push_back(temp);
-				push_heap(found.begin(),found.end(),cfound);
-				pop_heap(found.begin(),found.end(),cfound);
-				found.pop_back();
+				stack[top++]=node.first;
+				stack[top++]=cur+1;
+				continue;
 			}
-			else
+			unsigned int f=node.first;
+			leafDistances(&qx[f],&qy[f],&qz[f],node.count,node.min,node.max,P,d2);
+			for(unsigned int i=0;i<node.count;++i)
 			{
-				found.push_back(temp);
-				push_heap(found.begin(),found.end(),cfound);
+				if(d2[i]>r2) continue;
+				const octDir_t &dir=dirs[f+i];
+				if((dir.get()*N)<=mincos) continue;
+				reached++;
+				temp.dis=sqrt(d2[i]);
+				if((found.size()==K) && (temp.dis>found.front().dis)) continue;
+				PFLOAT sx=(node.max[0]-node.min[0])*(1.0/QSCALE);
+				PFLOAT sy=(node.max[1]-node.min[1])*(1.0/QSCALE);
+				PFLOAT sz=(node.max[2]-node.min[2])*(1.0/QSCALE);
+				temp.photon=storedPhoton_t(point3d_t(node.min[0]+qx[f+i]*sx,
+							node.min[1]+qy[f+i]*sy,node.min[2]+qz[f+i]*sz),colors[f+i],dir);
+				if(found.size()==K)
+				{
+					found.push_back(temp);
+					push_heap(found.begin(),found.end(),cfound);
+					pop_heap(found.begin(),found.end(),cfound);
+					found.pop_back();
+				}
+				else
+				{
+					found.push_back(temp);
+					push_heap(found.begin(),found.end(),cfound);
+				}
 			}
 		}
 		if(reached<K) radius*=2;
@@ -9,41 +9,54 @@
 #include "hash3d.h"
 #include "params.h"
 #include "scene.h"
+#include "mapfile.h"
 
 __BEGIN_YAFRAY
 
 
-class dirConverter_t
+/** Unit vector stored on the octahedron, two 16 bit coordinates.
+ *
+ * The direction is projected on the octahedron |x|+|y|+|z|=1 and the
+ * lower half is folded over the upper one, so the whole sphere maps to a
+ * square. Decoding needs no tables nor trigonometry, only a normalize.
+ * The coordinates go up to 65534, 0xffff marks the null vector.
+ */
+class octDir_t
 {
 	public:
-		dirConverter_t();
-
-		vector3d_t convert(unsigned char theta,unsigned char phi)
+		octDir_t() {u=v=0xffff;};
+		octDir_t(const vector3d_t &d) {set(d);};
+		bool null()const {return (u==0xffff) && (v==0xffff);};
+		void set(const vector3d_t &d)
 		{
-			return vector3d_t(sintheta[theta]*cosphi[phi],
-												sintheta[theta]*sinphi[phi],
-												costheta[theta]);
+			if(d.null()) {u=v=0xffff;return;}
+			PFLOAT l=1.0/(fabs(d.x)+fabs(d.y)+fabs(d.z));
+			PFLOAT x=d.x*l,y=d.y*l;
+			if(d.z<0) fold(x,y);
+			u=(unsigned short)((x+1.0)*(0.5*65534.0)+0.5);
+			v=(unsigned short)((y+1.0)*(0.5*65534.0)+0.5);
 		}
-		std::pair<unsigned char,unsigned char> convert(const vector3d_t &dir)
+		vector3d_t get()const
 		{
-			int t=(int)(acos(dir.z)*(255.0/M_PI));
-			int p=(int)(atan2(dir.y,dir.x)*(256.0/(2.0*M_PI)));
-			if(t>254) t=254;
-			else if(t<0) t=0;
-			if(p>255) p=255;
-			else if(p<0) p+=256;
-			return std::pair<unsigned char,unsigned char>(t,p);
+			if(null()) return vector3d_t(0,0,0);
+			PFLOAT x=(PFLOAT)u*(2.0/65534.0)-1.0;
+			PFLOAT y=(PFLOAT)v*(2.0/65534.0)-1.0;
+			PFLOAT z=1.0-fabs(x)-fabs(y);
+			if(z<0) fold(x,y);
+			vector3d_t d(x,y,z);
+			d.normalize();
+			return d;
 		}
-		
 	protected:
-		PFLOAT cosphi[256];
-		PFLOAT sinphi[256];
-		PFLOAT costheta[255];
-		PFLOAT sintheta[255];
+		static void fold(PFLOAT &x,PFLOAT &y)
+		{
+			PFLOAT ox=x;
+			x=(1.0-fabs(y))*((ox>=0) ? 1.0 : -1.0);
+			y=(1.0-fabs(ox))*((y>=0) ? 1.0 : -1.0);
+		}
+		unsigned short u,v;
 };
 
-extern dirConverter_t dirconverter;
-
 class storedPhoton_t;
 
 class YAFRAYCORE_EXPORT runningPhoton_t
@@ -72,84 +85,91 @@ class YAFRAYCORE_EXPORT storedPhoton_t
 {
 	friend class globalPhotonMap_t;
 	public:
-		storedPhoton_t() {theta=255;};
+		storedPhoton_t() {};
 		storedPhoton_t(const vector3d_t &d,const point3d_t &p,
 				const color_t &col)
 		{
 			direction(d);
 			pos=p;
 			c=col;};
+		storedPhoton_t(const point3d_t &p,const rgbe_t &col,const octDir_t &d):
+			pos(p),c(col),dir(d) {};
 		storedPhoton_t(const runningPhoton_t &p)
 		{
 			pos=p.pos;
 			c=p.c;
-			vector3d_t dir=p.lastpos-p.pos;
-			dir.normalize();
-			direction(dir);
+			vector3d_t d=p.lastpos-p.pos;
+			d.normalize();
+			direction(d);
 		};
 		const point3d_t & position()const {return pos;};
 		const color_t color()const {return c;};
 		void color(const color_t &col) {c=col;};
-		const vector3d_t direction()const 
-		{
-			if(theta==255) return vector3d_t(0,0,0);
-			else return dirconverter.convert(theta,phi);
-		};
-		void direction(const vector3d_t &dir)
-		{
-			if(dir.null()) theta=255;
-			else
-			{
-				std::pair<unsigned char,unsigned char> cd=dirconverter.convert(dir);
-				theta=cd.first;
-				phi=cd.second;
-			}
-		}
+		const vector3d_t direction()const {return dir.get();};
+		void direction(const vector3d_t &d) {dir.set(d);};
 	protected:
 		point3d_t pos;
 		rgbe_t c;
-		unsigned char theta,phi;
+		octDir_t dir;
 };
 
+/// The photon is a decoded copy, the map does not keep storedPhoton_t records
 struct foundPhoton_t
 {
-	const storedPhoton_t *photon;
+	storedPhoton_t photon;
 	PFLOAT dis;
 };
 
 
+/** Photon map for the global illumination lights.
+ *
+ * Photons are stored as they come and packed by buildTree() in a flat
+ * kd-tree, as a structure of arrays sorted by leaf. Positions are 16 bit
+ * fixed point inside the bound of their leaf, colors keep the shared
+ * exponent of rgbe_t and directions are octahedral. That is 14 bytes a
+ * photon, where a storedPhoton_t plus its tree pointer took 28 or more.
+ */
 class YAFRAYCORE_EXPORT globalPhotonMap_t
 {
 	public:
-
-		typedef std::vector<storedPhoton_t>::iterator iterator;
-		typedef std::vector<storedPhoton_t>::const_iterator const_iterator;
-		
 		globalPhotonMap_t(PFLOAT r);
 		~globalPhotonMap_t();
 
 		//void store(const runningPhoton_t &p,const vector3d_t &N);
 		void store(const storedPhoton_t &p);
+		/// Packs the photons stored so far, replacing the previous content
 		void buildTree();
 
 		void gather(const point3d_t &P,const vector3d_t &N,
 				std::vector<foundPhoton_t> &found,
 				unsigned int K,PFLOAT &radius,PFLOAT mincos=0.0)const;
 
-		int count()const {return photons.size();};
+		int count()const {return colors.size();};
 		PFLOAT getMaxRadius()const {return maxradius;};
 
-		iterator begin() {return photons.begin();}; 
-		const_iterator begin()const {return photons.begin();}; 
-		iterator end() {return photons.end();}; 
-		const_iterator end()const {return photons.end();}; 
+		/// The packed map is written as is, loading needs no tree build
+		void save(cacheWriter_t &cache)const;
+		bool load(cacheReader_t &cache);
 
 	protected:
 		globalPhotonMap_t(const globalPhotonMap_t &s) {}; //forbiden
+		/** Node of the flat tree. The left child follows its parent, first
+		 * is the right child for inner nodes and the first photon for
+		 * leaves. Leaves have count>0. */
+		struct node_t
+		{
+			float min[3],max[3];
+			unsigned int first,count;
+		};
+		unsigned int build(std::vector<storedPhoton_t> &v,unsigned int begin,unsigned int end);
 		PFLOAT maxradius;
 		//hash3d_t<storedPhoton_t> hash;
+		/// Photons waiting for buildTree()
 		std::vector<storedPhoton_t> photons;
-		gBoundTreeNode_t<const storedPhoton_t *> *tree;
+		std::vector<node_t> nodes;
+		std::vector<unsigned short> qx,qy,qz;
+		std::vector<rgbe_t> colors;
+		std::vector<octDir_t> dirs;
 };
 
 
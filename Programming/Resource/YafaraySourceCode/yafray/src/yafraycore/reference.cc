@@ -163,6 +163,14 @@ bound_t referenceObject_t::getBound() const
 	return bound;
 }
 
+void referenceObject_t::hashGeometry(keyHash_t &h) const
+{
+	object3d_t::hashGeometry(h);
+	original->hashGeometry(h);
+	for(int i=0;i<4;++i)
+		for(int j=0;j<4;++j) h.add(M[i][j]);
+}
+
 referenceObject_t * referenceObject_t::factory(const matrix4x4_t &M,object3d_t *org)
 {
 	return new referenceObject_t(M, org);
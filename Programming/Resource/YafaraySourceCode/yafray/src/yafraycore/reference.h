@@ -18,6 +18,7 @@ class YAFRAYCORE_EXPORT referenceObject_t : public object3d_t
 		virtual bool shoot(renderState_t &state,surfacePoint_t &where, const point3d_t &from,
 				const vector3d_t &ray,bool shadow=false,PFLOAT dis=-1)const;
 		virtual bound_t getBound() const;
+		virtual void hashGeometry(keyHash_t &h) const;
 
 		static referenceObject_t *factory(const matrix4x4_t &M,object3d_t *org);
 	protected:
@@ -28,6 +28,8 @@
 #include "ipc.h"
 #include "renderblock.h"
 #include "geometree.h"
+#include "lighttree.h"
+#include <algorithm>
 
 
 using namespace std;
@@ -38,7 +40,7 @@ int bcount;
 int pcount;
 
 renderState_t::renderState_t() :raylevel(0),depth(0),contribution(1.0),/*lastobject(NULL)
-	,lastobjectelement(NULL),*/ skipelement(NULL),currentPass(0),rayDivision(1),traveled(0)
+	,lastobjectelement(NULL),*/ skipelement(NULL),currentPass(0),rayDivision(1),rayWidth(0),raySpread(0),traveled(0)
 	,pixelNumber(0), chromatic(true), cur_ior(1)
 {
 }
@@ -57,6 +59,11 @@ scene_t::scene_t()
 	maxraylevel=3;
 	world_resolution=1.0;
 	radio_light=NULL;
+	light_tree=NULL;
+	light_samples=0;
+	shadow_threshold=0;
+	ray_differentials=false;
+	deferred=false;
 	BTree=NULL;
 	background=NULL;
 	repeatFirst=false;
@@ -68,6 +75,7 @@ scene_t::scene_t()
 
 scene_t::~scene_t()
 {
+	if(light_tree!=NULL) delete light_tree;
 	/*
 	for(list<object3d_t *>::iterator ite=obj_list.begin();
 			ite!=obj_list.end();ite++)
@@ -97,6 +105,13 @@ void scene_t::publishVoidData(const std::string &key,const void *data)
 	published[key]=data;
 }
 
+void scene_t::hashGeometry(keyHash_t &h)const
+{
+	h.add((unsigned int)obj_list.size());
+	for(list<object3d_t *>::const_iterator i=obj_list.begin();i!=obj_list.end();++i)
+		(*i)->hashGeometry(h);
+}
+
 void scene_t::setCamera(camera_t *cam)
 {
 	render_camera=cam;
@@ -197,19 +212,10 @@ void scene_t::fog_addToCol(CFLOAT depth, color_t &curcol) const
 	}
 }
 
-color_t scene_t::raytrace(renderState_t &state, const point3d_t &from, const vector3d_t & ray)const
+bool scene_t::closestHit(renderState_t &state,surfacePoint_t &sp,const point3d_t &f,
+		const vector3d_t &ray)const
 {
-	int &l_raylevel=state.raylevel;
-	CFLOAT &l_depth=state.depth;
-	++l_raylevel;
-	if(l_raylevel>=maxraylevel)
-	{
-		l_raylevel--;
-		l_depth=-1;
-		return color_t(0,0,0);
-	}
-	point3d_t f=from+ray*min_raydis;
-	surfacePoint_t sp,temp;
+	surfacePoint_t temp;
 	bool found=false;
 	//for(objectIterator_t ite(*BTree,f,ray);!ite;ite++)
 	PFLOAT limit=numeric_limits<PFLOAT>::infinity();
@@ -230,33 +236,69 @@ color_t scene_t::raytrace(renderState_t &state, const point3d_t &from, const vec
 			}
 		}
 	}
-	// need to set screen position in calculated surfacepoint here for possible win texmap.
-	sp.setScreenPos(state.screenpos);
-	if(found && (sp.getShader()!=NULL))
+	return found;
+}
+
+color_t scene_t::shadeHit(renderState_t &state,surfacePoint_t &sp,const point3d_t &from)const
+{
+	vector3d_t eye = from-sp.P();	// also now needed in displace
+	eye.normalize();
+	PFLOAT oldtraveled = state.traveled;
+	state.traveled += sp.Z();
+	PFLOAT oldwidth = state.rayWidth;
+	if ((state.rayWidth>0) || (state.raySpread>0))
 	{
-		vector3d_t eye = from-sp.P();	// also now needed in displace
-		eye.normalize();
-		PFLOAT oldtraveled = state.traveled;
-		state.traveled += sp.Z();
-		sp.getShader()->displace(state, sp, eye, world_resolution);
-		color_t res=light(state,sp,from);
-		l_raylevel--;
-		l_depth = (from-sp.P()).length();
-		// add simple fog if enabled
-		fog_addToCol(l_depth, res);
-		state.traveled = oldtraveled;
-		return res;
+		// the cone keeps its width across the axis facing the ray and is
+		// stretched along the other, this is the mean of both
+		PFLOAT w = state.rayWidth + state.raySpread*(from-sp.P()).length();
+		PFLOAT c = fabs(eye*sp.Ng());
+		if (c<0.01) c = 0.01;
+		sp.setFootprint(w/sqrt(c));
+		// secondary rays start as wide as the cone is here
+		state.rayWidth = w;
 	}
-	l_raylevel--;
-	l_depth=-1;
+	sp.getShader()->displace(state, sp, eye, world_resolution);
+	color_t res=light(state,sp,from);
+	state.raylevel--;
+	state.depth = (from-sp.P()).length();
+	// add simple fog if enabled
+	fog_addToCol(state.depth, res);
+	state.traveled = oldtraveled;
+	state.rayWidth = oldwidth;
+	return res;
+}
+
+color_t scene_t::shadeMiss(renderState_t &state,const vector3d_t &ray)const
+{
+	state.raylevel--;
+	state.depth=-1;
 	// don't include background if alpha_maskbackground flag set (only primary rays)
 	color_t bg(0.0);
-	if (!(alpha_maskbackground && (l_raylevel!=0))) bg = getBackground(ray, state);
+	if (!(alpha_maskbackground && (state.raylevel!=0))) bg = getBackground(ray, state);
 	// add simple fog if enabled
-	fog_addToCol(l_depth, bg);
+	fog_addToCol(state.depth, bg);
 	return bg;
 }
 
+color_t scene_t::raytrace(renderState_t &state, const point3d_t &from, const vector3d_t & ray)const
+{
+	int &l_raylevel=state.raylevel;
+	CFLOAT &l_depth=state.depth;
+	++l_raylevel;
+	if(l_raylevel>=maxraylevel)
+	{
+		l_raylevel--;
+		l_depth=-1;
+		return color_t(0,0,0);
+	}
+	surfacePoint_t sp;
+	bool found=closestHit(state,sp,from+ray*min_raydis,ray);
+	// need to set screen position in calculated surfacepoint here for possible win texmap.
+	sp.setScreenPos(state.screenpos);
+	if(found && (sp.getShader()!=NULL)) return shadeHit(state,sp,from);
+	return shadeMiss(state,ray);
+}
+
 color_t scene_t::light(renderState_t &state,const surfacePoint_t &sp,const point3d_t &from,
 		bool indirect)const
 {
@@ -265,17 +307,100 @@ color_t scene_t::light(renderState_t &state,const surfacePoint_t &sp,const point
 			return color_t(0,0,0);
 		color_t flights(0,0,0);
 		vector3d_t eye=from-sp.P();
-		for(list<light_t *>::const_iterator ite=light_list.begin();
-				ite!=light_list.end();++ite)
+		const list<light_t *> &lights=(light_tree!=NULL) ? free_lights : light_list;
+		if(shadow_threshold>0) flights+=adaptiveLight(state,sp,eye,lights,indirect);
+		else
+		for(list<light_t *>::const_iterator ite=lights.begin();
+				ite!=lights.end();++ite)
 		{
 			if(!indirect && !((*ite)->useInRender())) continue;
 			if(indirect && !((*ite)->useInIndirect())) continue;
 			flights+=(*ite)->illuminate(state,*this,sp,eye);
 		}
+		if(light_tree!=NULL) flights+=light_tree->illuminate(state,*this,sp,eye,light_samples);
 		if(!indirect) flights+=sha->fromWorld(state,sp,*this,eye);
 		return flights;
 }
 
+struct shadowTest_t
+{
+	color_t lit;
+	CFLOAT weight;
+	point3d_t to;
+	/// Sorts the strongest first
+	bool operator < (const shadowTest_t &t)const {return weight>t.weight;};
+};
+
+/** Per thread scratch list of the lights waiting for a shadow test.
+ * illuminate() may shade other points on the same state, each call only
+ * uses the tests it adds at the end and drops them when it is done.
+ */
+struct shadowTests_t : public context_t::destructible
+{
+	virtual ~shadowTests_t() {};
+	vector<shadowTest_t> tests;
+};
+
+color_t scene_t::adaptiveLight(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
+		const list<light_t *> &lights,bool indirect)const
+{
+	bool present;
+	shadowTests_t *scratch=state.context.getDestructible(_shadowtests,present);
+	if(!present)
+	{
+		scratch=new shadowTests_t;
+		state.context.storeDestructible(_shadowtests,scratch);
+	}
+	vector<shadowTest_t> &tests=scratch->tests;
+	const unsigned int first=tests.size();
+
+	color_t flights(0.0);
+	CFLOAT total=0;
+	shadowTest_t t;
+	color_t extra;
+	for(list<light_t *>::const_iterator ite=lights.begin();ite!=lights.end();++ite)
+	{
+		if(!indirect && !((*ite)->useInRender())) continue;
+		if(indirect && !((*ite)->useInIndirect())) continue;
+		if(!(*ite)->unshadowed(state,*this,sp,eye,t.lit,extra,t.to))
+		{
+			flights+=(*ite)->illuminate(state,*this,sp,eye);
+			continue;
+		}
+		flights+=extra;
+		t.weight=t.lit.energy();
+		if(t.weight<=0) continue;
+		total+=t.weight;
+		tests.push_back(t);
+	}
+	const unsigned int end=tests.size();
+	if(end==first) return flights;
+	sort(tests.begin()+first,tests.end());
+
+	const void *oldorigin=state.skipelement;
+	state.skipelement=sp.getOrigin();
+	CFLOAT tested=0,visible=0,left=total;
+	unsigned int i=first;
+	for(;(i<end) && (left>shadow_threshold*total);++i)
+	{
+		tested+=tests[i].weight;
+		left-=tests[i].weight;
+		if(isShadowed(state,sp,tests[i].to)) continue;
+		visible+=tests[i].weight;
+		flights+=tests[i].lit;
+	}
+	state.skipelement=oldorigin;
+	// the rest are guessed as visible as the tested ones
+	color_t rest(0.0);
+	if((i<end) && (visible>0))
+	{
+		for(;i<end;++i) rest+=tests[i].lit;
+		flights+=rest*(visible/tested);
+	}
+	tests.resize(first);
+	return flights;
+}
+
 void scene_t::setupLights()
 {
 	fprintf(stderr,"Setting up lights ...\n");
@@ -284,9 +409,35 @@ void scene_t::setupLights()
 	{
 		(*ite)->init(*this);
 	}
+	if(light_samples>0) buildLightTree();
 	fprintf(stderr,"Finished setting up lights\n");
 }
 
+void scene_t::buildLightTree()
+{
+	if(light_tree!=NULL) delete light_tree;
+	light_tree=NULL;
+	free_lights.clear();
+	// only lights used everywhere can share the tree
+	vector<light_t *> bounded;
+	lightBound_t b;
+	for(list<light_t *>::iterator i=light_list.begin();i!=light_list.end();++i)
+	{
+		if((*i)->useInRender() && (*i)->useInIndirect() && (*i)->emissionBound(b))
+			bounded.push_back(*i);
+		else free_lights.push_back(*i);
+	}
+	// not worth it when every light would be sampled anyway
+	if((int)bounded.size()<=light_samples)
+	{
+		free_lights.clear();
+		return;
+	}
+	light_tree=new lightTree_t(bounded);
+	fprintf(stderr,"Light tree with %d lights, %d samples per point\n",
+			light_tree->size(),light_samples);
+}
+
 void scene_t::postSetupLights()
 {
 	for(list<light_t *>::iterator ite=light_list.begin();ite!=light_list.end();
@@ -721,6 +872,83 @@ bool scene_t::firstHit(renderState_t &state,surfacePoint_t &sp,const point3d_t &
 }
 
 
+bool scene_t::deferRay(renderState_t &state,const vector3d_t &ray,deferredHit_t &hit,
+		colorA_t &col)const
+{
+	int &l_raylevel=state.raylevel;
+	if(++l_raylevel>=maxraylevel)
+	{
+		l_raylevel--;
+		state.depth=-1;
+		col=color_t(0,0,0);
+		return false;
+	}
+	surfacePoint_t sp;
+	if(!closestHit(state,sp,render_camera->position()+ray*min_raydis,ray) || (sp.getShader()==NULL))
+	{
+		col=shadeMiss(state,ray);
+		return false;
+	}
+	l_raylevel--;
+	hit.shader=sp.getShader();
+	hit.object=sp.getObject();
+	hit.element=sp.getOrigin();
+	hit.Z=sp.Z();
+	hit.ray=ray;
+	hit.screenpos=state.screenpos;
+	hit.rayWidth=state.rayWidth;
+	hit.raySpread=state.raySpread;
+	hit.pass=state.currentPass;
+	return true;
+}
+
+void scene_t::shadeDeferred(renderState_t &state,vector<deferredHit_t> &hits,
+		renderArea_t &area,colorA_t *acc)const
+{
+	// numbered in the order of the hits, so every run shades in the same order
+	map<const shader_t *,int> rank;
+	for(vector<deferredHit_t>::iterator h=hits.begin();h!=hits.end();++h)
+	{
+		map<const shader_t *,int>::iterator r=rank.find(h->shader);
+		if(r==rank.end()) r=rank.insert(make_pair(h->shader,(int)rank.size())).first;
+		h->rank=r->second;
+	}
+	stable_sort(hits.begin(),hits.end());
+
+	const point3d_t &from=render_camera->position();
+	surfacePoint_t sp;
+	colorA_t fcol;
+	for(vector<deferredHit_t>::const_iterator h=hits.begin();h!=hits.end();++h)
+	{
+		int j=area.X+h->pixel%area.W, i=area.Y+h->pixel/area.W;
+		// the state the camera ray had when it was traced
+		state.screenpos=h->screenpos;
+		state.rayWidth=h->rayWidth;
+		state.raySpread=h->raySpread;
+		state.pixelNumber=j+i*render_camera->resX();
+		state.currentPass=h->pass;
+		state.contribution=1.0;
+		state.chromatic=true;
+		state.cur_ior=1.0;
+		state.raylevel=0;
+		if(h->object->surface(state,sp,h->element,from+h->ray*min_raydis,h->ray,h->Z))
+		{
+			sp.setScreenPos(state.screenpos);
+			fcol=shadeHit(state,sp,from);
+		}
+		else fcol=shadeMiss(state,h->ray);
+		if (do_tonemap) fcol.expgam_Adjust(exposure, gamma_R, clamp_rgb);
+		if (state.depth>=0) fcol.setAlpha(1.0); else fcol.setAlpha(0.0);
+		if(acc!=NULL)
+			acc[h->pixel]+=fcol;
+		else
+		{
+			area.imagePixel(j,i) = fcol;
+			area.depthPixel(j,i) = state.depth;
+		}
+	}
+}
+
 void scene_t::render(renderArea_t &area) const
 {
 	renderState_t state;
@@ -736,6 +964,12 @@ void scene_t::render(renderArea_t &area) const
 
 	PFLOAT fx=0.5, fy=0.5;
 
+	// camera hits of the current pass, when shading is deferred
+	vector<deferredHit_t> hits;
+	deferredHit_t hit;
+	vector<colorA_t> acc;
+	vector<int> num;
+
 	//First pass
 	unsigned int sc1=0, sc2=0;
 	PFLOAT wt;
@@ -753,13 +987,22 @@ void scene_t::render(renderArea_t &area) const
 			{
 				state.raylevel = -1;
 				vector3d_t ray = render_camera->shootRay((PFLOAT)j+fx, (PFLOAT)i+fy, wt);
+				if (ray_differentials)
+					render_camera->rayCone((PFLOAT)j+fx, (PFLOAT)i+fy, state.rayWidth, state.raySpread);
 				contri = 1.0;
 				globalpass = 0;
 				state.pixelNumber = j+i*resx;
 				if (wt!=0.0) {
 					chroma = true;
 					cur_ior = 1.0;
-					fcol = raytrace(state, render_camera->position(), ray);
+					if (deferred) {
+						if (deferRay(state, ray, hit, fcol)) {
+							hit.pixel = (i-area.Y)*area.W + (j-area.X);
+							hits.push_back(hit);
+							continue;
+						}
+					}
+					else fcol = raytrace(state, render_camera->position(), ray);
 					if (do_tonemap) fcol.expgam_Adjust(exposure, gamma_R, clamp_rgb);
 					if (pdep>=0) fcol.setAlpha(1.0); else fcol.setAlpha(0.0);
 					area.imagePixel(j,i) = fcol;
@@ -772,12 +1015,18 @@ void scene_t::render(renderArea_t &area) const
 			}
 			else area.imagePixel(j,i)=colorA_t(0.0);
 		}
+	if (!hits.empty()) shadeDeferred(state, hits, area, NULL);
 
 	PFLOAT totsamdiv = AA_minsamples*AA_passes;
 	if (totsamdiv!=0) totsamdiv = 1.0/totsamdiv;
 	for (int pass=0;pass<AA_passes;pass++)
 	{
 		area.checkResample(AA_threshold);
+		if (deferred) {
+			hits.clear();
+			acc.assign(area.W*area.H, colorA_t(0.0));
+			num.assign(area.W*area.H, 0);
+		}
 		for (int i=area.Y;i<(area.Y+area.H);++i)
 			for (int j=area.X;j<(area.X+area.W);++j)
 			{
@@ -798,21 +1047,48 @@ void scene_t::render(renderArea_t &area) const
 					state.screenpos.set(2.0*(((PFLOAT)j+fx)/(PFLOAT)resx)-1.0, 
 							1.0-2.0*(((PFLOAT)i+fy)/(PFLOAT)resy), 0);
 					vector3d_t ray = render_camera->shootRay((PFLOAT)j+fx, (PFLOAT)i+fy, wt);
+					if (ray_differentials)
+						render_camera->rayCone((PFLOAT)j+fx, (PFLOAT)i+fy, state.rayWidth, state.raySpread);
 					if ((wt!=0.0) && (state.screenpos.x>=scxmin) && (state.screenpos.x<scxmax) &&
 							(state.screenpos.y>=scymin) && (state.screenpos.y<scymax))
 					{
 						chroma = true;
 						cur_ior = 1.0;
-						fcol = raytrace(state,render_camera->position(), ray);
+						totnumsam++;
+						if (deferred) {
+							if (deferRay(state, ray, hit, fcol)) {
+								hit.pixel = (i-area.Y)*area.W + (j-area.X);
+								hits.push_back(hit);
+								continue;
+							}
+						}
+						else fcol = raytrace(state,render_camera->position(), ray);
 						if (do_tonemap) fcol.expgam_Adjust(exposure, gamma_R, clamp_rgb);
 						if (pdep>=0) fcol.setAlpha(1.0); else fcol.setAlpha(0.0);
 						totcol += fcol;
-						totnumsam++;
 					}
 				}
+				if (deferred) {
+					// blended in once the hits are shaded
+					int p = (i-area.Y)*area.W + (j-area.X);
+					acc[p] = totcol;
+					num[p] = totnumsam;
+					continue;
+				}
 				CFLOAT mf = (CFLOAT)(pass*totnumsam+1);
 				area.imagePixel(j,i) = (mf*area.imagePixel(j,i) + totcol) / (mf+(CFLOAT)totnumsam);
 			}
+		if (deferred) {
+			if (!hits.empty()) shadeDeferred(state, hits, area, &acc[0]);
+			for (int i=area.Y;i<(area.Y+area.H);++i)
+				for (int j=area.X;j<(area.X+area.W);++j)
+				{
+					if (!area.resamplePixel(j,i)) continue;
+					int p = (i-area.Y)*area.W + (j-area.X);
+					CFLOAT mf = (CFLOAT)(pass*num[p]+1);
+					area.imagePixel(j,i) = (mf*area.imagePixel(j,i) + acc[p]) / (mf+(CFLOAT)num[p]);
+				}
+		}
 	}
 
 	if (alpha_premultiply) {
@@ -841,6 +1117,8 @@ void scene_t::fakeRender(renderArea_t &area)const
 			state.screenpos.set(2.0*(((PFLOAT)j+0.5)/(PFLOAT)resx)-1.0, 
 					1.0-2.0*(((PFLOAT)i+0.5)/(PFLOAT)resy), 0);
 			vector3d_t ray = render_camera->shootRay((PFLOAT)j+0.5, (PFLOAT)i+0.5, wt);
+			if (ray_differentials)
+				render_camera->rayCone((PFLOAT)j+0.5, (PFLOAT)i+0.5, state.rayWidth, state.raySpread);
 			contri = 1.0;
 			globalpass = 0;
 			state.pixelNumber = j+i*resx;
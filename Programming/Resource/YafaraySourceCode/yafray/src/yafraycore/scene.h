@@ -41,11 +41,14 @@
 #include <list>
 
 #include "tools.h"
+#include "mapfile.h"
 
 __BEGIN_YAFRAY
 class renderArea_t;
 class scene_t;
 class object3d_t;
+class lightTree_t;
+struct shadowTests_t;
 template<class T> class geomeTree_t;
 
 struct YAFRAYCORE_EXPORT renderState_t
@@ -61,6 +64,8 @@ struct YAFRAYCORE_EXPORT renderState_t
 	const void *skipelement;
 	int currentPass;
 	int rayDivision;
+	/// Width and spread angle of the cone around the current ray, 0 if unknown
+	PFLOAT rayWidth, raySpread;
 	context_t context;
 	PFLOAT traveled;
 	int pixelNumber;
@@ -94,6 +99,25 @@ __END_YAFRAY
 
 __BEGIN_YAFRAY
 
+/** Primary hit waiting to be shaded, only what is needed to rebuild the
+ * surface point and the state its camera ray had.
+ */
+struct deferredHit_t
+{
+	const shader_t *shader;
+	const object3d_t *object;
+	/// What the object hit, the triangle for meshes
+	const void *element;
+	PFLOAT Z;
+	vector3d_t ray;
+	point3d_t screenpos;
+	PFLOAT rayWidth,raySpread;
+	/// Pixel inside the render area and sample pass
+	int pixel,pass;
+	/// Shaders are numbered in the order the area first met them
+	int rank;
+	bool operator < (const deferredHit_t &h)const {return rank<h.rank;};
+};
 
 class YAFRAYCORE_EXPORT scene_t
 {
@@ -155,8 +179,45 @@ class YAFRAYCORE_EXPORT scene_t
 			if (background==NULL) return color_t(0.0);
 			return (*background)(dir, state, filtered);
 		}
+		const envSampler_t *backgroundSampler() const
+		{
+			if (background==NULL) return NULL;
+			return background->sampler();
+		}
+
+		/** Lights picked per shading point from the light tree.
+		 *
+		 * With 0, the default, every light is evaluated at every point.
+		 * Otherwise the lights with emission bounds go in a tree and only
+		 * that many are sampled, weighted so the average stays the same.
+		 */
+		void setLightSamples(int n) {light_samples=n;};
+		/** Adaptive shadow testing, after Ward.
+		 *
+		 * Lights are sorted by unshadowed contribution and shadow rays are
+		 * traced in that order until the untested ones add up to less than
+		 * this fraction of the total. Their visibility is then guessed from
+		 * the tested ones. 0, the default, tests every light.
+		 */
+		void setShadowThreshold(PFLOAT t) {shadow_threshold=t;};
+		/** Ray cones for texture filtering.
+		 *
+		 * Camera rays carry the cone the pixel sees and each hit turns
+		 * it into a footprint on the surface point, which textures use
+		 * to pick a mip level or drop noise octaves. Reflected and
+		 * refracted rays start with the width of the cone at the hit.
+		 */
+		void setRayDifferentials(bool r) {ray_differentials=r;};
+		/** Deferred shading of camera rays.
+		 *
+		 * Each render area first traces all the camera rays of a pass and
+		 * keeps the hits, then shades them grouped by shader, so the same
+		 * shader and textures run back to back. Misses are shaded at once.
+		 */
+		void setDeferredShading(bool d) {deferred=d;};
 
 		void setCPUs(const int num) { cpus = num; }
+		int getCPUs() const { return cpus; }
 
 		// gamma & exposure
 		void setGamma(CFLOAT g) { gamma_R=0.0;  if (g!=0.0) gamma_R=1.0/g; }
@@ -191,6 +252,7 @@ class YAFRAYCORE_EXPORT scene_t
 		bool getRepeatFirst()const {return repeatFirst;};
 		PFLOAT getWorldResolution()const {return world_resolution;};
 		point3d_t getCenterOfView()const {return render_camera->position();};
+		camera_t *getCamera()const {return render_camera;};
 		PFLOAT getAspectRatio()const 
 			{return (PFLOAT)(render_camera->resX())/(PFLOAT)(render_camera->resY());};
 
@@ -202,6 +264,9 @@ class YAFRAYCORE_EXPORT scene_t
 		light_iterator lightsEnd() {return light_list.end();};
 		const_light_iterator lightsEnd()const {return light_list.end();};
 
+		/// Key of the scene geometry, used to validate precomputed data caches
+		void hashGeometry(keyHash_t &h)const;
+
 		void publishVoidData(const std::string &key,const void *data);
 
 		template<class T>
@@ -220,6 +285,21 @@ class YAFRAYCORE_EXPORT scene_t
 	protected:
 		scene_t();
 		scene_t(const scene_t &s) {}; //forbiden
+		void buildLightTree();
+		/// Closest hit along the ray from f, any object
+		bool closestHit(renderState_t &state,surfacePoint_t &sp,const point3d_t &f,
+				const vector3d_t &ray)const;
+		/// The two ends of raytrace(), for a hit from "from" and for a miss
+		color_t shadeHit(renderState_t &state,surfacePoint_t &sp,const point3d_t &from)const;
+		color_t shadeMiss(renderState_t &state,const vector3d_t &ray)const;
+		/// Traces a camera ray, false with its color when there is nothing to defer
+		bool deferRay(renderState_t &state,const vector3d_t &ray,deferredHit_t &hit,
+				colorA_t &col)const;
+		/// Shades the hits, into the area for the first pass or else adding to acc
+		void shadeDeferred(renderState_t &state,std::vector<deferredHit_t> &hits,
+				renderArea_t &area,colorA_t *acc)const;
+		color_t adaptiveLight(renderState_t &state,const surfacePoint_t &sp,const vector3d_t &eye,
+				const std::list<light_t *> &lights,bool indirect)const;
 
 		camera_t *render_camera;
 		int cpus;
@@ -227,6 +307,14 @@ class YAFRAYCORE_EXPORT scene_t
 		PFLOAT world_resolution;
 		std::list<object3d_t *> obj_list;
 		std::list<light_t *> light_list;
+		/// Lights left out of the light tree, always evaluated
+		std::list<light_t *> free_lights;
+		lightTree_t *light_tree;
+		int light_samples;
+		PFLOAT shadow_threshold;
+		bool ray_differentials;
+		bool deferred;
+		shadowTests_t *_shadowtests;
 		std::list<filter_t *> filter_list;
 		light_t *radio_light;
 		int maxraylevel;
@@ -152,6 +152,13 @@ class YAFRAYCORE_EXPORT shader_t
 		virtual bool discrete()const {return false;};
 		virtual bool isRGB() const { return true; }
 		virtual void getDispersion(PFLOAT &disp_pw, PFLOAT &A, PFLOAT &B, color_t &beer) const { disp_pw=A=B=0;  beer.black(); }
+		/** Appends the shader inputs this one reads.
+		 *
+		 * The pointers are the members themselves, so the node graph can be
+		 * rewired after loading. NULL inputs may be included.
+		 * @see shaderGraph_t
+		 */
+		virtual void getInputs(std::vector<const shader_t **> &in) {}
 };
 
 #define FACE_FORWARD(Ng,N,I) ((((Ng)*(I))<0) ? (-N) : (N))
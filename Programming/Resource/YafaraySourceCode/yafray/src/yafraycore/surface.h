@@ -79,10 +79,11 @@ class YAFRAYCORE_EXPORT surfacePoint_t
 			suNd = n;	// unmodified normal (not displaced)
 			dudu = dudv = dvdu = dvdv = 0;
 			originelement=NULL;
+			fprint = 0;
 		}
 
 		///An empty constructor
-		surfacePoint_t() { hasorco=false;hasuv=false;  has_vcol=false;  shader=NULL; originelement=NULL; }
+		surfacePoint_t() { hasorco=false;hasuv=false;  has_vcol=false;  shader=NULL; originelement=NULL;  fprint=0; }
 		/// Destructor
 		~surfacePoint_t() {}
 
@@ -155,6 +156,13 @@ class YAFRAYCORE_EXPORT surfacePoint_t
 	
 		void setOrigin(const void *it) {originelement=it;};
 		const void *getOrigin()const {return originelement;};
+
+		/** Width of the area seen around the point by the ray that found it,
+		 * in world units, or in texture units once a mapper has put texture
+		 * coords in P. 0 when unknown, textures are not filtered then.
+		 */
+		PFLOAT footprint() const { return fprint; }
+		void setFootprint(PFLOAT w) { fprint=w; }
 	protected:
 		/// The surface normal
 		vector3d_t suN, suNU, suNV, suTU, suTV, suNd;
@@ -177,6 +185,7 @@ class YAFRAYCORE_EXPORT surfacePoint_t
 		// vertex color
 		color_t vtxcol;
 		const void *originelement;
+		PFLOAT fprint;
 };
 
 __END_YAFRAY
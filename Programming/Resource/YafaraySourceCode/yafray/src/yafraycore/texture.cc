@@ -91,6 +91,43 @@ void spheremap(const point3d_t &p, PFLOAT &u, PFLOAT &v)
 	}
 }
 
+static void moveFootprint(const surfacePoint_t &sp, surfacePoint_t &to, const vector3d_t &dir,
+		GFLOAT dudir, GFLOAT dvdir)
+{
+	PFLOAT w = sp.footprint();
+	to = sp;
+	to.P() = sp.P() + dir*w;
+	to.u() = sp.u() + dudir*w;
+	to.v() = sp.v() + dvdir*w;
+	if (sp.hasOrco() && (sp.getObject()!=NULL))
+		to.orco() = sp.orco() + (sp.getObject()->toObjectOrco(to.P()) - sp.getObject()->toObjectOrco(sp.P()));
+}
+
+bool footprintPoints(const surfacePoint_t &sp, surfacePoint_t &spu, surfacePoint_t &spv)
+{
+	if (sp.footprint()<=0) return false;
+	moveFootprint(sp, spu, sp.NU(), sp.dudNU(), sp.dvdNU());
+	moveFootprint(sp, spv, sp.NV(), sp.dudNV(), sp.dvdNV());
+	return true;
+}
+
+static PFLOAT wrapped(PFLOAT d)
+{
+	d = fabs(d);
+	return (d>0.5) ? 1-d : d;
+}
+
+PFLOAT footprintWidth(const point3d_t &t, const point3d_t &tu, const point3d_t &tv, bool wrap)
+{
+	if (wrap) {
+		PFLOAT ux=wrapped(tu.x-t.x), uy=wrapped(tu.y-t.y);
+		PFLOAT vx=wrapped(tv.x-t.x), vy=wrapped(tv.y-t.y);
+		return sqrt(max(ux*ux + uy*uy, vx*vx + vy*vy));
+	}
+	PFLOAT du=(tu-t).length(), dv=(tv-t).length();
+	return max(du, dv);
+}
+
 modulator_t::modulator_t(const texture_t *tex)
 {
 	_color = _specular = _hard = _transmision = _reflection = _displace = 0;
@@ -496,12 +533,18 @@ bool modulator_t::doMapping(const surfacePoint_t &sp, const vector3d_t &eye,
 //------------------------------------------------------------------------------------------
 // modulator
 
+PFLOAT modulator_t::filterWidth(const surfacePoint_t &sp, const vector3d_t &eye, const point3d_t &texpt) const
+{
+	return mappedFootprintWidth(*this, tex_coords, sp, eye, texpt, _tex->discrete());
+}
+
 void modulator_t::modulate(color_t &C, color_t &S, CFLOAT &H, const surfacePoint_t &sp, const vector3d_t &eye) const
 {
 	point3d_t texpt;
 	if (doMapping(sp, eye, texpt)) return;	// doMapping returns true if texture clipped
-	color_t texcolor = _tex->getColor(texpt);
-	CFLOAT texfloat = _tex->getFloat(texpt);
+	PFLOAT width = filterWidth(sp, eye, texpt);
+	color_t texcolor = _tex->getFilteredColor(texpt, width);
+	CFLOAT texfloat = _tex->getFilteredFloat(texpt, width);
 
 	if (_mode==TMO_MIX)
 	{
@@ -537,7 +580,7 @@ void modulator_t::modulate(color_t &T,color_t &R, const surfacePoint_t &sp, cons
 {
 	point3d_t texpt;
 	if (doMapping(sp, eye, texpt)) return;		//returns true if texture clipped
-	color_t texcolor = _tex->getColor(texpt);
+	color_t texcolor = _tex->getFilteredColor(texpt, filterWidth(sp, eye, texpt));
 
 	if(_mode==TMO_MIX)
 	{
@@ -48,9 +48,15 @@ class YAFRAYCORE_EXPORT texture_t
 
 		virtual colorA_t getColor(const point3d_t &p) const { return color_t(0.0); }
 		virtual CFLOAT getFloat(const point3d_t &p) const { return 0; }
+		/** Lookups averaged over a filter of the given width in texture
+		 * space. Only textures that can prefilter (mipmapped images, noise
+		 * octaves) do something with the width.
+		 */
+		virtual colorA_t getFilteredColor(const point3d_t &p, PFLOAT width) const { return getColor(p); }
+		virtual CFLOAT getFilteredFloat(const point3d_t &p, PFLOAT width) const { return getFloat(p); }
 
 		// only used with image backgrounds for SH lighting
-		virtual void preFilter(bool spheremap) {}
+		virtual void preFilter(bool spheremap, int threads=1) {}
 		virtual colorA_t getColorSH(const vector3d_t &n) const { return colorA_t(0.0); }
 		virtual bool has_SH() const { return false; }
 
@@ -195,6 +201,8 @@ class YAFRAYCORE_EXPORT modulator_t
 					point3d_t &texpt) const;
 
 	protected:
+		PFLOAT filterWidth(const surfacePoint_t &sp, const vector3d_t &eye, const point3d_t &texpt) const;
+
 		CFLOAT _color, _specular, _hard, _transmision, _reflection, _displace;
 		GFLOAT _sizex, _sizey, _sizez;	// texture scale factors
 		TEX_MODULATE _mode;
@@ -218,6 +226,28 @@ YAFRAYCORE_EXPORT void angmap(const point3d_t &p, PFLOAT &u, PFLOAT &v);
 YAFRAYCORE_EXPORT void tubemap(const point3d_t &p, PFLOAT &u, PFLOAT &v);
 YAFRAYCORE_EXPORT void spheremap(const point3d_t &p, PFLOAT &u, PFLOAT &v);
 
+// texture filtering
+// copies of sp moved by its footprint along NU and NV, uv and orco moved along,
+// mapped like sp they give the footprint in texture space. false if sp has none
+YAFRAYCORE_EXPORT bool footprintPoints(const surfacePoint_t &sp, surfacePoint_t &spu, surfacePoint_t &spv);
+// filter width from the mapped points, wrap for image coords that repeat in [0, 1]
+YAFRAYCORE_EXPORT PFLOAT footprintWidth(const point3d_t &t, const point3d_t &tu, const point3d_t &tv, bool wrap);
+// filter width at texpt, mapped from sp by m.doMapping() as are the footprint points,
+// shared by modulators and mapper nodes. Only coords that move with the point have
+// a footprint, the window, normal and reflection ones are not filtered
+template<class M>
+PFLOAT mappedFootprintWidth(const M &m, TEX_COORDS coords, const surfacePoint_t &sp,
+		const vector3d_t &eye, const point3d_t &texpt, bool wrap)
+{
+	if ((coords!=TXC_UV) && (coords!=TXC_GLOB) && (coords!=TXC_ORCO)) return 0;
+	surfacePoint_t spu, spv;
+	if (!footprintPoints(sp, spu, spv)) return 0;
+	point3d_t tu, tv;
+	m.doMapping(spu, eye, tu);
+	m.doMapping(spv, eye, tv);
+	return footprintWidth(texpt, tu, tv, wrap);
+}
+
 __END_YAFRAY
 
 #endif
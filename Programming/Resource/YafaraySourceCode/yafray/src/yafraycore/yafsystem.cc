@@ -13,6 +13,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
 
@@ -26,6 +27,7 @@
 #include <dlfcn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #endif
@@ -404,5 +406,16 @@ const std::list<std::string> & listDir(const std::string &dir)
   return lista;
 }
 
+double wallClock()
+{
+#if defined(WIN32)
+	return (double)GetTickCount()*0.001;
+#else
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return (double)tv.tv_sec+(double)tv.tv_usec*0.000001;
+#endif
+}
+
 __END_YAFRAY
 
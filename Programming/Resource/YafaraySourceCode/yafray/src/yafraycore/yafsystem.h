@@ -46,6 +46,10 @@ class YAFRAYCORE_EXPORT sharedlibrary_t
 
 YAFRAYCORE_EXPORT const std::list<std::string> & listDir(const std::string &dir);
 
+/// Wall clock seconds, only meant for differences. Unlike clock() it
+/// does not add up the time of every thread.
+YAFRAYCORE_EXPORT double wallClock();
+
 
 __END_YAFRAY
 